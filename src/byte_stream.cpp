@@ -0,0 +1,95 @@
+#include "byte_stream.h"
+#include <cstring>
+#include <cerrno>
+#include <vector>
+using namespace std;
+
+//------------------------------------------------------------------------------
+// The chunk size used when copying between streams.
+//------------------------------------------------------------------------------
+const size_t COPY_CHUNK = 64 * 1024;
+
+//------------------------------------------------------------------------------
+// String_Source
+//------------------------------------------------------------------------------
+size_t String_Source::read(char* buffer, size_t size)
+    throw(runtime_error) {
+
+    size_t count = min(size, m_bytes.size() - m_pos);
+    memcpy(buffer, m_bytes.data() + m_pos, count);
+    m_pos += count;
+    return count;
+}
+
+//------------------------------------------------------------------------------
+// File_Sink
+//------------------------------------------------------------------------------
+void File_Sink::write(const char* buffer, size_t size)
+    throw(runtime_error) {
+
+    if (fwrite(buffer, 1, size, m_file) != size) {
+        throw runtime_error(string("Failed to write file: ") +
+                            strerror(errno));
+    }
+}
+
+//------------------------------------------------------------------------------
+// Spool
+//------------------------------------------------------------------------------
+Spool::Spool()
+    throw(runtime_error) : m_file(tmpfile()),
+                           m_size(0) {
+
+    if (!m_file) {
+        throw runtime_error(string("Failed to create a temporary file: ") +
+                            strerror(errno));
+    }
+}
+
+Spool::~Spool() {
+    fclose(m_file);
+}
+
+void Spool::write(const char* buffer, size_t size)
+    throw(runtime_error) {
+
+    if (fwrite(buffer, 1, size, m_file) != size) {
+        throw runtime_error(string("Failed to write temporary file: ") +
+                            strerror(errno));
+    }
+    m_size += size;
+}
+
+size_t Spool::read(char* buffer, size_t size)
+    throw(runtime_error) {
+
+    size_t count = fread(buffer, 1, size, m_file);
+    if (count < size && ferror(m_file)) {
+        throw runtime_error(string("Failed to read temporary file: ") +
+                            strerror(errno));
+    }
+    return count;
+}
+
+void Spool::rewind()
+    throw(runtime_error) {
+
+    if (fflush(m_file) != 0 || fseek(m_file, 0, SEEK_SET) != 0) {
+        throw runtime_error(string("Failed to rewind temporary file: ") +
+                            strerror(errno));
+    }
+}
+
+//------------------------------------------------------------------------------
+int64_t copy_bytes(Byte_Source& source, Byte_Sink& sink)
+    throw(runtime_error) {
+
+    vector<char> buffer(COPY_CHUNK);
+    int64_t total = 0;
+    size_t count;
+    while ((count = source.read(&buffer[0], buffer.size())) > 0) {
+        sink.write(&buffer[0], count);
+        total += count;
+    }
+    return total;
+}
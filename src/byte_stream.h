@@ -0,0 +1,147 @@
+#ifndef BYTE_STREAM_H
+#define BYTE_STREAM_H
+
+#include <stdexcept>
+#include <string>
+#include <cstdio>
+#include <stdint.h>
+
+//------------------------------------------------------------------------------
+// A source of bytes read in chunks, so that large content can be passed along
+// without holding all of it in memory.
+//------------------------------------------------------------------------------
+class Byte_Source {
+
+    public:
+        virtual ~Byte_Source() {}
+
+        //----------------------------------------------------------------------
+        // @param buffer Out buffer of at least size bytes.
+        // @return The number of bytes read into buffer; 0 once all bytes have
+        //         been read.
+        // @throw  If the bytes cannot be read.
+        //----------------------------------------------------------------------
+        virtual size_t read(char* buffer, size_t size)
+            throw(std::runtime_error) = 0;
+};
+
+//------------------------------------------------------------------------------
+// A destination of bytes written in chunks.
+//------------------------------------------------------------------------------
+class Byte_Sink {
+
+    public:
+        virtual ~Byte_Sink() {}
+
+        //----------------------------------------------------------------------
+        // @post  The size bytes at buffer are appended to the sink.
+        // @throw If the bytes cannot be written.
+        //----------------------------------------------------------------------
+        virtual void write(const char* buffer, size_t size)
+            throw(std::runtime_error) = 0;
+};
+
+//------------------------------------------------------------------------------
+// Reads the bytes of a string, which must outlive the source.
+//------------------------------------------------------------------------------
+class String_Source : public Byte_Source {
+
+    public:
+        String_Source(const std::string& bytes) : m_bytes(bytes), m_pos(0) {}
+
+        virtual size_t read(char* buffer, size_t size)
+            throw(std::runtime_error);
+
+    private:
+        const std::string& m_bytes;
+        size_t             m_pos;
+};
+
+//------------------------------------------------------------------------------
+// Appends the bytes written to a string.
+//------------------------------------------------------------------------------
+class String_Sink : public Byte_Sink {
+
+    public:
+        String_Sink(std::string& bytes) : m_bytes(bytes) {}
+
+        virtual void write(const char* buffer, size_t size)
+            throw(std::runtime_error) {
+            m_bytes.append(buffer, size);
+        }
+
+    private:
+        std::string& m_bytes;
+};
+
+//------------------------------------------------------------------------------
+// Writes the bytes to an open stdio stream (which is not closed).
+//------------------------------------------------------------------------------
+class File_Sink : public Byte_Sink {
+
+    public:
+        File_Sink(FILE* file) : m_file(file) {}
+
+        virtual void write(const char* buffer, size_t size)
+            throw(std::runtime_error);
+
+    private:
+        FILE* m_file;
+};
+
+//------------------------------------------------------------------------------
+// A temporary file, written as a sink and then read back as a source. Used to
+// buffer content of unknown size (such as a cipher being produced) on disk
+// rather than in memory, e.g. before it is stored as a BLOB of fixed size.
+// The file is deleted when the spool is destroyed.
+//------------------------------------------------------------------------------
+class Spool : public Byte_Source, public Byte_Sink {
+
+    public:
+        //----------------------------------------------------------------------
+        // @throw If the temporary file cannot be created.
+        //----------------------------------------------------------------------
+        Spool()
+            throw(std::runtime_error);
+
+        ~Spool();
+
+        //----------------------------------------------------------------------
+        // @pre   rewind() has not been called since the last write.
+        //----------------------------------------------------------------------
+        virtual void write(const char* buffer, size_t size)
+            throw(std::runtime_error);
+
+        //----------------------------------------------------------------------
+        // @pre   rewind() has been called after the last write.
+        //----------------------------------------------------------------------
+        virtual size_t read(char* buffer, size_t size)
+            throw(std::runtime_error);
+
+        //----------------------------------------------------------------------
+        // @post  The next read() starts from the first byte written.
+        //----------------------------------------------------------------------
+        void rewind()
+            throw(std::runtime_error);
+
+        //----------------------------------------------------------------------
+        // @return The number of bytes written.
+        //----------------------------------------------------------------------
+        int64_t size() const { return m_size; }
+
+    private:
+        Spool(const Spool&);
+        Spool& operator=(const Spool&);
+
+        FILE*   m_file;
+        int64_t m_size;
+};
+
+//------------------------------------------------------------------------------
+// Copies all bytes of the source to the sink, a chunk at a time.
+// @return The number of bytes copied.
+//------------------------------------------------------------------------------
+int64_t copy_bytes(Byte_Source& source, Byte_Sink& sink)
+    throw(std::runtime_error);
+
+#endif
@@ -0,0 +1,16 @@
+#ifndef CLOCK_H
+#define CLOCK_H
+
+#include <sys/time.h>
+#include <stdint.h>
+
+//------------------------------------------------------------------------------
+// @return The current time in microseconds since the epoch.
+//------------------------------------------------------------------------------
+inline int64_t epoch_usec() {
+    timeval tv;
+    gettimeofday(&tv, 0);
+    return static_cast<int64_t>(tv.tv_sec) * 1000000 + tv.tv_usec;
+}
+
+#endif
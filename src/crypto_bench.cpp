@@ -0,0 +1,189 @@
+#include "gpgme_wrapper.h"
+#include "test_keyring.h"
+#include "thread_pool.h"
+#include "clock.h"
+#include <algorithm>
+#include <iostream>
+#include <cstdlib>
+#include <stdint.h>
+using namespace std;
+
+//------------------------------------------------------------------------------
+// Payload sizes, and the plain text bytes each case encrypts in total (within
+// MIN_RUNS and MAX_RUNS operations).
+//------------------------------------------------------------------------------
+const size_t SIZES[]      = { 100, 1000, 10000, 100000, 1000000, 10000000 };
+const size_t CASE_BYTES   = 32 * 1000 * 1000;
+const size_t MIN_RUNS     = 3;
+const size_t MAX_RUNS     = 200;
+const size_t THREADS      = 4;
+
+//------------------------------------------------------------------------------
+// One thread's share of a case: encrypts the payload runs times into ciphers,
+// or decrypts the ciphers and checks that the payload comes back, timing each
+// operation.
+//------------------------------------------------------------------------------
+class Crypto_Run : public Thread_Pool::Task {
+
+    public:
+        Crypto_Run(GPGME_Wrapper& g, const string& k, const string& p,
+                   size_t r) : gpg(g), key(k), payload(p), runs(r),
+                               decrypting(false) {}
+
+        virtual void run() {
+            usec.clear();
+            ciphers.resize(runs);
+            for (size_t i = 0; i < runs; ++i) {
+                int64_t start = epoch_usec();
+                if (decrypting) {
+                    if (gpg.decrypt(ciphers[i]) != payload) {
+                        throw runtime_error("Decrypted text differs");
+                    }
+                }
+                else {
+                    ciphers[i] = gpg.encrypt(payload, key);
+                }
+                usec.push_back(epoch_usec() - start);
+            }
+        }
+
+        GPGME_Wrapper&  gpg;
+        const string&   key;
+        const string&   payload;
+        size_t          runs;
+        bool            decrypting;
+        vector<string>  ciphers;
+        vector<int64_t> usec;       // Latency of each operation
+};
+
+//------------------------------------------------------------------------------
+// @return A payload of pseudo random bytes, which GnuPG cannot compress.
+//------------------------------------------------------------------------------
+string make_payload(size_t size) {
+    string payload(size, '\0');
+    uint32_t state = 2463534242u;
+    for (size_t i = 0; i < size; ++i) {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        payload[i] = static_cast<char>(state);
+    }
+    return payload;
+}
+
+//------------------------------------------------------------------------------
+// Runs one phase (encryption or decryption) of a case on all runs at once and
+// writes its NDJSON result.
+//------------------------------------------------------------------------------
+void run_phase(Thread_Pool& pool, vector<Crypto_Run*>& runs, bool decrypting,
+               bool armor, size_t size) {
+
+    vector<Thread_Pool::Task*> tasks;
+    for (size_t i = 0; i < runs.size(); ++i) {
+        runs[i]->decrypting = decrypting;
+        tasks.push_back(runs[i]);
+    }
+    int64_t start = epoch_usec();
+    pool.run(tasks);
+    int64_t wall = max<int64_t>(epoch_usec() - start, 1);
+
+    vector<int64_t> usec;
+    size_t cipher_bytes = 0;
+    for (size_t i = 0; i < runs.size(); ++i) {
+        usec.insert(usec.end(), runs[i]->usec.begin(), runs[i]->usec.end());
+        cipher_bytes += runs[i]->ciphers[0].size();
+    }
+    sort(usec.begin(), usec.end());
+
+    double bytes = static_cast<double>(size) * usec.size();
+    cout << "{\"op\":\""     << (decrypting ? "decrypt" : "encrypt") << "\""
+         << ",\"size\":"     << size
+         << ",\"armor\":"    << (armor ? "true" : "false")
+         << ",\"threads\":"  << runs.size()
+         << ",\"runs\":"     << usec.size()
+         << ",\"cipher\":"   << cipher_bytes / runs.size()
+         << ",\"mb_per_sec\":" << bytes / wall
+         << ",\"ops_per_sec\":" << usec.size() * 1e6 / wall
+         << ",\"p50_usec\":" << usec[usec.size() / 2]
+         << ",\"p99_usec\":" << usec[(usec.size() * 99) / 100]
+         << ",\"max_usec\":" << usec.back()
+         << "}" << endl;
+}
+
+//------------------------------------------------------------------------------
+// Encrypts and then decrypts the payload with one wrapper per thread, the
+// runs of the case shared out evenly.
+//------------------------------------------------------------------------------
+void run_case(Thread_Pool& pool, vector<GPGME_Wrapper*>& wrappers,
+              size_t threads, const string& key, const string& payload,
+              bool armor) {
+
+    size_t runs = max(MIN_RUNS, min(MAX_RUNS, CASE_BYTES / payload.size()));
+    vector<Crypto_Run*> tasks;
+    for (size_t i = 0; i < threads; ++i) {
+        wrappers[i]->set_armor(armor);
+        tasks.push_back(new Crypto_Run(*wrappers[i], key, payload,
+                                       (runs + threads - 1) / threads));
+    }
+    try {
+        run_phase(pool, tasks, false, armor, payload.size());
+        run_phase(pool, tasks, true,  armor, payload.size());
+    }
+    catch (...) {
+        for (size_t i = 0; i < tasks.size(); ++i) {
+            delete tasks[i];
+        }
+        throw;
+    }
+    for (size_t i = 0; i < tasks.size(); ++i) {
+        delete tasks[i];
+    }
+}
+
+//------------------------------------------------------------------------------
+// Benchmarks GPGME_Wrapper encryption and decryption against a throwaway
+// keyring: every payload size, armored and binary, on one thread and on
+// THREADS threads (or as many as given on the command line). Writes one NDJSON
+// result per phase; exits with 1 if a round trip fails.
+//------------------------------------------------------------------------------
+int main(int argc, char** argv) {
+    size_t threads = argc > 1 ? atoi(argv[1]) : THREADS;
+    if (argc > 2 || threads < 1) {
+        cout << "Usage: " << argv[0] << " [THREADS]" << endl;
+        return 1;
+    }
+    vector<GPGME_Wrapper*> wrappers;
+    int rv = 0;
+    try {
+        Test_Keyring keyring;
+        try {
+            for (size_t i = 0; i < threads; ++i) {
+                wrappers.push_back(new GPGME_Wrapper);
+            }
+            string key = wrappers[0]->all_keys().at(0);
+            Thread_Pool pool(threads);
+
+            for (size_t i = 0; i < sizeof(SIZES) / sizeof(SIZES[0]); ++i) {
+                string payload = make_payload(SIZES[i]);
+                for (int armor = 1; armor >= 0; --armor) {
+                    run_case(pool, wrappers, 1, key, payload, armor);
+                    if (threads > 1) {
+                        run_case(pool, wrappers, threads, key, payload, armor);
+                    }
+                }
+            }
+        }
+        catch (const exception& e) {
+            cout << "{\"error\":\"" << e.what() << "\"}" << endl;
+            rv = 1;
+        }
+        for (size_t i = 0; i < wrappers.size(); ++i) {
+            delete wrappers[i];
+        }
+    }
+    catch (const exception& e) {
+        cout << "{\"error\":\"" << e.what() << "\"}" << endl;
+        rv = 1;
+    }
+    return rv;
+}
@@ -0,0 +1,431 @@
+#include "encrypting_serializer.h"
+#include <set>
+using namespace std;
+
+//------------------------------------------------------------------------------
+// Decrypts the content of the encrypted Items from index first on.
+//------------------------------------------------------------------------------
+void decrypt_items(GPGME_Wrapper& gpg, vector<Item*>& items, size_t first)
+    throw(runtime_error) {
+
+    for (size_t i = first; i < items.size(); ++i) {
+        if (items[i]->encrypted) {
+            items[i]->content = gpg.decrypt(items[i]->content);
+        }
+    }
+}
+
+//------------------------------------------------------------------------------
+// @return A copy of the Item to be stored, encrypted as the policy says.
+//------------------------------------------------------------------------------
+Item encrypt_item(GPGME_Wrapper& gpg, const Key_Policy& policy, const Item& i)
+    throw(runtime_error) {
+
+    Item stored = i;
+    string key = policy.key(i);
+    stored.encrypted = !key.empty();
+    if (stored.encrypted) {
+        stored.content = gpg.encrypt(i.content, key);
+    }
+    return stored;
+}
+
+//------------------------------------------------------------------------------
+// The crypto stage of a pipelined write: encrypts items [first, last) into
+// the copies to be stored.
+//------------------------------------------------------------------------------
+class Encrypt_Batch : public Thread_Pool::Task {
+
+    public:
+        Encrypt_Batch(GPGME_Wrapper& g, const Key_Policy& p) : gpg(g),
+                                                               policy(p),
+                                                               items(0),
+                                                               first(0),
+                                                               last(0),
+                                                               stored(0) {}
+
+        virtual void run() {
+            stored->clear();
+            for (size_t i = first; i < last; ++i) {
+                stored->push_back(encrypt_item(gpg, policy, *(*items)[i]));
+            }
+        }
+
+        GPGME_Wrapper&          gpg;
+        const Key_Policy&       policy;
+        const vector<Item*>*    items;
+        size_t                  first;
+        size_t                  last;
+        vector<Item>*           stored;
+};
+
+//------------------------------------------------------------------------------
+// The I/O stage of a pipelined write: writes the stored copies of items
+// [first, first + stored.size()) in a batch of their own (unless nested in an
+// open one), handing the ids and timestamps back to the items as they are
+// written. A batch failing to write or commit is rolled back, and the items
+// then get back the ids and timestamps they had.
+//------------------------------------------------------------------------------
+class Write_Batch : public Thread_Pool::Task {
+
+    public:
+        explicit Write_Batch(Serializer& s) : db(s), items(0), first(0),
+                                              stored(0), nested(false) {}
+
+        virtual void run() {
+            if (!nested) {
+                db.begin_batch();
+            }
+            vector<Item> saved;
+            try {
+                for (size_t i = 0; i < stored->size(); ++i) {
+                    Item& item = *(*items)[first + i];
+                    saved.push_back(Item());
+                    saved.back().id        = item.id;
+                    saved.back().timestamp = item.timestamp;
+                    saved.back().encrypted = item.encrypted;
+                    db.write((*stored)[i]);
+                    item.id        = (*stored)[i].id;
+                    item.timestamp = (*stored)[i].timestamp;
+                    item.encrypted = (*stored)[i].encrypted;
+                }
+                if (!nested) {
+                    db.commit_batch();
+                }
+            }
+            catch (...) {
+                if (!nested) {
+                    restore(saved);
+                    db.rollback_batch();
+                }
+                throw;
+            }
+        }
+
+        // Hands the items written back the fields they had before the batch
+        void restore(const vector<Item>& saved) {
+            for (size_t i = 0; i < saved.size(); ++i) {
+                Item& item = *(*items)[first + i];
+                item.id        = saved[i].id;
+                item.timestamp = saved[i].timestamp;
+                item.encrypted = saved[i].encrypted;
+            }
+        }
+
+        Serializer&             db;
+        const vector<Item*>*    items;
+        size_t                  first;
+        vector<Item>*           stored;
+        bool                    nested;
+};
+
+//------------------------------------------------------------------------------
+// A batch of a pipelined read by id; owns the Items read until they are
+// handed to the caller.
+//------------------------------------------------------------------------------
+struct Id_Batch {
+    vector<int>   ids;
+    vector<Item*> items;
+
+    ~Id_Batch() {
+        for (size_t i = 0; i < items.size(); ++i) {
+            delete items[i];
+        }
+    }
+};
+
+//------------------------------------------------------------------------------
+// The I/O stage of a pipelined read by id.
+//------------------------------------------------------------------------------
+class Fetch_Batch : public Thread_Pool::Task {
+
+    public:
+        Fetch_Batch(Serializer& s, Id_Batch& b) : db(s), batch(b) {}
+
+        virtual void run() {
+            db.read_by_id(batch.ids, batch.items);
+        }
+
+        Serializer& db;
+        Id_Batch&   batch;
+};
+
+//------------------------------------------------------------------------------
+// The crypto stage of a pipelined read by id.
+//------------------------------------------------------------------------------
+class Decrypt_Batch : public Thread_Pool::Task {
+
+    public:
+        Decrypt_Batch(GPGME_Wrapper& g, Id_Batch& b) : gpg(g), batch(b) {}
+
+        virtual void run() {
+            decrypt_items(gpg, batch.items, 0);
+        }
+
+        GPGME_Wrapper& gpg;
+        Id_Batch&      batch;
+};
+
+//------------------------------------------------------------------------------
+// Ctor
+//------------------------------------------------------------------------------
+Encrypting_Serializer::Encrypting_Serializer(Serializer& db,
+                                             GPGME_Wrapper& gpg,
+                                             const Key_Policy& policy,
+                                             size_t batch_size)
+    throw(runtime_error) : m_db(db),
+                           m_gpg(gpg),
+                           m_policy(policy),
+                           m_batch_size(batch_size ? batch_size : 1),
+                           m_batch(false),
+                           m_pool(2) {
+}
+
+//------------------------------------------------------------------------------
+// Decrypts the Items read from index first on. On failure the Items read are
+// deleted, so that the caller is not left with cipher text.
+//------------------------------------------------------------------------------
+void Encrypting_Serializer::decrypt(vector<Item*>& items, size_t first)
+    throw(runtime_error) {
+
+    try {
+        decrypt_items(m_gpg, items, first);
+    }
+    catch (...) {
+        for (size_t i = first; i < items.size(); ++i) {
+            delete items[i];
+        }
+        items.resize(first);
+        throw;
+    }
+}
+
+//------------------------------------------------------------------------------
+void Encrypting_Serializer::write(Item& i)
+    throw(runtime_error) {
+
+    Item stored = encrypt_item(m_gpg, m_policy, i);
+    m_db.write(stored);
+    i.id        = stored.id;
+    i.timestamp = stored.timestamp;
+    i.encrypted = stored.encrypted;
+}
+
+//------------------------------------------------------------------------------
+// The first batch is encrypted on its own; from then on each batch is written
+// while the next one is being encrypted.
+//------------------------------------------------------------------------------
+void Encrypting_Serializer::write(vector<Item*>& items)
+    throw(runtime_error) {
+
+    vector<Item> stored[2];
+    Encrypt_Batch encrypting(m_gpg, m_policy);
+    Write_Batch   writing(m_db);
+    encrypting.items = writing.items = &items;
+    writing.nested   = m_batch;
+
+    encrypting.first  = 0;
+    encrypting.last   = min(m_batch_size, items.size());
+    encrypting.stored = &stored[0];
+    encrypting.run();
+
+    for (size_t first = 0, k = 0; first < items.size();
+         first += m_batch_size, ++k) {
+
+        vector<Thread_Pool::Task*> tasks;
+        writing.first  = first;
+        writing.stored = &stored[k % 2];
+        tasks.push_back(&writing);
+
+        size_t next = first + m_batch_size;
+        if (next < items.size()) {
+            encrypting.first  = next;
+            encrypting.last   = min(next + m_batch_size, items.size());
+            encrypting.stored = &stored[(k + 1) % 2];
+            tasks.push_back(&encrypting);
+        }
+        m_pool.run(tasks);
+    }
+}
+
+//------------------------------------------------------------------------------
+void Encrypting_Serializer::read(const vector<string>& tags,
+                                 vector<Item*>& items)
+    throw(runtime_error) {
+
+    size_t first = items.size();
+    m_db.read(tags, items);
+    decrypt(items, first);
+}
+
+//------------------------------------------------------------------------------
+void Encrypting_Serializer::query(const Query& q, vector<Item*>& items)
+    throw(runtime_error) {
+
+    size_t first = items.size();
+    m_db.query(q, items);
+    decrypt(items, first);
+}
+
+//------------------------------------------------------------------------------
+// Repeated ids are dropped up front, as they would only be skipped within a
+// batch. Each batch is decrypted while the next one is being read.
+//------------------------------------------------------------------------------
+void Encrypting_Serializer::read_by_id(const vector<int>& ids,
+                                       vector<Item*>& items)
+    throw(runtime_error) {
+
+    vector<int> unique;
+    set<int> seen;
+    for (size_t i = 0; i < ids.size(); ++i) {
+        if (seen.insert(ids[i]).second) {
+            unique.push_back(ids[i]);
+        }
+    }
+
+    size_t returned = items.size();
+    Id_Batch batches[2];
+    try {
+        batches[0].ids.assign(unique.begin(), 
+                              unique.begin() + min(m_batch_size, unique.size()));
+        Fetch_Batch(m_db, batches[0]).run();
+
+        for (size_t first = 0, k = 0; first < unique.size();
+             first += m_batch_size, ++k) {
+
+            Id_Batch& current = batches[k % 2];
+            Id_Batch& next    = batches[(k + 1) % 2];
+            Decrypt_Batch decrypting(m_gpg, current);
+            Fetch_Batch   fetching(m_db, next);
+
+            vector<Thread_Pool::Task*> tasks;
+            tasks.push_back(&decrypting);
+
+            size_t next_first = first + m_batch_size;
+            if (next_first < unique.size()) {
+                next.ids.assign(unique.begin() + next_first,
+                                unique.begin() + min(next_first + m_batch_size,
+                                                     unique.size()));
+                tasks.push_back(&fetching);
+            }
+            m_pool.run(tasks);
+
+            items.insert(items.end(), current.items.begin(),
+                         current.items.end());
+            current.items.clear();
+        }
+    }
+    catch (...) {
+        for (size_t i = returned; i < items.size(); ++i) {
+            delete items[i];
+        }
+        items.resize(returned);
+        throw;
+    }
+}
+
+//------------------------------------------------------------------------------
+void Encrypting_Serializer::find_by_title(const string& title,
+                                          vector<Item*>& items)
+    throw(runtime_error) {
+
+    size_t first = items.size();
+    m_db.find_by_title(title, items);
+    decrypt(items, first);
+}
+
+//------------------------------------------------------------------------------
+void Encrypting_Serializer::read_range(int64_t from, int64_t to,
+                                       vector<Item*>& items)
+    throw(runtime_error) {
+
+    size_t first = items.size();
+    m_db.read_range(from, to, items);
+    decrypt(items, first);
+}
+
+//------------------------------------------------------------------------------
+void Encrypting_Serializer::read_recent(const vector<string>& tags,
+                                        size_t limit,
+                                        vector<Item*>& items)
+    throw(runtime_error) {
+
+    size_t first = items.size();
+    m_db.read_recent(tags, limit, items);
+    decrypt(items, first);
+}
+
+//------------------------------------------------------------------------------
+void Encrypting_Serializer::begin_batch()
+    throw(runtime_error) {
+
+    m_db.begin_batch();
+    m_batch = true;
+}
+
+//------------------------------------------------------------------------------
+void Encrypting_Serializer::commit_batch()
+    throw(runtime_error) {
+
+    m_batch = false;
+    m_db.commit_batch();
+}
+
+//------------------------------------------------------------------------------
+void Encrypting_Serializer::rollback_batch()
+    throw(runtime_error) {
+
+    m_batch = false;
+    m_db.rollback_batch();
+}
+
+//------------------------------------------------------------------------------
+void Encrypting_Serializer::trash(const Item& i)
+    throw(runtime_error) {
+
+    m_db.trash(i);
+}
+
+//------------------------------------------------------------------------------
+long Encrypting_Serializer::count(const vector<string>& tags, Tag_Match mode)
+    throw(runtime_error) {
+
+    return m_db.count(tags, mode);
+}
+
+//------------------------------------------------------------------------------
+bool Encrypting_Serializer::exists(const vector<string>& tags)
+    throw(runtime_error) {
+
+    return m_db.exists(tags);
+}
+
+//------------------------------------------------------------------------------
+void Encrypting_Serializer::tags(vector<string>& tags)
+    throw(runtime_error) {
+
+    m_db.tags(tags);
+}
+
+//------------------------------------------------------------------------------
+void Encrypting_Serializer::complete_tags(const string& prefix, size_t limit,
+                                          vector<string>& tags)
+    throw(runtime_error) {
+
+    m_db.complete_tags(prefix, limit, tags);
+}
+
+//------------------------------------------------------------------------------
+long Encrypting_Serializer::tag_count(const string& tag)
+    throw(runtime_error) {
+
+    return m_db.tag_count(tag);
+}
+
+//------------------------------------------------------------------------------
+void Encrypting_Serializer::facets(const vector<string>& tags,
+                                   vector<Tag_Count>& counts)
+    throw(runtime_error) {
+
+    m_db.facets(tags, counts);
+}
@@ -0,0 +1,175 @@
+#ifndef ENCRYPTING_SERIALIZER_H
+#define ENCRYPTING_SERIALIZER_H
+
+#include "recap.h"
+#include "gpgme_wrapper.h"
+#include "thread_pool.h"
+
+//------------------------------------------------------------------------------
+// Decides which Items are stored encrypted, and with which key.
+//------------------------------------------------------------------------------
+class Key_Policy {
+
+    public:
+        virtual ~Key_Policy() {}
+
+        //----------------------------------------------------------------------
+        // @return The id of the key (as listed by GPGME_Wrapper::all_keys())
+        //         to encrypt the Item with, or an empty string to store the
+        //         Item in plain text.
+        //----------------------------------------------------------------------
+        virtual std::string key(const Item& i) const = 0;
+};
+
+//------------------------------------------------------------------------------
+// Encrypts the Items flagged encrypted, or all Items, with a single key.
+//------------------------------------------------------------------------------
+class Single_Key_Policy : public Key_Policy {
+
+    public:
+        Single_Key_Policy(const std::string& key, bool all = false)
+            : m_key(key), m_all(all) {}
+
+        virtual std::string key(const Item& i) const {
+            return m_all || i.encrypted ? m_key : std::string();
+        }
+
+    private:
+        std::string m_key;
+        bool        m_all;
+};
+
+//------------------------------------------------------------------------------
+// Serializer decorator encrypting and decrypting Item content on the way to
+// and from another Serializer. Clients only ever see plain text: written
+// Items are encrypted as the key policy says (the encrypted field of the Item
+// is set accordingly), and encrypted Items read are decrypted (keeping the
+// encrypted field set).
+//
+// Several Items written or read by id at once are processed in batches on a
+// pipeline of two threads, so that the next batch is encrypted (decrypted)
+// while the current one is written (read). Each batch is written in a batch
+// of the decorated Serializer (a single transaction with SQLite3_Serializer),
+// unless one was opened through the decorator; the batches are then written
+// as part of it.
+//
+// As the GPGME context of the wrapper is not thread-safe, neither is the
+// decorator; the wrapper must not be used elsewhere while it is in use.
+//------------------------------------------------------------------------------
+class Encrypting_Serializer : public Serializer {
+
+    public:
+
+        //----------------------------------------------------------------------
+        // @param db         The Serializer storing the Items.
+        // @param gpg        The wrapper doing the encryption.
+        // @param policy     The key policy for written Items.
+        // @param batch_size The number of Items per pipelined batch.
+        // @note  db, gpg and policy must outlive the decorator.
+        // @throw If the pipeline threads cannot be started.
+        //----------------------------------------------------------------------
+        Encrypting_Serializer(Serializer& db,
+                              GPGME_Wrapper& gpg,
+                              const Key_Policy& policy,
+                              size_t batch_size = 64)
+            throw(std::runtime_error);
+
+        //----------------------------------------------------------------------
+        // @post  As Serializer::write(); the content of the Item stays plain
+        //        text, its encrypted field tells how it was stored.
+        // @throw If the Item cannot be encrypted or written.
+        //----------------------------------------------------------------------
+        virtual void write(Item& i)
+            throw(std::runtime_error);
+
+        //----------------------------------------------------------------------
+        // @param items The Items to be written.
+        // @post  As write(Item&) for each Item, pipelined in batches.
+        // @throw If an Item cannot be encrypted or written. The batches before
+        //        the failing one are written and the failing one is rolled
+        //        back, unless a batch was opened through the decorator: the
+        //        Items written before the failing one then stay in it, with
+        //        their ids and timestamps set.
+        //----------------------------------------------------------------------
+        void write(std::vector<Item*>& items)
+            throw(std::runtime_error);
+
+        //----------------------------------------------------------------------
+        // Reads as the decorated Serializer, with the Items decrypted. Ids
+        // are read and decrypted in pipelined batches.
+        // @throw If reading or decrypting fails; no Items are returned then.
+        //----------------------------------------------------------------------
+        virtual void read(const std::vector<std::string>& tags,
+                          std::vector<Item*>& items)
+            throw(std::runtime_error);
+
+        virtual void query(const Query& q, std::vector<Item*>& items)
+            throw(std::runtime_error);
+
+        virtual void read_by_id(const std::vector<int>& ids,
+                                std::vector<Item*>& items)
+            throw(std::runtime_error);
+
+        virtual void find_by_title(const std::string& title,
+                                   std::vector<Item*>& items)
+            throw(std::runtime_error);
+
+        virtual void read_range(int64_t from, int64_t to,
+                                std::vector<Item*>& items)
+            throw(std::runtime_error);
+
+        virtual void read_recent(const std::vector<std::string>& tags,
+                                 size_t limit,
+                                 std::vector<Item*>& items)
+            throw(std::runtime_error);
+
+        //----------------------------------------------------------------------
+        // Passed on to the decorated Serializer unchanged.
+        //----------------------------------------------------------------------
+        virtual void begin_batch()
+            throw(std::runtime_error);
+
+        virtual void commit_batch()
+            throw(std::runtime_error);
+
+        virtual void rollback_batch()
+            throw(std::runtime_error);
+
+        virtual void trash(const Item& i)
+            throw(std::runtime_error);
+
+        virtual long count(const std::vector<std::string>& tags, Tag_Match mode)
+            throw(std::runtime_error);
+
+        virtual bool exists(const std::vector<std::string>& tags)
+            throw(std::runtime_error);
+
+        virtual void tags(std::vector<std::string>& tags)
+            throw(std::runtime_error);
+
+        virtual void complete_tags(const std::string& prefix, size_t limit,
+                                   std::vector<std::string>& tags)
+            throw(std::runtime_error);
+
+        virtual long tag_count(const std::string& tag)
+            throw(std::runtime_error);
+
+        virtual void facets(const std::vector<std::string>& tags,
+                            std::vector<Tag_Count>& counts)
+            throw(std::runtime_error);
+
+    private:
+        Encrypting_Serializer(const Encrypting_Serializer&);
+        Encrypting_Serializer& operator=(const Encrypting_Serializer&);
+
+        void decrypt(std::vector<Item*>&, size_t)   throw(std::runtime_error);
+
+        Serializer&       m_db;
+        GPGME_Wrapper&    m_gpg;
+        const Key_Policy& m_policy;
+        size_t            m_batch_size;
+        bool              m_batch;          // A batch was opened through this
+        Thread_Pool       m_pool;           // One crypto and one I/O stage
+};
+
+#endif
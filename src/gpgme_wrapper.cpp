@@ -1,7 +1,10 @@
 //-----------------------------------------------------------------------------
 #include "gpgme_wrapper.h"
+#include "memory_usage.h"
 //-----------------------------------------------------------------------------
 #include <errno.h>
+#include <cstring>
+#include <algorithm>
 //-----------------------------------------------------------------------------
 using namespace std;
 
@@ -51,9 +54,63 @@ inline string GPGME_Wrapper::gpgme_data2str(const gpgme_data_t buffer)
         m_error = gpgme_err_code_from_errno(errno);
         throw_if_error("Failed to convert data buffer");
     }
+    m_result_peak = max(m_result_peak, rval.capacity());
     return rval;
 }
 
+//-----------------------------------------------------------------------------
+// The state behind a GPGME data object reading a Byte_Source or writing a
+// Byte_Sink. Exceptions cannot pass through GPGME, so the callbacks keep the
+// message and report EIO instead.
+//-----------------------------------------------------------------------------
+struct Stream_Data {
+    Byte_Source* source;
+    Byte_Sink*   sink;
+    string       error;
+
+    Stream_Data(Byte_Source* s, Byte_Sink* k) : source(s), sink(k) {}
+};
+
+ssize_t read_source_cb(void* handle, void* buffer, size_t size) {
+    Stream_Data* data = static_cast<Stream_Data*>(handle);
+    try {
+        return data->source->read(static_cast<char*>(buffer), size);
+    }
+    catch (const exception& e) {
+        data->error = e.what();
+        errno = EIO;
+        return -1;
+    }
+}
+
+ssize_t write_sink_cb(void* handle, const void* buffer, size_t size) {
+    Stream_Data* data = static_cast<Stream_Data*>(handle);
+    try {
+        data->sink->write(static_cast<const char*>(buffer), size);
+        return size;
+    }
+    catch (const exception& e) {
+        data->error = e.what();
+        errno = EIO;
+        return -1;
+    }
+}
+
+gpgme_data_cbs SOURCE_CBS = { read_source_cb, 0, 0, 0 };
+gpgme_data_cbs SINK_CBS   = { 0, write_sink_cb, 0, 0 };
+
+//-----------------------------------------------------------------------------
+// Throws the error of a stream callback, if there was one, in preference to
+// the GPGME error it caused.
+//-----------------------------------------------------------------------------
+inline void throw_if_stream_error(const Stream_Data& data) 
+    throw(runtime_error) {
+
+    if (!data.error.empty()) {
+        throw runtime_error(data.error);
+    }
+}
+
 //-----------------------------------------------------------------------------
 // Creates a human readible string identifying a GPG key
 //-----------------------------------------------------------------------------
@@ -74,7 +131,7 @@ inline string key2str(const gpgme_key_t key) {
 GPGME_Wrapper::GPGME_Wrapper()
     throw(runtime_error)
 
-    : m_context(0) {
+    : m_context(0), m_result_peak(0) {
 
     // TODO: check PGP engine, check GPG Agent 
     // Set locale
@@ -142,6 +199,48 @@ vector<string> GPGME_Wrapper::all_keys() const {
     return rval;
 }
 
+//-----------------------------------------------------------------------------
+void GPGME_Wrapper::set_armor(bool armor) {
+    gpgme_set_armor(m_context, armor ? 1 : 0);
+}
+
+//-----------------------------------------------------------------------------
+// Estimates each cached key from its subkeys and user ids (signatures and
+// other details GPGME keeps are not counted).
+//-----------------------------------------------------------------------------
+size_t estimate_key_bytes(const gpgme_key_t key) {
+    size_t bytes = sizeof(*key) + (key->fpr ? strlen(key->fpr) + 1 : 0);
+    for (gpgme_subkey_t sub = key->subkeys; sub; sub = sub->next) {
+        bytes += sizeof(*sub);
+        bytes += sub->keyid ? strlen(sub->keyid) + 1 : 0;
+        bytes += sub->fpr   ? strlen(sub->fpr)   + 1 : 0;
+    }
+    for (gpgme_user_id_t uid = key->uids; uid; uid = uid->next) {
+        bytes += sizeof(*uid);
+        bytes += uid->uid     ? strlen(uid->uid)     + 1 : 0;
+        bytes += uid->name    ? strlen(uid->name)    + 1 : 0;
+        bytes += uid->email   ? strlen(uid->email)   + 1 : 0;
+        bytes += uid->comment ? strlen(uid->comment) + 1 : 0;
+    }
+    return bytes;
+}
+
+GPGME_Memory GPGME_Wrapper::memory() const {
+    GPGME_Memory memory;
+    memory.keys        = m_keys.size();
+    memory.result_peak = m_result_peak;
+
+    map<string, gpgme_key_t>::const_iterator it = m_keys.begin(), 
+                                            end = m_keys.end();
+    while (it != end) {
+        memory.key_bytes += sizeof(*it) + MAP_NODE_OVERHEAD + 
+                            it->first.capacity() + 
+                            estimate_key_bytes(it->second);
+        ++it;
+    }
+    return memory;
+}
+
 //-----------------------------------------------------------------------------
 // Prepare GPGME data types and encrypt the plain text with the given key
 // TODO: Refactor long method
@@ -221,3 +320,81 @@ string GPGME_Wrapper::decrypt(const string& cipher)
         throw;
     }
 }
+
+//-----------------------------------------------------------------------------
+// Encrypts the source into the sink through GPGME data callbacks.
+//-----------------------------------------------------------------------------
+void GPGME_Wrapper::encrypt(Byte_Source& plaintext, 
+                            const string& key,
+                            Byte_Sink& cipher) 
+    throw (runtime_error) {
+
+    Stream_Data in(&plaintext, 0), out(0, &cipher);
+    gpgme_data_t input = 0, output = 0;
+    try {
+        if (m_keys.find(key) == m_keys.end()) {
+            throw runtime_error("Invalid key: " + key);
+        }
+        gpgme_key_t inkey[] = { m_keys[key], NULL };
+
+        m_error = gpgme_data_new_from_cbs(&input, &SOURCE_CBS, &in);
+        throw_if_error("Failed to prepare plain text for encryption");
+
+        m_error = gpgme_data_new_from_cbs(&output, &SINK_CBS, &out);
+        throw_if_error("Failed to prepare cipher buffer");
+
+        m_error = gpgme_op_encrypt(
+            m_context, 
+            inkey, 
+            GPGME_ENCRYPT_ALWAYS_TRUST,
+            input,
+            output
+        );
+        throw_if_stream_error(in);
+        throw_if_stream_error(out);
+        throw_if_error("Failed to encrypt the plain text");
+
+        gpgme_encrypt_result_t result = gpgme_op_encrypt_result(m_context);
+        if (result->invalid_recipients) {
+            throw runtime_error("Encryption failed (invalid recipient "
+                                "for the given key).");
+        }
+        gpgme_data_release(input);
+        gpgme_data_release(output);
+    }
+    catch (const exception&) {
+        if (input)  gpgme_data_release(input);
+        if (output) gpgme_data_release(output);
+        throw;
+    }
+}
+
+//-----------------------------------------------------------------------------
+// Decrypts the source into the sink through GPGME data callbacks.
+//-----------------------------------------------------------------------------
+void GPGME_Wrapper::decrypt(Byte_Source& cipher, Byte_Sink& plaintext) 
+    throw (runtime_error) {
+
+    Stream_Data in(&cipher, 0), out(0, &plaintext);
+    gpgme_data_t input = 0, output = 0;
+    try {
+        m_error = gpgme_data_new_from_cbs(&input, &SOURCE_CBS, &in);
+        throw_if_error("Failed to prepare cipher buffer");
+
+        m_error = gpgme_data_new_from_cbs(&output, &SINK_CBS, &out);
+        throw_if_error("Failed to prepare plain text buffer");
+
+        m_error = gpgme_op_decrypt(m_context, input, output);
+        throw_if_stream_error(in);
+        throw_if_stream_error(out);
+        throw_if_error("Failed to decrypt cipher text");
+
+        gpgme_data_release(input);
+        gpgme_data_release(output);
+    }
+    catch (const exception&) {
+        if (input)  gpgme_data_release(input);
+        if (output) gpgme_data_release(output);
+        throw;
+    }
+}
@@ -1,6 +1,7 @@
 #ifndef GPGME_WRAPPER_H
 #define GPGME_WRAPPER_H
 //-----------------------------------------------------------------------------
+#include "byte_stream.h"
 #include <stdexcept>
 #include <gpgme.h>
 #include <vector>
@@ -8,6 +9,18 @@
 #include <map>
 //-----------------------------------------------------------------------------
 
+//-----------------------------------------------------------------------------
+// Memory held by a GPGME_Wrapper, in bytes. Buffers of the string operations
+// are only held during a call, so the largest one is reported instead.
+//-----------------------------------------------------------------------------
+struct GPGME_Memory {
+    size_t keys;            // Cached keys
+    size_t key_bytes;       // The key cache (estimated)
+    size_t result_peak;     // Largest result of encrypt() or decrypt()
+
+    GPGME_Memory() : keys(0), key_bytes(0), result_peak(0) {}
+};
+
 //-----------------------------------------------------------------------------
 // Provides interface for the basic cryptographic needs required to store
 // encrypted strings in the database.
@@ -59,6 +72,37 @@ class GPGME_Wrapper {
         std::string decrypt(const std::string& cipher)
             throw (std::runtime_error);
 
+        //---------------------------------------------------------------------
+        // Streaming variants of encrypt() and decrypt(). GPGME pulls the
+        // input from the source and pushes the output to the sink through
+        // data callbacks, a chunk at a time, so that large texts are
+        // processed in bounded memory.
+        // @throw  If errors occurred in the process, or reading the source
+        //         or writing the sink failed.
+        //---------------------------------------------------------------------
+        void encrypt(Byte_Source& plaintext, 
+                     const std::string& key,
+                     Byte_Sink& cipher)
+            throw (std::runtime_error);
+
+        void decrypt(Byte_Source& cipher, Byte_Sink& plaintext)
+            throw (std::runtime_error);
+
+        //---------------------------------------------------------------------
+        // @param  armor
+        //         Whether ciphers are ASCII armored (the default) or binary.
+        //         Binary ciphers are about a quarter smaller, and may hold
+        //         NUL bytes, which both the string and the streaming calls
+        //         carry through. Decryption takes either.
+        //---------------------------------------------------------------------
+        void set_armor(bool armor);
+
+        //---------------------------------------------------------------------
+        // @return The memory held by the key cache and the largest string
+        //         result so far.
+        //---------------------------------------------------------------------
+        GPGME_Memory memory() const;
+
         ~GPGME_Wrapper();
 
     private:
@@ -68,5 +112,6 @@ class GPGME_Wrapper {
         gpgme_ctx_t                         m_context;
         gpgme_error_t                       m_error;
         std::map<std::string, gpgme_key_t>  m_keys;
+        size_t                              m_result_peak;
 };
 #endif
@@ -0,0 +1,295 @@
+#include "maintenance.h"
+#include "clock.h"
+#include "thread_pool.h"
+#include <sqlite3.h>
+#include <sstream>
+#include <algorithm>
+#include <sys/stat.h>
+using namespace std;
+
+//------------------------------------------------------------------------------
+// Virtual machine instructions between checks of the slice deadline.
+//------------------------------------------------------------------------------
+const int PROGRESS_OPS = 1000;
+
+//------------------------------------------------------------------------------
+// Maintenance_Options
+//------------------------------------------------------------------------------
+Maintenance_Options::Maintenance_Options() : interval(0),
+                                             idle(5000),
+                                             slice(50),
+                                             analyze_changes(0),
+                                             analysis_limit(0),
+                                             wal_bytes(0),
+                                             vacuum_pages(0),
+                                             vacuum_step(64) {
+}
+
+Maintenance_Options Maintenance_Options::background() {
+    Maintenance_Options options;
+    options.interval        = 1000;
+    options.analyze_changes = 10000;
+    options.analysis_limit  = 1000;
+    options.wal_bytes       = 16 * 1024 * 1024;
+    options.vacuum_pages    = 1024;
+    options.vacuum_step     = 128;
+    return options;
+}
+
+//------------------------------------------------------------------------------
+// Tallies the result of a task.
+// @return Whether the task succeeded; if not, the slice is to end.
+//------------------------------------------------------------------------------
+bool tally_task(int rc, uint64_t& completed, Maintenance_Stats& stats) {
+    switch (rc) {
+        case SQLITE_OK:
+            ++completed;
+            return true;
+        case SQLITE_INTERRUPT:
+        case SQLITE_BUSY:
+        case SQLITE_LOCKED:
+            stats.interrupted = 1;
+            return false;
+        default:
+            ++stats.errors;
+            return false;
+    }
+}
+
+//------------------------------------------------------------------------------
+// Ctor: Opens the connection and starts the thread.
+//------------------------------------------------------------------------------
+Maintenance_Scheduler::Maintenance_Scheduler(const string& filename,
+                                             const Maintenance_Options& options)
+    throw(runtime_error) : m_db(0),
+                           m_wal(filename + "-wal"),
+                           m_options(options),
+                           m_incremental(false),
+                           m_deadline(0),
+                           m_stop(false),
+                           m_running(false),
+                           m_yield(false),
+                           m_last(epoch_usec()),
+                           m_total(0),
+                           m_changed(0) {
+
+    if (sqlite3_open_v2(filename.c_str(), &m_db, SQLITE_OPEN_READWRITE,
+                        NULL) != SQLITE_OK) {
+        string error = sqlite3_errmsg(m_db);
+        sqlite3_close(m_db);
+        throw runtime_error(error);
+    }
+    int64_t auto_vacuum = 0;
+    exec("PRAGMA auto_vacuum;", &auto_vacuum);
+    m_incremental = auto_vacuum == 2;
+    if (m_options.analysis_limit > 0) {
+        stringstream pragma;
+        pragma << "PRAGMA analysis_limit = " << m_options.analysis_limit << ";";
+        exec(pragma.str().c_str());
+    }
+    sqlite3_progress_handler(m_db, PROGRESS_OPS, progress, this);
+
+    pthread_mutex_init(&m_mutex, NULL);
+    pthread_cond_init(&m_wake, NULL);
+    pthread_cond_init(&m_done, NULL);
+    if (pthread_create(&m_thread, NULL, &Maintenance_Scheduler::main,
+                       this) != 0) {
+        pthread_cond_destroy(&m_done);
+        pthread_cond_destroy(&m_wake);
+        pthread_mutex_destroy(&m_mutex);
+        sqlite3_close(m_db);
+        throw runtime_error("Failed to start the maintenance thread");
+    }
+}
+
+//------------------------------------------------------------------------------
+// Dtor
+//------------------------------------------------------------------------------
+Maintenance_Scheduler::~Maintenance_Scheduler() {
+    stop();
+    pthread_cond_destroy(&m_done);
+    pthread_cond_destroy(&m_wake);
+    pthread_mutex_destroy(&m_mutex);
+    sqlite3_close(m_db);
+}
+
+//------------------------------------------------------------------------------
+// Ends the current slice at once and joins the thread.
+//------------------------------------------------------------------------------
+void Maintenance_Scheduler::stop() {
+    {
+        Mutex_Lock lock(m_mutex);
+        m_stop = m_yield = true;
+        if (m_running) {
+            sqlite3_interrupt(m_db);
+        }
+        pthread_cond_signal(&m_wake);
+    }
+    pthread_join(m_thread, NULL);
+}
+
+//------------------------------------------------------------------------------
+// The changes are counted from the totals, so that only one call per
+// statement is needed.
+//------------------------------------------------------------------------------
+void Maintenance_Scheduler::touch(int total_changes) {
+    Mutex_Lock lock(m_mutex);
+    m_last = epoch_usec();
+    m_changed += static_cast<unsigned int>(total_changes) -
+                 static_cast<unsigned int>(m_total);
+    m_total = total_changes;
+    if (m_running) {
+        m_yield = true;
+        sqlite3_interrupt(m_db);
+        while (m_running) {
+            pthread_cond_wait(&m_done, &m_mutex);
+        }
+    }
+}
+
+//------------------------------------------------------------------------------
+Maintenance_Stats Maintenance_Scheduler::stats() const {
+    Mutex_Lock lock(m_mutex);
+    return m_stats;
+}
+
+//------------------------------------------------------------------------------
+void* Maintenance_Scheduler::main(void* scheduler) {
+    static_cast<Maintenance_Scheduler*>(scheduler)->run();
+    return 0;
+}
+
+//------------------------------------------------------------------------------
+// The thread: wakes up every interval and runs a slice if the database has
+// been idle long enough.
+//------------------------------------------------------------------------------
+void Maintenance_Scheduler::run() {
+    pthread_mutex_lock(&m_mutex);
+    while (!m_stop) {
+        int64_t wake = epoch_usec() + m_options.interval * 1000LL;
+        timespec until;
+        until.tv_sec  = wake / 1000000;
+        until.tv_nsec = (wake % 1000000) * 1000;
+        pthread_cond_timedwait(&m_wake, &m_mutex, &until);
+        if (m_stop || epoch_usec() - m_last < m_options.idle * 1000LL) {
+            continue;
+        }
+
+        int64_t changed = m_changed;
+        m_running = true;
+        m_yield   = false;
+        pthread_mutex_unlock(&m_mutex);
+
+        Maintenance_Stats done;
+        run_slice(changed, done);
+
+        pthread_mutex_lock(&m_mutex);
+        m_running = false;
+        if (done.analyzes) {
+            m_changed -= changed;
+        }
+        m_stats.slices         += done.slices;
+        m_stats.interrupted    += done.interrupted;
+        m_stats.checkpoints    += done.checkpoints;
+        m_stats.analyzes       += done.analyzes;
+        m_stats.vacuumed_pages += done.vacuumed_pages;
+        m_stats.errors         += done.errors;
+        pthread_cond_broadcast(&m_done);
+    }
+    pthread_mutex_unlock(&m_mutex);
+}
+
+//------------------------------------------------------------------------------
+// Runs the due tasks until they are done or the slice is over. A checkpoint
+// is not bounded by the progress handler, but by wal_bytes (and touch()).
+// @param changed The rows changed since the last ANALYZE.
+// @param done    Out counters of the work done.
+//------------------------------------------------------------------------------
+void Maintenance_Scheduler::run_slice(int64_t changed, Maintenance_Stats& done) {
+    m_deadline = epoch_usec() + m_options.slice * 1000LL;
+
+    struct stat wal;
+    if (m_options.wal_bytes > 0 && stat(m_wal.c_str(), &wal) == 0 &&
+        wal.st_size >= m_options.wal_bytes) {
+
+        done.slices = 1;
+        int rc = sqlite3_wal_checkpoint_v2(m_db, NULL,
+                                           SQLITE_CHECKPOINT_TRUNCATE,
+                                           NULL, NULL);
+        if (!tally_task(rc, done.checkpoints, done)) {
+            return;
+        }
+    }
+    if (m_options.analyze_changes > 0 && changed >= m_options.analyze_changes) {
+        if (yielding()) {
+            done.interrupted = 1;
+            return;
+        }
+        done.slices = 1;
+        if (!tally_task(exec("ANALYZE;"), done.analyzes, done)) {
+            return;
+        }
+    }
+    int64_t free_pages = 0;
+    if (!m_incremental || m_options.vacuum_pages <= 0 ||
+        exec("PRAGMA freelist_count;", &free_pages) != SQLITE_OK ||
+        free_pages < m_options.vacuum_pages) {
+        return;
+    }
+    done.slices = 1;
+    while (free_pages > 0) {
+        if (yielding()) {
+            done.interrupted = 1;
+            return;
+        }
+        int64_t pages = min<int64_t>(max(m_options.vacuum_step, 1), free_pages);
+        stringstream pragma;
+        pragma << "PRAGMA incremental_vacuum(" << pages << ");";
+        uint64_t vacuums = 0;
+        if (!tally_task(exec(pragma.str().c_str()), vacuums, done)) {
+            return;
+        }
+        done.vacuumed_pages += pages;
+        free_pages -= pages;
+    }
+}
+
+//------------------------------------------------------------------------------
+// @return Whether the slice is over, by its budget or by touch().
+//------------------------------------------------------------------------------
+bool Maintenance_Scheduler::yielding() {
+    if (epoch_usec() >= m_deadline) {
+        return true;
+    }
+    Mutex_Lock lock(m_mutex);
+    return m_yield;
+}
+
+//------------------------------------------------------------------------------
+// Progress handler: interrupts the statement running past the slice.
+//------------------------------------------------------------------------------
+int Maintenance_Scheduler::progress(void* scheduler) {
+    return epoch_usec() >= static_cast<Maintenance_Scheduler*>(scheduler)->
+                                                               m_deadline;
+}
+
+//------------------------------------------------------------------------------
+// Runs a statement to completion.
+// @param value Out (optional) first column of the first row.
+// @return SQLITE_OK or the error code.
+//------------------------------------------------------------------------------
+int Maintenance_Scheduler::exec(const char* sql, int64_t* value) {
+    sqlite3_stmt* statement;
+    int rc = sqlite3_prepare_v2(m_db, sql, -1, &statement, NULL);
+    if (rc != SQLITE_OK) {
+        return rc;
+    }
+    while ((rc = sqlite3_step(statement)) == SQLITE_ROW) {
+        if (value) {
+            *value = sqlite3_column_int64(statement, 0);
+            value = 0;
+        }
+    }
+    sqlite3_finalize(statement);
+    return rc == SQLITE_DONE ? SQLITE_OK : rc;
+}
@@ -0,0 +1,126 @@
+#ifndef MAINTENANCE_H
+#define MAINTENANCE_H
+
+#include <stdexcept>
+#include <string>
+#include <stdint.h>
+#include <pthread.h>
+struct sqlite3;
+
+//------------------------------------------------------------------------------
+// When and how much background maintenance a SQLite3_Serializer runs. The
+// default constructed options run none.
+//------------------------------------------------------------------------------
+struct Maintenance_Options {
+
+    int     interval;           // Milliseconds between checks for due work
+                                // (0: no maintenance thread)
+    int     idle;               // Milliseconds without statements on the
+                                // serializer before a slice may run
+    int     slice;              // Milliseconds of work per slice
+    int64_t analyze_changes;    // Rows changed that trigger ANALYZE (0: never)
+    int     analysis_limit;     // Rows ANALYZE samples per index (0: all)
+    int64_t wal_bytes;          // WAL file size that triggers a checkpoint
+                                // (0: never)
+    int     vacuum_pages;       // Free pages that trigger an incremental
+                                // vacuum (0: never). New databases are then
+                                // created with auto_vacuum = INCREMENTAL;
+                                // existing ones only after an offline VACUUM
+                                // with that setting.
+    int     vacuum_step;        // Pages freed per statement
+
+    Maintenance_Options();
+
+    //--------------------------------------------------------------------------
+    // Preset for long-running processes: checks every second, runs slices of
+    // 50 ms after 5 s of idleness.
+    //--------------------------------------------------------------------------
+    static Maintenance_Options background();
+};
+
+//------------------------------------------------------------------------------
+// Counters of the maintenance work done so far.
+//------------------------------------------------------------------------------
+struct Maintenance_Stats {
+    uint64_t slices;            // Slices run
+    uint64_t interrupted;       // Slices cut short by the budget or by the
+                                // serializer becoming busy
+    uint64_t checkpoints;       // WAL checkpoints completed
+    uint64_t analyzes;          // ANALYZE runs completed
+    uint64_t vacuumed_pages;    // Free pages returned to the file system
+    uint64_t errors;            // Tasks failed for other reasons
+
+    Maintenance_Stats() : slices(0), interrupted(0), checkpoints(0),
+                          analyzes(0), vacuumed_pages(0), errors(0) {}
+};
+
+//------------------------------------------------------------------------------
+// Runs maintenance tasks on a database from a background thread, through a
+// connection of its own, while the owning serializer is idle:
+//   - a WAL checkpoint (TRUNCATE) once the WAL file has grown past wal_bytes,
+//   - ANALYZE (bounded by analysis_limit) once analyze_changes rows changed,
+//   - PRAGMA incremental_vacuum while vacuum_pages or more pages are free.
+// Work is done in slices of at most options.slice ms, enforced through a
+// progress handler, and only after options.idle ms without activity. The
+// owner reports each statement through touch(); a slice running then is
+// interrupted and waited for, so the owner never contends with maintenance
+// for locks. Failed or interrupted tasks are retried in a later slice.
+//------------------------------------------------------------------------------
+class Maintenance_Scheduler {
+
+    public:
+
+        //----------------------------------------------------------------------
+        // @param filename The database file (not ":memory:").
+        // @param options  The triggers and budgets; options.interval > 0.
+        // @throw If the database cannot be opened or the thread started.
+        //----------------------------------------------------------------------
+        Maintenance_Scheduler(const std::string& filename,
+                              const Maintenance_Options& options)
+            throw(std::runtime_error);
+
+        //----------------------------------------------------------------------
+        // @post The thread is stopped (after the current slice) and joined.
+        //----------------------------------------------------------------------
+        ~Maintenance_Scheduler();
+
+        //----------------------------------------------------------------------
+        // @param total_changes sqlite3_total_changes() of the owner.
+        // @post  The database is not idle; any running slice has ended.
+        //----------------------------------------------------------------------
+        void touch(int total_changes);
+
+        Maintenance_Stats stats() const;
+
+    private:
+        Maintenance_Scheduler(const Maintenance_Scheduler&);
+        Maintenance_Scheduler& operator=(const Maintenance_Scheduler&);
+
+        void run();
+        void run_slice(int64_t, Maintenance_Stats&);
+        bool yielding();
+        int  exec(const char*, int64_t* = 0);
+        void stop();
+        static void* main(void*);
+        static int   progress(void*);
+
+        sqlite3*            m_db;
+        std::string         m_wal;              // WAL file name
+        Maintenance_Options m_options;
+        bool                m_incremental;      // auto_vacuum = INCREMENTAL
+        int64_t             m_deadline;         // End of the current slice
+
+        mutable pthread_mutex_t m_mutex;        // Guards the members below
+        pthread_cond_t      m_wake;
+        pthread_cond_t      m_done;
+        pthread_t           m_thread;
+        bool                m_stop;
+        bool                m_running;          // A slice is running
+        bool                m_yield;            // The slice is to end
+        int64_t             m_last;             // Last activity, usec
+        int                 m_total;            // Last total_changes seen
+        int64_t             m_changed;          // Rows changed since ANALYZE
+        Maintenance_Stats   m_stats;
+};
+
+#endif
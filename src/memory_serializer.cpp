@@ -0,0 +1,505 @@
+#include "memory_serializer.h"
+#include "query.h"
+#include "clock.h"
+#include <algorithm>
+#include <limits>
+using namespace std;
+
+//------------------------------------------------------------------------------
+// Ctor: Loads the items of the tier (if any).
+//------------------------------------------------------------------------------
+Memory_Serializer::Memory_Serializer(Serializer* tier, Tier_Mode mode)
+    throw(runtime_error) : m_next_id(1),
+                           m_next_tag_id(1),
+                           m_tier(tier),
+                           m_mode(mode) {
+    if (!m_tier) {
+        return;
+    }
+    vector<Item*> items;
+    try {
+        m_tier->read_range(numeric_limits<int64_t>::min(),
+                           numeric_limits<int64_t>::max(),
+                           items);
+    }
+    catch (const exception&) {
+        for (size_t i = 0; i < items.size(); ++i) {
+            delete items[i];
+        }
+        throw;
+    }
+    for (size_t i = 0; i < items.size(); ++i) {
+        int id = items[i]->id;
+        store(id, *items[i]);
+        m_tier_ids[id] = id;
+        m_next_id = max(m_next_id, id + 1);
+        delete items[i];
+    }
+}
+
+//------------------------------------------------------------------------------
+// Dtor
+//------------------------------------------------------------------------------
+Memory_Serializer::~Memory_Serializer() {
+    for (Entry_Map::iterator it = m_items.begin(); it != m_items.end(); ++it) {
+        delete it->second;
+    }
+}
+
+//------------------------------------------------------------------------------
+// Adds a new entry for the item under the given id.
+//------------------------------------------------------------------------------
+void Memory_Serializer::store(int id, const Item& item) {
+    Entry* entry = new Entry;
+    entry->item = item;
+    entry->item.id = id;
+    set_tags(*entry, item.tags);
+
+    m_items[id] = entry;
+    index(*entry);
+    m_index.add_item(id);
+}
+
+//------------------------------------------------------------------------------
+// Associates the entry with exactly the given tags (case insensitive), creating
+// unknown tags. Only the relations that change touch the postings.
+//------------------------------------------------------------------------------
+void Memory_Serializer::set_tags(Entry& entry, const vector<string>& tags) {
+    int id = entry.item.id;
+    vector<int> tag_ids;
+    for (size_t i = 0; i < tags.size(); ++i) {
+        int tag_id = m_tags.find(tags[i]);
+        if (tag_id == 0) {
+            tag_id = m_next_tag_id++;
+            m_tags.insert(tag_id, tags[i]);
+        }
+        if (find(tag_ids.begin(), tag_ids.end(), tag_id) == tag_ids.end()) {
+            tag_ids.push_back(tag_id);
+        }
+    }
+
+    set<int> old_ids(entry.tag_ids.begin(), entry.tag_ids.end());
+    set<int> new_ids(tag_ids.begin(), tag_ids.end());
+    for (size_t i = 0; i < entry.tag_ids.size(); ++i) {
+        if (!new_ids.count(entry.tag_ids[i])) {
+            m_index.remove(id, entry.tag_ids[i]);
+            m_tags.add_uses(entry.tag_ids[i], -1);
+        }
+    }
+    for (size_t i = 0; i < tag_ids.size(); ++i) {
+        if (!old_ids.count(tag_ids[i])) {
+            m_index.add(id, tag_ids[i]);
+            m_tags.add_uses(tag_ids[i], 1);
+        }
+    }
+
+    entry.tag_ids.swap(tag_ids);
+    entry.item.tags.clear();
+    for (size_t i = 0; i < entry.tag_ids.size(); ++i) {
+        entry.item.tags.push_back(m_tags.title(entry.tag_ids[i]));
+    }
+}
+
+//------------------------------------------------------------------------------
+// Returns the first time index key at the timestamp, ahead of every id.
+//------------------------------------------------------------------------------
+Memory_Serializer::Time_Key Memory_Serializer::time_key(int64_t timestamp) {
+    return make_pair(timestamp, numeric_limits<int>::min());
+}
+
+//------------------------------------------------------------------------------
+// Adds the entry to the time and title indexes.
+//------------------------------------------------------------------------------
+void Memory_Serializer::index(const Entry& entry) {
+    m_by_time.insert(make_pair(make_pair(entry.item.timestamp, entry.item.id),
+                               entry.item.id));
+    m_by_title.insert(make_pair(entry.item.title, entry.item.id));
+}
+
+//------------------------------------------------------------------------------
+// Removes the entry from the time and title indexes.
+//------------------------------------------------------------------------------
+void Memory_Serializer::unindex(const Entry& entry) {
+    m_by_time.erase(make_pair(entry.item.timestamp, entry.item.id));
+
+    pair<Title_Index::iterator, Title_Index::iterator> titles =
+        m_by_title.equal_range(entry.item.title);
+
+    for (Title_Index::iterator it = titles.first; it != titles.second; ++it) {
+        if (it->second == entry.item.id) {
+            m_by_title.erase(it);
+            break;
+        }
+    }
+}
+
+//------------------------------------------------------------------------------
+// Appends copies of the items in ids to the out vector, newest first.
+//------------------------------------------------------------------------------
+void Memory_Serializer::copy_items(const Roaring_Bitmap& ids,
+                                   vector<Item*>& out_items) const {
+    vector<uint32_t> id_list;
+    ids.values(id_list);
+
+    size_t first = out_items.size();
+    for (size_t i = 0; i < id_list.size(); ++i) {
+        Entry_Map::const_iterator it = m_items.find(id_list[i]);
+        if (it != m_items.end()) {
+            out_items.push_back(new Item(it->second->item));
+        }
+    }
+    sort(out_items.begin() + first, out_items.end(), Item_Newer());
+}
+
+//------------------------------------------------------------------------------
+// @return The id of the item in the tier, or 0 if it has not reached it yet.
+//------------------------------------------------------------------------------
+int Memory_Serializer::tier_id(int id) const {
+    map<int, int>::const_iterator it = m_tier_ids.find(id);
+    return it == m_tier_ids.end() ? 0 : it->second;
+}
+
+//------------------------------------------------------------------------------
+// Writes the pending changes to a SNAPSHOT tier, trashes first.
+//------------------------------------------------------------------------------
+void Memory_Serializer::checkpoint()
+    throw(runtime_error) {
+
+    if (!m_tier || m_mode != SNAPSHOT) {
+        return;
+    }
+    size_t done = 0;
+    try {
+        for (; done < m_trashed.size(); ++done) {
+            m_tier->trash(m_trashed[done]);
+        }
+    }
+    catch (const exception&) {
+        m_trashed.erase(m_trashed.begin(), m_trashed.begin() + done);
+        throw;
+    }
+    m_trashed.clear();
+
+    while (!m_dirty.empty()) {
+        int id = *m_dirty.begin();
+        Item copy(m_items[id]->item);
+        copy.id = tier_id(id);
+        m_tier->write(copy);
+        m_tier_ids[id] = copy.id;
+        m_dirty.erase(m_dirty.begin());
+    }
+}
+
+//------------------------------------------------------------------------------
+// Inserts or updates an item, writing it through to the tier first if needed.
+//------------------------------------------------------------------------------
+void Memory_Serializer::write(Item& record)
+    throw(runtime_error) {
+
+    Entry_Map::iterator it = m_items.end();
+    if (record.id != 0 && (it = m_items.find(record.id)) == m_items.end()) {
+        throw runtime_error("No such item");
+    }
+
+    Item copy(record);
+    bool write_through = m_tier && m_mode == WRITE_THROUGH;
+    if (write_through) {
+        copy.id = record.id ? tier_id(record.id) : 0;
+        m_tier->write(copy);
+    }
+    else {
+        copy.timestamp = epoch_usec();
+    }
+
+    int id = record.id;
+    if (id == 0) {
+        id = write_through ? copy.id : m_next_id;
+        m_next_id = max(m_next_id, id + 1);
+        if (write_through) {
+            m_tier_ids[id] = copy.id;
+        }
+        store(id, copy);
+    }
+    else {
+        Entry& entry = *it->second;
+        unindex(entry);
+        entry.item.title     = copy.title;
+        entry.item.content   = copy.content;
+        entry.item.encrypted = copy.encrypted;
+        entry.item.timestamp = copy.timestamp;
+        set_tags(entry, copy.tags);
+        index(entry);
+    }
+    if (m_tier && m_mode == SNAPSHOT) {
+        m_dirty.insert(id);
+    }
+    record.id        = id;
+    record.timestamp = copy.timestamp;
+}
+
+//------------------------------------------------------------------------------
+// Read all items associated with any of the tags.
+//------------------------------------------------------------------------------
+void Memory_Serializer::read(const vector<string>& tags,
+                             vector<Item*>& out_items)
+    throw(runtime_error) {
+
+    if (tags.empty()) {
+        return;
+    }
+    Roaring_Bitmap matches;
+    m_index.any(tags, m_tags, matches);
+    copy_items(matches, out_items);
+}
+
+//------------------------------------------------------------------------------
+// Counts the matches on the postings without copying any item.
+//------------------------------------------------------------------------------
+long Memory_Serializer::count(const vector<string>& tags, Tag_Match mode)
+    throw(runtime_error) {
+
+    Roaring_Bitmap matches;
+    if (mode == MATCH_ALL) {
+        m_index.all(tags, m_tags, matches);
+    }
+    else {
+        m_index.any(tags, m_tags, matches);
+    }
+    return static_cast<long>(matches.cardinality());
+}
+
+//------------------------------------------------------------------------------
+bool Memory_Serializer::exists(const vector<string>& tags)
+    throw(runtime_error) {
+
+    for (size_t i = 0; i < tags.size(); ++i) {
+        if (!m_index.postings(m_tags.find(tags[i])).empty()) {
+            return true;
+        }
+    }
+    return false;
+}
+
+//------------------------------------------------------------------------------
+// Evaluates the query on the postings; title and time predicates are answered
+// by evaluate_leaf().
+//------------------------------------------------------------------------------
+void Memory_Serializer::query(const Query& q, vector<Item*>& out_items)
+    throw(runtime_error) {
+
+    Roaring_Bitmap matches;
+    m_index.evaluate(q.root(), m_tags, matches, this);
+    copy_items(matches, out_items);
+}
+
+//------------------------------------------------------------------------------
+void Memory_Serializer::evaluate_leaf(const Query_Node& node,
+                                      Roaring_Bitmap& out) const
+    throw(runtime_error) {
+
+    out.clear();
+    switch (node.type) {
+        case Query_Node::TITLE: {
+            string needle = Tag_Dictionary::fold(node.values[0]);
+            for (Entry_Map::const_iterator it = m_items.begin();
+                 it != m_items.end(); ++it) {
+
+                string title = Tag_Dictionary::fold(it->second->item.title);
+                if (title.find(needle) != string::npos) {
+                    out.add(it->first);
+                }
+            }
+            break;
+        }
+        case Query_Node::AFTER: {
+            Time_Index::const_iterator it =
+                m_by_time.lower_bound(time_key(node.time));
+            for (; it != m_by_time.end(); ++it) {
+                out.add(it->second);
+            }
+            break;
+        }
+        case Query_Node::BEFORE: {
+            Time_Index::const_iterator end =
+                m_by_time.lower_bound(time_key(node.time));
+            for (Time_Index::const_iterator it = m_by_time.begin();
+                 it != end; ++it) {
+                out.add(it->second);
+            }
+            break;
+        }
+
+        default:
+            throw runtime_error("Unexpected query predicate");
+    }
+}
+
+//------------------------------------------------------------------------------
+// Copy the items with the given ids, in the order of the ids.
+//------------------------------------------------------------------------------
+void Memory_Serializer::read_by_id(const vector<int>& ids,
+                                   vector<Item*>& out_items)
+    throw(runtime_error) {
+
+    set<int> seen;
+    for (size_t i = 0; i < ids.size(); ++i) {
+        Entry_Map::const_iterator it = m_items.find(ids[i]);
+        if (it != m_items.end() && seen.insert(ids[i]).second) {
+            out_items.push_back(new Item(it->second->item));
+        }
+    }
+}
+
+//------------------------------------------------------------------------------
+// Copy the items with the title from the title index, newest first.
+//------------------------------------------------------------------------------
+void Memory_Serializer::find_by_title(const string& title,
+                                      vector<Item*>& out_items)
+    throw(runtime_error) {
+
+    size_t first = out_items.size();
+    pair<Title_Index::const_iterator, Title_Index::const_iterator> range =
+        m_by_title.equal_range(title);
+
+    for (Title_Index::const_iterator it = range.first; it != range.second; ++it) {
+        out_items.push_back(new Item(m_items[it->second]->item));
+    }
+    sort(out_items.begin() + first, out_items.end(), Item_Newer());
+}
+
+//------------------------------------------------------------------------------
+// Read all items modified within [from, to), oldest first.
+//------------------------------------------------------------------------------
+void Memory_Serializer::read_range(int64_t from, int64_t to,
+                                   vector<Item*>& out_items)
+    throw(runtime_error) {
+
+    Time_Index::const_iterator end = m_by_time.lower_bound(time_key(to));
+    for (Time_Index::const_iterator it = m_by_time.lower_bound(time_key(from));
+         it != end; ++it) {
+        out_items.push_back(new Item(m_items[it->second]->item));
+    }
+}
+
+//------------------------------------------------------------------------------
+// Walks the time index from the newest item, keeping those in the postings of
+// the tags until limit items are found.
+//------------------------------------------------------------------------------
+void Memory_Serializer::read_recent(const vector<string>& tags,
+                                    size_t limit,
+                                    vector<Item*>& out_items)
+    throw(runtime_error) {
+
+    if (tags.empty() || limit == 0) {
+        return;
+    }
+    Roaring_Bitmap matches;
+    m_index.any(tags, m_tags, matches);
+
+    size_t found = 0;
+    for (Time_Index::reverse_iterator it = m_by_time.rbegin();
+         it != m_by_time.rend() && found < limit; ++it) {
+
+        if (matches.contains(it->second)) {
+            out_items.push_back(new Item(m_items[it->second]->item));
+            ++found;
+        }
+    }
+}
+
+//------------------------------------------------------------------------------
+// Removes the item, trashing it in the tier directly or at the next checkpoint.
+//------------------------------------------------------------------------------
+void Memory_Serializer::trash(const Item& record)
+    throw(runtime_error) {
+
+    Entry_Map::iterator it = m_items.find(record.id);
+    if (it == m_items.end()) {
+        throw runtime_error("No such item");
+    }
+    Entry* entry = it->second;
+
+    if (m_tier) {
+        Item copy(entry->item);
+        copy.id = tier_id(record.id);
+        if (m_mode == WRITE_THROUGH) {
+            m_tier->trash(copy);
+        }
+        else if (copy.id) {
+            m_trashed.push_back(copy);
+        }
+    }
+    m_dirty.erase(record.id);
+    m_tier_ids.erase(record.id);
+
+    unindex(*entry);
+    m_index.remove_item(record.id, entry->tag_ids);
+    for (size_t i = 0; i < entry->tag_ids.size(); ++i) {
+        m_tags.add_uses(entry->tag_ids[i], -1);
+    }
+    m_items.erase(it);
+    delete entry;
+}
+
+//------------------------------------------------------------------------------
+// Tag lookups, all answered by the tag dictionary.
+//------------------------------------------------------------------------------
+void Memory_Serializer::tags(vector<string>& out_tags)
+    throw(runtime_error) {
+
+    m_tags.complete("", m_tags.size(), out_tags);
+}
+
+//------------------------------------------------------------------------------
+void Memory_Serializer::complete_tags(const string& prefix, size_t limit,
+                                      vector<string>& out_tags)
+    throw(runtime_error) {
+
+    m_tags.complete(prefix, limit, out_tags);
+}
+
+//------------------------------------------------------------------------------
+long Memory_Serializer::tag_count(const string& tag)
+    throw(runtime_error) {
+
+    return m_tags.uses(m_tags.find(tag));
+}
+
+//------------------------------------------------------------------------------
+// Counts the tags of the matching items in one pass over them.
+//------------------------------------------------------------------------------
+void Memory_Serializer::facets(const vector<string>& tags,
+                               vector<Tag_Count>& out_counts)
+    throw(runtime_error) {
+
+    size_t first = out_counts.size();
+    if (tags.empty()) {
+        vector<string> all;
+        m_tags.complete("", m_tags.size(), all);
+        for (size_t i = 0; i < all.size(); ++i) {
+            long count = tag_count(all[i]);
+            if (count > 0) {
+                out_counts.push_back(Tag_Count(all[i], count));
+            }
+        }
+    }
+    else {
+        Roaring_Bitmap matches;
+        m_index.any(tags, m_tags, matches);
+        vector<uint32_t> ids;
+        matches.values(ids);
+
+        map<int, long> counts;
+        for (size_t i = 0; i < ids.size(); ++i) {
+            const vector<int>& tag_ids = m_items[ids[i]]->tag_ids;
+            for (size_t j = 0; j < tag_ids.size(); ++j) {
+                ++counts[tag_ids[j]];
+            }
+        }
+        for (map<int, long>::iterator it = counts.begin();
+             it != counts.end(); ++it) {
+            out_counts.push_back(Tag_Count(m_tags.title(it->first), it->second));
+        }
+    }
+    sort(out_counts.begin() + first, out_counts.end(), Tag_Count_Rank());
+}
@@ -0,0 +1,160 @@
+#ifndef MEMORY_SERIALIZER_H
+#define MEMORY_SERIALIZER_H
+
+#include "recap.h"
+#include "tag_dictionary.h"
+#include "tag_index.h"
+#include <map>
+#include <set>
+#include <tr1/unordered_map>
+
+//------------------------------------------------------------------------------
+// In-memory implementation of the serialization interface. Items are kept in a
+// hash map by id, tags in a dictionary with a bitmap posting list per tag, a
+// time ordered index serves range and recency reads and a title index serves
+// title lookups.
+//
+// An optional tier (any other Serializer, typically a SQLite3_Serializer)
+// provides durability. Its items are loaded on construction, and changes are
+// either written through to it immediately or collected and written at each
+// checkpoint().
+//
+// Ids are those of the tier, with one exception: a new item written with a
+// SNAPSHOT tier is given a memory id, as the tier only assigns one at the next
+// checkpoint(). The memory id stays valid for this object (which maps it to
+// the tier id), but is not durable: a Memory_Serializer loaded later from the
+// tier, and the tier itself, know the item by its tier id.
+//------------------------------------------------------------------------------
+class Memory_Serializer : public Serializer,
+                          private Tag_Index::Leaf_Evaluator {
+
+    public:
+
+        enum Tier_Mode {
+            WRITE_THROUGH,  // Every write() and trash() goes to the tier first
+            SNAPSHOT        // Changes reach the tier on checkpoint() only
+        };
+
+        //----------------------------------------------------------------------
+        // @param tier The durable tier, or 0 for a purely ephemeral store.
+        //             It must outlive this object.
+        // @param mode How changes reach the tier.
+        // @post  All items of the tier are loaded, keeping their ids.
+        // @throw If the tier cannot be read.
+        //----------------------------------------------------------------------
+        explicit Memory_Serializer(Serializer* tier = 0,
+                                   Tier_Mode mode = SNAPSHOT)
+            throw(std::runtime_error);
+
+        //----------------------------------------------------------------------
+        // @note Pending SNAPSHOT changes are discarded; call checkpoint() first
+        //       to keep them.
+        //----------------------------------------------------------------------
+        ~Memory_Serializer();
+
+        //----------------------------------------------------------------------
+        // @post  With a SNAPSHOT tier, every item written or trashed since the
+        //        last checkpoint is written to or trashed in the tier. The
+        //        tier stamps the items with the checkpoint time and assigns
+        //        ids to the new ones, which keep their memory ids here.
+        //        Otherwise nothing happens.
+        // @throw If the tier cannot be written. Changes not yet written stay
+        //        pending.
+        //----------------------------------------------------------------------
+        void checkpoint()
+            throw(std::runtime_error);
+
+        //----------------------------------------------------------------------
+        // Serializer interface. With a WRITE_THROUGH tier, write() and trash()
+        // leave the memory store unchanged if the tier throws.
+        //----------------------------------------------------------------------
+        virtual void write(Item& i)
+            throw(std::runtime_error);
+
+        virtual void read(const std::vector<std::string>& tags,
+                          std::vector<Item*>& items)
+            throw(std::runtime_error);
+
+        virtual long count(const std::vector<std::string>& tags, Tag_Match mode)
+            throw(std::runtime_error);
+
+        virtual bool exists(const std::vector<std::string>& tags)
+            throw(std::runtime_error);
+
+        virtual void query(const Query& q, std::vector<Item*>& items)
+            throw(std::runtime_error);
+
+        virtual void read_by_id(const std::vector<int>& ids,
+                                std::vector<Item*>& items)
+            throw(std::runtime_error);
+
+        virtual void find_by_title(const std::string& title,
+                                   std::vector<Item*>& items)
+            throw(std::runtime_error);
+
+        virtual void read_range(int64_t from, int64_t to,
+                                std::vector<Item*>& items)
+            throw(std::runtime_error);
+
+        virtual void read_recent(const std::vector<std::string>& tags,
+                                 size_t limit,
+                                 std::vector<Item*>& items)
+            throw(std::runtime_error);
+
+        virtual void trash(const Item& i)
+            throw(std::runtime_error);
+
+        virtual void tags(std::vector<std::string>& tags)
+            throw(std::runtime_error);
+
+        virtual void complete_tags(const std::string& prefix, size_t limit,
+                                   std::vector<std::string>& tags)
+            throw(std::runtime_error);
+
+        virtual long tag_count(const std::string& tag)
+            throw(std::runtime_error);
+
+        virtual void facets(const std::vector<std::string>& tags,
+                            std::vector<Tag_Count>& counts)
+            throw(std::runtime_error);
+
+    private:
+        struct Entry {
+            Item             item;
+            std::vector<int> tag_ids;
+        };
+        typedef std::tr1::unordered_map<int, Entry*> Entry_Map;
+        typedef std::pair<int64_t, int>              Time_Key;
+        typedef std::map<Time_Key, int>              Time_Index;
+        typedef std::multimap<std::string, int>      Title_Index;
+
+        Memory_Serializer(const Memory_Serializer&);
+        Memory_Serializer& operator=(const Memory_Serializer&);
+
+        virtual void evaluate_leaf(const Query_Node&, Roaring_Bitmap&) const
+            throw(std::runtime_error);
+
+        void store(int, const Item&);
+        void set_tags(Entry&, const std::vector<std::string>&);
+        static Time_Key time_key(int64_t);
+        void index(const Entry&);
+        void unindex(const Entry&);
+        void copy_items(const Roaring_Bitmap&, std::vector<Item*>&) const;
+        int  tier_id(int) const;
+
+        Entry_Map           m_items;
+        Time_Index          m_by_time;
+        Title_Index         m_by_title;
+        Tag_Dictionary      m_tags;
+        Tag_Index           m_index;
+        int                 m_next_id;
+        int                 m_next_tag_id;
+
+        Serializer*         m_tier;
+        Tier_Mode           m_mode;
+        std::map<int, int>  m_tier_ids;     // Memory id to tier id
+        std::set<int>       m_dirty;        // Written since the last checkpoint
+        std::vector<Item>   m_trashed;      // Trashed since the last checkpoint
+};
+
+#endif
@@ -0,0 +1,12 @@
+#ifndef MEMORY_USAGE_H
+#define MEMORY_USAGE_H
+
+#include <cstddef>
+
+//------------------------------------------------------------------------------
+// The links and colour of a std::map node, counted on top of its value by the
+// memory estimates.
+//------------------------------------------------------------------------------
+const size_t MAP_NODE_OVERHEAD = 4 * sizeof(void*);
+
+#endif
@@ -0,0 +1,336 @@
+#include "query.h"
+#include "tag_dictionary.h"
+#include <memory>
+#include <set>
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+using namespace std;
+
+//------------------------------------------------------------------------------
+// Stateless utility functions
+//------------------------------------------------------------------------------
+
+//------------------------------------------------------------------------------
+// Converts a TIME token (epoch microseconds or YYYY-MM-DD[THH:MM[:SS]] in UTC)
+// into microseconds since the epoch.
+//------------------------------------------------------------------------------
+int64_t parse_query_time(const string& text) throw(runtime_error) {
+    const char* p = text.c_str();
+    char* end = 0;
+    long long usec = strtoll(p, &end, 10);
+    if (end != p && *end == '\0') {
+        return usec;
+    }
+
+    tm t = tm();
+    int n = 0;
+    if (sscanf(p, "%d-%d-%d%n", &t.tm_year, &t.tm_mon, &t.tm_mday, &n) != 3) {
+        throw runtime_error("Invalid time in query: " + text);
+    }
+    p += n;
+    if (*p == 'T') {
+        if (sscanf(++p, "%d:%d%n", &t.tm_hour, &t.tm_min, &n) != 2) {
+            throw runtime_error("Invalid time in query: " + text);
+        }
+        p += n;
+        if (*p == ':') {
+            if (sscanf(++p, "%d%n", &t.tm_sec, &n) != 1) {
+                throw runtime_error("Invalid time in query: " + text);
+            }
+            p += n;
+        }
+    }
+    if (*p != '\0') {
+        throw runtime_error("Invalid time in query: " + text);
+    }
+    t.tm_year -= 1900;
+    t.tm_mon  -= 1;
+    return static_cast<int64_t>(timegm(&t)) * 1000000;
+}
+
+//------------------------------------------------------------------------------
+// Moves the values of src into dst, skipping case insensitive duplicates.
+//------------------------------------------------------------------------------
+void merge_tag_values(const Query_Node& src, Query_Node& dst) {
+    set<string> seen;
+    for (size_t i = 0; i < dst.values.size(); ++i) {
+        seen.insert(Tag_Dictionary::fold(dst.values[i]));
+    }
+    for (size_t i = 0; i < src.values.size(); ++i) {
+        if (seen.insert(Tag_Dictionary::fold(src.values[i])).second) {
+            dst.values.push_back(src.values[i]);
+        }
+    }
+}
+
+//------------------------------------------------------------------------------
+// Rewrites a freshly parsed tree into its optimized form. Takes ownership of
+// node and returns the node that replaces it.
+//------------------------------------------------------------------------------
+Query_Node* optimize_query(Query_Node* node) {
+    for (size_t i = 0; i < node->children.size(); ++i) {
+        node->children[i] = optimize_query(node->children[i]);
+    }
+
+    if (node->type == Query_Node::NOT) {
+        Query_Node* child = node->children[0];
+        if (child->type == Query_Node::NOT) {
+            Query_Node* grandchild = child->children[0];
+            child->children.clear();
+            delete node;
+            return grandchild;
+        }
+        return node;
+    }
+    if (node->type != Query_Node::AND && node->type != Query_Node::OR) {
+        return node;
+    }
+
+    // Flatten (a AND (b AND c)) into (a AND b AND c)
+    vector<Query_Node*> children;
+    for (size_t i = 0; i < node->children.size(); ++i) {
+        Query_Node* child = node->children[i];
+        if (child->type == node->type) {
+            children.insert(children.end(), child->children.begin(),
+                                            child->children.end());
+            child->children.clear();
+            delete child;
+        }
+        else {
+            children.push_back(child);
+        }
+    }
+
+    // Merge the tag tests into one node, so that they are answered by a
+    // single index lookup.
+    Query_Node::Type merged_type =
+        node->type == Query_Node::OR ? Query_Node::ANY_TAG
+                                     : Query_Node::ALL_TAGS;
+    Query_Node* merged = 0;
+    node->children.clear();
+
+    for (size_t i = 0; i < children.size(); ++i) {
+        Query_Node* child = children[i];
+        bool mergeable = child->type == merged_type ||
+                         ((child->type == Query_Node::ANY_TAG ||
+                           child->type == Query_Node::ALL_TAGS) &&
+                          child->values.size() == 1);
+        if (!mergeable) {
+            node->children.push_back(child);
+        }
+        else if (!merged) {
+            merged = child;
+            merged->type = merged_type;
+            node->children.push_back(merged);
+        }
+        else {
+            merge_tag_values(*child, *merged);
+            delete child;
+        }
+    }
+    if (merged && merged->values.size() == 1) {
+        merged->type = Query_Node::ANY_TAG;
+    }
+    if (node->children.size() == 1) {
+        Query_Node* child = node->children[0];
+        node->children.clear();
+        delete node;
+        return child;
+    }
+    return node;
+}
+
+//------------------------------------------------------------------------------
+// Recursive descent parser for the grammar documented in query.h.
+//------------------------------------------------------------------------------
+class Query_Parser {
+
+    public:
+        Query_Parser(const string& text) : m_text(text), m_pos(0) {
+            next();
+        }
+
+        Query_Node* parse() throw(runtime_error) {
+            auto_ptr<Query_Node> root(expr());
+            if (m_kind != END) {
+                fail("unexpected " + m_token);
+            }
+            return root.release();
+        }
+
+    private:
+        enum Kind { END, OPEN, CLOSE, WORD, QUOTED };
+
+        //----------------------------------------------------------------------
+        // Reads the next token into m_kind and m_token. A bare word runs until
+        // white space or a parenthesis; double quoted sections within it are
+        // taken literally, so title:"two words" is a single word.
+        //----------------------------------------------------------------------
+        void next() throw(runtime_error) {
+            while (m_pos < m_text.size() && 
+                   isspace(static_cast<unsigned char>(m_text[m_pos]))) {
+                ++m_pos;
+            }
+            m_token.clear();
+            if (m_pos == m_text.size()) {
+                m_kind = END;
+                return;
+            }
+            char c = m_text[m_pos];
+            if (c == '(' || c == ')') {
+                m_kind = (c == '(' ? OPEN : CLOSE);
+                m_token = c;
+                ++m_pos;
+                return;
+            }
+            m_kind = (c == '"' ? QUOTED : WORD);
+            while (m_pos < m_text.size()) {
+                c = m_text[m_pos];
+                if (isspace(static_cast<unsigned char>(c)) || 
+                    c == '(' || c == ')') {
+                    break;
+                }
+                ++m_pos;
+                if (c != '"') {
+                    m_token += c;
+                    continue;
+                }
+                size_t close = m_text.find('"', m_pos);
+                if (close == string::npos) {
+                    fail("unterminated quote");
+                }
+                m_token.append(m_text, m_pos, close - m_pos);
+                m_pos = close + 1;
+            }
+        }
+
+        bool keyword(const char* word) const {
+            return m_kind == WORD && m_token == word;
+        }
+
+        Query_Node* expr() throw(runtime_error) {
+            auto_ptr<Query_Node> node(new Query_Node(Query_Node::OR));
+            node->children.push_back(term());
+            while (keyword("OR")) {
+                next();
+                node->children.push_back(term());
+            }
+            return node.release();
+        }
+
+        Query_Node* term() throw(runtime_error) {
+            auto_ptr<Query_Node> node(new Query_Node(Query_Node::AND));
+            node->children.push_back(factor());
+            while (m_kind != END && m_kind != CLOSE && !keyword("OR")) {
+                if (keyword("AND")) {
+                    next();
+                }
+                node->children.push_back(factor());
+            }
+            return node.release();
+        }
+
+        Query_Node* factor() throw(runtime_error) {
+            if (keyword("NOT")) {
+                next();
+                auto_ptr<Query_Node> node(new Query_Node(Query_Node::NOT));
+                node->children.push_back(factor());
+                return node.release();
+            }
+            if (m_kind == OPEN) {
+                next();
+                auto_ptr<Query_Node> node(expr());
+                if (m_kind != CLOSE) {
+                    fail("missing )");
+                }
+                next();
+                return node.release();
+            }
+            if (m_kind != WORD && m_kind != QUOTED) {
+                fail(m_kind == END ? "unexpected end" : "unexpected " + m_token);
+            }
+            if (keyword("AND") || keyword("OR")) {
+                fail("unexpected " + m_token);
+            }
+            auto_ptr<Query_Node> node(predicate());
+            next();
+            return node.release();
+        }
+
+        Query_Node* predicate() throw(runtime_error) {
+            if (m_kind == WORD) {
+                if (m_token.compare(0, 6, "title:") == 0) {
+                    Query_Node* node = new Query_Node(Query_Node::TITLE);
+                    node->values.push_back(m_token.substr(6));
+                    return node;
+                }
+                if (m_token.compare(0, 6, "after:") == 0) {
+                    Query_Node* node = new Query_Node(Query_Node::AFTER);
+                    try { node->time = parse_query_time(m_token.substr(6)); }
+                    catch (...) { delete node; throw; }
+                    return node;
+                }
+                if (m_token.compare(0, 7, "before:") == 0) {
+                    Query_Node* node = new Query_Node(Query_Node::BEFORE);
+                    try { node->time = parse_query_time(m_token.substr(7)); }
+                    catch (...) { delete node; throw; }
+                    return node;
+                }
+            }
+            Query_Node* node = new Query_Node(Query_Node::ANY_TAG);
+            node->values.push_back(m_token);
+            return node;
+        }
+
+        void fail(const string& what) throw(runtime_error) {
+            throw runtime_error("Invalid query (" + what + "): " + m_text);
+        }
+
+        const string& m_text;
+        size_t        m_pos;
+        Kind          m_kind;
+        string        m_token;
+};
+
+//------------------------------------------------------------------------------
+// Query_Node
+//------------------------------------------------------------------------------
+Query_Node::~Query_Node() {
+    for (size_t i = 0; i < children.size(); ++i) {
+        delete children[i];
+    }
+}
+
+//------------------------------------------------------------------------------
+bool Query_Node::tags_only() const {
+    if (type == ANY_TAG || type == ALL_TAGS) {
+        return true;
+    }
+    if (type != AND && type != OR && type != NOT) {
+        return false;
+    }
+    for (size_t i = 0; i < children.size(); ++i) {
+        if (!children[i]->tags_only()) {
+            return false;
+        }
+    }
+    return true;
+}
+
+//------------------------------------------------------------------------------
+// Query
+//------------------------------------------------------------------------------
+Query::Query(const string& expression)
+    throw(runtime_error) : m_expression(expression),
+                           m_root(0) {
+
+    Query_Parser parser(m_expression);
+    m_root = optimize_query(parser.parse());
+}
+
+//------------------------------------------------------------------------------
+Query::~Query() {
+    delete m_root;
+}
@@ -0,0 +1,85 @@
+#ifndef QUERY_H
+#define QUERY_H
+
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+//------------------------------------------------------------------------------
+// Node of a parsed and optimized tag query.
+//------------------------------------------------------------------------------
+struct Query_Node {
+
+    enum Type {
+        ANY_TAG,    // Associated with any of values
+        ALL_TAGS,   // Associated with all of values
+        TITLE,      // Title contains values[0] (case insensitive)
+        AFTER,      // Modified at or after time
+        BEFORE,     // Modified before time
+        AND,
+        OR,
+        NOT         // Negates children[0]
+    };
+
+    Type                     type;
+    std::vector<std::string> values;
+    int64_t                  time;
+    std::vector<Query_Node*> children;
+
+    explicit Query_Node(Type t) : type(t), time(0) {}
+    ~Query_Node();
+
+    //--------------------------------------------------------------------------
+    // @return Whether the node and all its children only test tags.
+    //--------------------------------------------------------------------------
+    bool tags_only() const;
+
+    private:
+        Query_Node(const Query_Node&);
+        Query_Node& operator=(const Query_Node&);
+};
+
+//------------------------------------------------------------------------------
+// A boolean tag query, e.g. "(work OR project) AND NOT archived".
+//
+//   expr      := term ("OR" term)*
+//   term      := factor (["AND"] factor)*
+//   factor    := "NOT" factor | "(" expr ")" | predicate | TAG
+//   predicate := "title:" WORD | "after:" TIME | "before:" TIME
+//
+// Keywords are upper case. A TAG or WORD is a bare word or a double quoted
+// string. A TIME is either microseconds since the epoch or a UTC date of the
+// form YYYY-MM-DD[THH:MM[:SS]].
+//
+// The parsed tree is optimized so that backends can evaluate it as a single
+// plan: nested ANDs and ORs are flattened, double negations removed and
+// sibling tag tests merged into one ANY_TAG (for OR) or ALL_TAGS (for AND)
+// node.
+//------------------------------------------------------------------------------
+class Query {
+
+    public:
+
+        //----------------------------------------------------------------------
+        // @param expression The query text.
+        // @post  The query is parsed and optimized.
+        // @throw If the expression is not a valid query.
+        //----------------------------------------------------------------------
+        explicit Query(const std::string& expression)
+            throw(std::runtime_error);
+
+        ~Query();
+
+        const Query_Node&  root()       const { return *m_root; }
+        const std::string& expression() const { return m_expression; }
+
+    private:
+        Query(const Query&);
+        Query& operator=(const Query&);
+
+        std::string m_expression;
+        Query_Node* m_root;
+};
+
+#endif
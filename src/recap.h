@@ -1,7 +1,9 @@
 #ifndef RECAP_H
 #define RECAP_H
 #include <vector>
+#include <string>
 #include <stdexcept>
+#include <stdint.h>
 
 //------------------------------------------------------------------------------
 // Core data type. 
@@ -11,10 +13,46 @@ struct Item {
     bool encrypted;
     std::string title;
     std::string content;
-    std::string timestamp;
+    int64_t timestamp;      // Last modified, in microseconds since the epoch
     std::vector<std::string> tags;
 };
 
+//------------------------------------------------------------------------------
+// Orders Items newest first (by timestamp, then by id).
+//------------------------------------------------------------------------------
+struct Item_Newer {
+    bool operator()(const Item* lhs, const Item* rhs) const {
+        if (lhs->timestamp != rhs->timestamp) {
+            return lhs->timestamp > rhs->timestamp;
+        }
+        return lhs->id > rhs->id;
+    }
+};
+
+class Query;
+
+//------------------------------------------------------------------------------
+// Whether a tag filter matches Items associated with any or all of its tags.
+//------------------------------------------------------------------------------
+enum Tag_Match { MATCH_ANY, MATCH_ALL };
+
+//------------------------------------------------------------------------------
+// A tag title paired with a number of Items.
+//------------------------------------------------------------------------------
+typedef std::pair<std::string, long> Tag_Count;
+
+//------------------------------------------------------------------------------
+// Orders Tag_Counts by descending count, then by title.
+//------------------------------------------------------------------------------
+struct Tag_Count_Rank {
+    bool operator()(const Tag_Count& lhs, const Tag_Count& rhs) const {
+        if (lhs.second != rhs.second) {
+            return lhs.second > rhs.second;
+        }
+        return lhs.first < rhs.first;
+    }
+};
+
 //------------------------------------------------------------------------------
 // Simple Item serialization interface.
 //------------------------------------------------------------------------------
@@ -33,11 +71,25 @@ class Serializer {
         virtual void write(Item& i) 
             throw(std::runtime_error) = 0;
 
+        //---------------------------------------------------------------------
+        // Batches. Between begin_batch() and commit_batch() the calls may be
+        // grouped into one transaction, committed at once or discarded by
+        // rollback_batch(). Serializers without transactions ignore them.
+        // @throw If a batch is already open (begin_batch), or it cannot be
+        //        started, committed or rolled back.
+        //---------------------------------------------------------------------
+        virtual void begin_batch()
+            throw(std::runtime_error) {}
+        virtual void commit_batch()
+            throw(std::runtime_error) {}
+        virtual void rollback_batch()
+            throw(std::runtime_error) {}
+
         //---------------------------------------------------------------------
         // @param tags    An in vector of tag strings.
         // @param items   An out vector to store the Items.
         // @post  All Items associated with the tags are returned in the out 
-        //        parameter.
+        //        parameter, newest first.
         // @throw If errors occur reading the Item.
         //---------------------------------------------------------------------
         virtual void read(const std::vector<std::string>& tags, 
@@ -45,6 +97,84 @@ class Serializer {
 
             throw(std::runtime_error) = 0;
 
+        //---------------------------------------------------------------------
+        // @param tags An in vector of tag strings.
+        // @param mode Whether Items must be associated with any or all of the
+        //             tags.
+        // @return The number of Items matching the tags (with MATCH_ANY, the
+        //         number read() would return); the Items are not read. An
+        //         empty filter matches no Items.
+        // @throw If errors occur reading the tags.
+        //---------------------------------------------------------------------
+        virtual long count(const std::vector<std::string>& tags, Tag_Match mode)
+            throw(std::runtime_error) = 0;
+
+        //---------------------------------------------------------------------
+        // @param tags An in vector of tag strings.
+        // @return Whether any Item is associated with any of the tags.
+        // @throw If errors occur reading the tags.
+        //---------------------------------------------------------------------
+        virtual bool exists(const std::vector<std::string>& tags)
+            throw(std::runtime_error) = 0;
+
+        //---------------------------------------------------------------------
+        // @param q     A parsed boolean tag query (see query.h).
+        // @param items An out vector to store the Items.
+        // @post  All Items matching the query are returned in the out 
+        //        parameter, newest first.
+        // @throw If errors occur reading the Items.
+        //---------------------------------------------------------------------
+        virtual void query(const Query& q, std::vector<Item*>& items)
+            throw(std::runtime_error) = 0;
+
+        //---------------------------------------------------------------------
+        // @param ids   An in vector of ItemIDs.
+        // @param items An out vector to store the Items.
+        // @post  The stored Items with the ids are returned in the out
+        //        parameter, in the order of the ids. Unknown and repeated ids
+        //        are skipped.
+        // @throw If errors occur reading the Items.
+        //---------------------------------------------------------------------
+        virtual void read_by_id(const std::vector<int>& ids,
+                                std::vector<Item*>& items)
+            throw(std::runtime_error) = 0;
+
+        //---------------------------------------------------------------------
+        // @param title The exact (case sensitive) Item title.
+        // @param items An out vector to store the Items.
+        // @post  All Items with the title are returned in the out parameter,
+        //        newest first.
+        // @throw If errors occur reading the Items.
+        //---------------------------------------------------------------------
+        virtual void find_by_title(const std::string& title,
+                                   std::vector<Item*>& items)
+            throw(std::runtime_error) = 0;
+
+        //---------------------------------------------------------------------
+        // @param from  Inclusive lower bound in microseconds since the epoch.
+        // @param to    Exclusive upper bound in microseconds since the epoch.
+        // @param items An out vector to store the Items.
+        // @post  All Items last modified within [from, to) are returned in
+        //        the out parameter, oldest first.
+        // @throw If errors occur reading the Items.
+        //---------------------------------------------------------------------
+        virtual void read_range(int64_t from, int64_t to,
+                                std::vector<Item*>& items)
+            throw(std::runtime_error) = 0;
+
+        //---------------------------------------------------------------------
+        // @param tags  An in vector of tag strings.
+        // @param limit The maximum number of Items to return.
+        // @param items An out vector to store the Items.
+        // @post  The limit most recently modified Items associated with any
+        //        of the tags are returned in the out parameter, newest first.
+        // @throw If errors occur reading the Items.
+        //---------------------------------------------------------------------
+        virtual void read_recent(const std::vector<std::string>& tags,
+                                 size_t limit,
+                                 std::vector<Item*>& items)
+            throw(std::runtime_error) = 0;
+
         //---------------------------------------------------------------------
         // @param i The item to be deleted
         // @pre     The item is stored.
@@ -61,5 +191,38 @@ class Serializer {
         //---------------------------------------------------------------------
         virtual void tags(std::vector<std::string>& tags) 
             throw(std::runtime_error) = 0;
+
+        //---------------------------------------------------------------------
+        // @param prefix The (case insensitive) start of the tag titles.
+        // @param limit  The maximum number of tags to return.
+        // @param tags   Out vector of tag strings
+        // @post  Up to limit tags starting with prefix are loaded into the 
+        //        out vector, most used first.
+        // @throw If errors occur reading the tags.
+        //---------------------------------------------------------------------
+        virtual void complete_tags(const std::string& prefix, size_t limit,
+                                   std::vector<std::string>& tags)
+            throw(std::runtime_error) = 0;
+
+        //---------------------------------------------------------------------
+        // @param tag The tag title.
+        // @return The number of Items associated with the tag.
+        // @throw If errors occur reading the tag.
+        //---------------------------------------------------------------------
+        virtual long tag_count(const std::string& tag)
+            throw(std::runtime_error) = 0;
+
+        //---------------------------------------------------------------------
+        // @param tags   An in vector of tag strings to filter by (any match).
+        //               An empty filter matches every Item.
+        // @param counts Out vector of tags and Item counts.
+        // @post  For every tag associated with an Item matching the filter,
+        //        the number of matching Items associated with it is loaded
+        //        into the out vector, highest count first.
+        // @throw If errors occur reading the tags.
+        //---------------------------------------------------------------------
+        virtual void facets(const std::vector<std::string>& tags,
+                            std::vector<Tag_Count>& counts)
+            throw(std::runtime_error) = 0;
 };
 #endif
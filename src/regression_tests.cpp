@@ -1,6 +1,13 @@
 #include "gpgme_wrapper.h"
+#include "sqlite3_serializer.h"
+#include "encrypting_serializer.h"
+#include "memory_serializer.h"
+#include "query.h"
+#include "test_keyring.h"
+#include <algorithm>
 #include <stdexcept>
 #include <iostream>
+#include <sstream>
 using namespace std;
 
 string list_keys(const GPGME_Wrapper&);
@@ -12,17 +19,28 @@ string encrypt_and_display(const string&,
 void decrypt_and_display(const string& cipher,
                          GPGME_Wrapper& gw);
 
+void stream_through_db(const string&, GPGME_Wrapper&);
+
+void pipeline_through_db(const string&, GPGME_Wrapper&);
+
+void memory_matches_db();
+
 int main() {
     try {
+        Test_Keyring keyring;
         GPGME_Wrapper gw;
         string key = list_keys(gw);
         string cipher = encrypt_and_display(
             "L'enfer, c'est les autres", key, gw
         );
         decrypt_and_display(cipher, gw);
+        stream_through_db(key, gw);
+        pipeline_through_db(key, gw);
+        memory_matches_db();
     }
     catch(const exception& e) {
         cout << e.what() << endl;
+        return 1;
     }
 }
 
@@ -53,3 +71,192 @@ void decrypt_and_display(const string& cipher,
     string text = gw.decrypt(cipher);
     cout << "Decrypted text:\t" << text << endl;
 }
+
+//-----------------------------------------------------------------------------
+// Encrypts a large note into a spool, streams the cipher into a DB and back
+// out through the decryption, and checks the round trip.
+//-----------------------------------------------------------------------------
+void stream_through_db(const string& key, GPGME_Wrapper& gw) {
+
+    string text;
+    while (text.size() < 8 * 1024 * 1024) {
+        text += "L'enfer, c'est les autres. ";
+    }
+    SQLite3_Serializer db(":memory:");
+    Item item;
+    item.id = 0;
+    item.encrypted = true;
+    item.title = "Huis clos";
+
+    String_Source plaintext(text);
+    Spool cipher;
+    gw.encrypt(plaintext, key, cipher);
+    cipher.rewind();
+    db.write(item, cipher, cipher.size());
+
+    string decrypted;
+    String_Sink sink(decrypted);
+    Content_Reader reader(db, item.id);
+    gw.decrypt(reader, sink);
+
+    cout << "Streamed " << text.size() << " bytes (" << cipher.size() 
+         << " encrypted): " << (decrypted == text ? "OK" : "MISMATCH") 
+         << endl;
+}
+
+//-----------------------------------------------------------------------------
+// Writes notes, every other one encrypted, through an Encrypting_Serializer
+// in pipelined batches, reads them back by id the same way, and checks that
+// the round trip returns them as written while only the encrypted ones are
+// stored as cipher text.
+//-----------------------------------------------------------------------------
+void pipeline_through_db(const string& key, GPGME_Wrapper& gw) {
+
+    SQLite3_Serializer db(":memory:");
+    Single_Key_Policy policy(key);
+    Encrypting_Serializer encrypting(db, gw, policy, 8);
+
+    vector<Item*> items;
+    for (int i = 0; i < 50; ++i) {
+        Item* item = new Item;
+        item->id = 0;
+        item->encrypted = i % 2 == 0;
+        item->title = "Les mouches";
+        item->content = string(i + 1, 'a' + i % 26);
+        item->tags.push_back(i % 3 ? "Sartre" : "Camus");
+        items.push_back(item);
+    }
+    vector<int> ids;
+    vector<Item*> stored, read;
+    bool ok = true;
+    try {
+        encrypting.write(items);
+        for (size_t i = 0; i < items.size(); ++i) {
+            ids.push_back(items[i]->id);
+        }
+        db.read_by_id(ids, stored);
+        encrypting.read_by_id(ids, read);
+
+        ok = read.size() == items.size() && stored.size() == items.size();
+        for (size_t i = 0; ok && i < items.size(); ++i) {
+            ok = read[i]->id        == items[i]->id &&
+                 read[i]->encrypted == items[i]->encrypted &&
+                 read[i]->content   == items[i]->content &&
+                 read[i]->tags      == items[i]->tags &&
+                 stored[i]->encrypted == items[i]->encrypted &&
+                 (stored[i]->content == items[i]->content) != 
+                     items[i]->encrypted;
+        }
+    }
+    catch (const exception& e) {
+        cout << e.what() << endl;
+        ok = false;
+    }
+    for (size_t i = 0; i < items.size(); ++i) {
+        delete items[i];
+    }
+    for (size_t i = 0; i < stored.size(); ++i) {
+        delete stored[i];
+    }
+    for (size_t i = 0; i < read.size(); ++i) {
+        delete read[i];
+    }
+    cout << "Pipelined " << ids.size() << " notes through the DB: "
+         << (ok ? "OK" : "MISMATCH") << endl;
+    if (!ok) {
+        throw runtime_error("Pipelined round trip failed");
+    }
+}
+
+//-----------------------------------------------------------------------------
+// @return The items as text, one line each, in order, with the tags sorted.
+//-----------------------------------------------------------------------------
+string describe(vector<Item*>& items) {
+    string text;
+    for (size_t i = 0; i < items.size(); ++i) {
+        vector<string> tags = items[i]->tags;
+        sort(tags.begin(), tags.end());
+        text += items[i]->title + "|" + items[i]->content + "|";
+        for (size_t j = 0; j < tags.size(); ++j) {
+            text += tags[j] + ",";
+        }
+        text += "\n";
+        delete items[i];
+    }
+    items.clear();
+    return text;
+}
+
+//-----------------------------------------------------------------------------
+// Makes the same writes, updates and trashes through a Memory_Serializer and
+// a SQLite3_Serializer, and checks that reads and queries of both agree in
+// content and order.
+//-----------------------------------------------------------------------------
+void memory_matches_db() {
+
+    SQLite3_Serializer db(":memory:");
+    Memory_Serializer memory;
+    Serializer* stores[] = { &db, &memory };
+
+    const char* tags[] = { "Sartre", "Camus", "sartre", "Beauvoir" };
+    for (int i = 0; i < 24; ++i) {
+        Item item;
+        item.encrypted = false;
+        item.title = i % 4 ? "Les mouches" : "Huis clos";
+        item.content = string(i + 1, 'a' + i % 26);
+        item.tags.push_back(tags[i % 4]);
+        if (i % 3 == 0) {
+            item.tags.push_back("Camus");
+        }
+        item.id = 0;
+        Item copies[] = { item, item };
+        for (int s = 0; s < 2; ++s) {
+            stores[s]->write(copies[s]);
+            if (i % 5 == 0) {
+                copies[s].tags.assign(1, "Beauvoir");
+                copies[s].content += " (revised)";
+                stores[s]->write(copies[s]);
+            }
+            if (i % 7 == 3) {
+                stores[s]->trash(copies[s]);
+            }
+        }
+    }
+
+    vector<string> filter;
+    filter.push_back("sartre");
+    filter.push_back("BEAUVOIR");
+    const char* queries[] = {
+        "Sartre", "Camus AND NOT Beauvoir", "(Sartre OR Beauvoir) AND Camus",
+        "title:clos", "NOT title:mouches"
+    };
+    const size_t query_count = sizeof(queries) / sizeof(queries[0]);
+
+    string results[2];
+    for (int s = 0; s < 2; ++s) {
+        vector<Item*> items;
+        stores[s]->read(filter, items);
+        results[s] += describe(items);
+        for (size_t q = 0; q < query_count; ++q) {
+            stores[s]->query(Query(queries[q]), items);
+            results[s] += describe(items);
+        }
+        stores[s]->read_recent(filter, 5, items);
+        results[s] += describe(items);
+
+        vector<string> all;
+        stores[s]->tags(all);
+        sort(all.begin(), all.end());
+        for (size_t i = 0; i < all.size(); ++i) {
+            ostringstream count;
+            count << all[i] << "=" << stores[s]->tag_count(all[i]) << "\n";
+            results[s] += count.str();
+        }
+    }
+    bool ok = results[0] == results[1];
+    cout << "Memory store matches the DB: " << (ok ? "OK" : "MISMATCH") 
+         << endl;
+    if (!ok) {
+        throw runtime_error("Memory and DB stores differ");
+    }
+}
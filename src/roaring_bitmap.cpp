@@ -0,0 +1,399 @@
+#include "roaring_bitmap.h"
+#include <algorithm>
+#include <iterator>
+using namespace std;
+
+//------------------------------------------------------------------------------
+// Container limits. A sparse container holding more than ARRAY_MAX values
+// takes more room than a bitset, so it is converted (and back again when it
+// shrinks).
+//------------------------------------------------------------------------------
+const uint32_t ARRAY_MAX    = 4096;
+const size_t   BITSET_WORDS = 65536 / 64;
+
+//------------------------------------------------------------------------------
+// Stateless utility functions
+//------------------------------------------------------------------------------
+inline bool test_bit(const vector<uint64_t>& bits, uint16_t low) {
+    return (bits[low >> 6] >> (low & 63)) & 1;
+}
+
+inline uint32_t count_bits(const vector<uint64_t>& bits) {
+    uint32_t count = 0;
+    for (size_t i = 0; i < BITSET_WORDS; ++i) {
+        count += __builtin_popcountll(bits[i]);
+    }
+    return count;
+}
+
+//------------------------------------------------------------------------------
+// Container representation changes.
+//------------------------------------------------------------------------------
+template <typename C>
+void to_bitset(C& c) {
+    c.bits.assign(BITSET_WORDS, 0);
+    for (size_t i = 0; i < c.array.size(); ++i) {
+        c.bits[c.array[i] >> 6] |= uint64_t(1) << (c.array[i] & 63);
+    }
+    vector<uint16_t>().swap(c.array);
+}
+
+template <typename C>
+void to_array(C& c) {
+    c.array.clear();
+    c.array.reserve(c.cardinality);
+    for (size_t i = 0; i < BITSET_WORDS; ++i) {
+        for (uint64_t word = c.bits[i]; word; word &= word - 1) {
+            c.array.push_back(i * 64 + __builtin_ctzll(word));
+        }
+    }
+    vector<uint64_t>().swap(c.bits);
+}
+
+//------------------------------------------------------------------------------
+// Switches a container to the representation matching its cardinality.
+//------------------------------------------------------------------------------
+template <typename C>
+void normalize(C& c) {
+    if (!c.dense() && c.cardinality > ARRAY_MAX) {
+        to_bitset(c);
+    }
+    else if (c.dense() && c.cardinality <= ARRAY_MAX) {
+        to_array(c);
+    }
+}
+
+//------------------------------------------------------------------------------
+// Orders containers by key.
+//------------------------------------------------------------------------------
+struct Container_Key_Less {
+    template <typename C>
+    bool operator()(const C& c, uint16_t key) const { return c.key < key; }
+};
+
+//------------------------------------------------------------------------------
+// Single value operations
+//------------------------------------------------------------------------------
+Roaring_Bitmap::Container* Roaring_Bitmap::find(uint16_t key) {
+    vector<Container>::iterator it = lower_bound(
+        m_containers.begin(), m_containers.end(), key, Container_Key_Less()
+    );
+    return (it == m_containers.end() || it->key != key) ? 0 : &*it;
+}
+
+const Roaring_Bitmap::Container* Roaring_Bitmap::find(uint16_t key) const {
+    vector<Container>::const_iterator it = lower_bound(
+        m_containers.begin(), m_containers.end(), key, Container_Key_Less()
+    );
+    return (it == m_containers.end() || it->key != key) ? 0 : &*it;
+}
+
+//------------------------------------------------------------------------------
+void Roaring_Bitmap::add(uint32_t value) {
+    uint16_t key = value >> 16, low = value & 0xFFFF;
+
+    Container* c = 0;
+    if (m_containers.empty() || m_containers.back().key < key) {
+        m_containers.push_back(Container(key));
+        c = &m_containers.back();
+    }
+    else if (!(c = find(key))) {
+        c = &*m_containers.insert(
+            lower_bound(m_containers.begin(), m_containers.end(), key,
+                        Container_Key_Less()),
+            Container(key)
+        );
+    }
+
+    if (c->dense()) {
+        uint64_t& word = c->bits[low >> 6];
+        uint64_t  mask = uint64_t(1) << (low & 63);
+        if (!(word & mask)) {
+            word |= mask;
+            ++c->cardinality;
+        }
+        return;
+    }
+    if (c->array.empty() || c->array.back() < low) {
+        c->array.push_back(low);
+    }
+    else {
+        vector<uint16_t>::iterator it =
+            lower_bound(c->array.begin(), c->array.end(), low);
+        if (*it == low) {
+            return;
+        }
+        c->array.insert(it, low);
+    }
+    ++c->cardinality;
+    normalize(*c);
+}
+
+//------------------------------------------------------------------------------
+void Roaring_Bitmap::remove(uint32_t value) {
+    uint16_t key = value >> 16, low = value & 0xFFFF;
+
+    Container* c = find(key);
+    if (!c) {
+        return;
+    }
+    if (c->dense()) {
+        uint64_t& word = c->bits[low >> 6];
+        uint64_t  mask = uint64_t(1) << (low & 63);
+        if (!(word & mask)) {
+            return;
+        }
+        word &= ~mask;
+    }
+    else {
+        vector<uint16_t>::iterator it =
+            lower_bound(c->array.begin(), c->array.end(), low);
+        if (it == c->array.end() || *it != low) {
+            return;
+        }
+        c->array.erase(it);
+    }
+    if (--c->cardinality == 0) {
+        m_containers.erase(m_containers.begin() + (c - &m_containers[0]));
+    }
+    else {
+        normalize(*c);
+    }
+}
+
+//------------------------------------------------------------------------------
+bool Roaring_Bitmap::contains(uint32_t value) const {
+    const Container* c = find(value >> 16);
+    if (!c) {
+        return false;
+    }
+    uint16_t low = value & 0xFFFF;
+    return c->dense() ? test_bit(c->bits, low)
+                      : binary_search(c->array.begin(), c->array.end(), low);
+}
+
+//------------------------------------------------------------------------------
+uint64_t Roaring_Bitmap::cardinality() const {
+    uint64_t count = 0;
+    for (size_t i = 0; i < m_containers.size(); ++i) {
+        count += m_containers[i].cardinality;
+    }
+    return count;
+}
+
+//------------------------------------------------------------------------------
+size_t Roaring_Bitmap::memory_used() const {
+    size_t bytes = m_containers.capacity() * sizeof(Container);
+    for (size_t i = 0; i < m_containers.size(); ++i) {
+        bytes += m_containers[i].array.capacity() * sizeof(uint16_t) +
+                 m_containers[i].bits.capacity()  * sizeof(uint64_t);
+    }
+    return bytes;
+}
+
+//------------------------------------------------------------------------------
+void Roaring_Bitmap::values(vector<uint32_t>& out) const {
+    out.reserve(out.size() + cardinality());
+    for (size_t i = 0; i < m_containers.size(); ++i) {
+        const Container& c = m_containers[i];
+        uint32_t high = uint32_t(c.key) << 16;
+
+        if (!c.dense()) {
+            for (size_t j = 0; j < c.array.size(); ++j) {
+                out.push_back(high | c.array[j]);
+            }
+            continue;
+        }
+        for (size_t j = 0; j < BITSET_WORDS; ++j) {
+            for (uint64_t word = c.bits[j]; word; word &= word - 1) {
+                out.push_back(high | (j * 64 + __builtin_ctzll(word)));
+            }
+        }
+    }
+}
+
+//------------------------------------------------------------------------------
+// Set operations. Containers are matched by key with a merge over the two
+// sorted container lists; each pair is combined according to the two
+// representations involved.
+//------------------------------------------------------------------------------
+Roaring_Bitmap& Roaring_Bitmap::operator|=(const Roaring_Bitmap& other) {
+    vector<Container> result;
+    result.reserve(m_containers.size() + other.m_containers.size());
+
+    size_t i = 0, j = 0;
+    while (i < m_containers.size() || j < other.m_containers.size()) {
+        if (j == other.m_containers.size() ||
+            (i < m_containers.size() &&
+             m_containers[i].key < other.m_containers[j].key)) {
+
+            result.push_back(Container(0));
+            result.back().swap(m_containers[i++]);
+            continue;
+        }
+        if (i == m_containers.size() ||
+            other.m_containers[j].key < m_containers[i].key) {
+
+            result.push_back(other.m_containers[j++]);
+            continue;
+        }
+        result.push_back(Container(0));
+        Container& c = result.back();
+        c.swap(m_containers[i++]);
+        const Container& o = other.m_containers[j++];
+
+        if (c.dense() || o.dense()) {
+            if (!c.dense()) {
+                to_bitset(c);
+            }
+            if (o.dense()) {
+                for (size_t w = 0; w < BITSET_WORDS; ++w) {
+                    c.bits[w] |= o.bits[w];
+                }
+            }
+            else {
+                for (size_t k = 0; k < o.array.size(); ++k) {
+                    c.bits[o.array[k] >> 6] |= uint64_t(1) << (o.array[k] & 63);
+                }
+            }
+            c.cardinality = count_bits(c.bits);
+        }
+        else {
+            vector<uint16_t> merged;
+            merged.reserve(c.array.size() + o.array.size());
+            set_union(c.array.begin(), c.array.end(),
+                      o.array.begin(), o.array.end(), back_inserter(merged));
+            c.array.swap(merged);
+            c.cardinality = c.array.size();
+        }
+        normalize(c);
+    }
+    m_containers.swap(result);
+    return *this;
+}
+
+//------------------------------------------------------------------------------
+Roaring_Bitmap& Roaring_Bitmap::operator&=(const Roaring_Bitmap& other) {
+    vector<Container> result;
+
+    size_t i = 0, j = 0;
+    while (i < m_containers.size() && j < other.m_containers.size()) {
+        if (m_containers[i].key < other.m_containers[j].key) {
+            ++i;
+            continue;
+        }
+        if (other.m_containers[j].key < m_containers[i].key) {
+            ++j;
+            continue;
+        }
+        result.push_back(Container(0));
+        Container& c = result.back();
+        c.swap(m_containers[i++]);
+        const Container& o = other.m_containers[j++];
+
+        if (c.dense() && o.dense()) {
+            for (size_t w = 0; w < BITSET_WORDS; ++w) {
+                c.bits[w] &= o.bits[w];
+            }
+            c.cardinality = count_bits(c.bits);
+        }
+        else if (c.dense()) {
+            vector<uint16_t> kept;
+            for (size_t k = 0; k < o.array.size(); ++k) {
+                if (test_bit(c.bits, o.array[k])) {
+                    kept.push_back(o.array[k]);
+                }
+            }
+            vector<uint64_t>().swap(c.bits);
+            c.array.swap(kept);
+            c.cardinality = c.array.size();
+        }
+        else {
+            vector<uint16_t> kept;
+            if (o.dense()) {
+                for (size_t k = 0; k < c.array.size(); ++k) {
+                    if (test_bit(o.bits, c.array[k])) {
+                        kept.push_back(c.array[k]);
+                    }
+                }
+            }
+            else {
+                set_intersection(c.array.begin(), c.array.end(),
+                                 o.array.begin(), o.array.end(),
+                                 back_inserter(kept));
+            }
+            c.array.swap(kept);
+            c.cardinality = c.array.size();
+        }
+        if (c.cardinality == 0) {
+            result.pop_back();
+        }
+        else {
+            normalize(c);
+        }
+    }
+    m_containers.swap(result);
+    return *this;
+}
+
+//------------------------------------------------------------------------------
+Roaring_Bitmap& Roaring_Bitmap::operator-=(const Roaring_Bitmap& other) {
+    vector<Container> result;
+    result.reserve(m_containers.size());
+
+    size_t j = 0;
+    for (size_t i = 0; i < m_containers.size(); ++i) {
+        while (j < other.m_containers.size() &&
+               other.m_containers[j].key < m_containers[i].key) {
+            ++j;
+        }
+        result.push_back(Container(0));
+        Container& c = result.back();
+        c.swap(m_containers[i]);
+
+        if (j == other.m_containers.size() ||
+            other.m_containers[j].key != c.key) {
+            continue;
+        }
+        const Container& o = other.m_containers[j];
+
+        if (c.dense()) {
+            if (o.dense()) {
+                for (size_t w = 0; w < BITSET_WORDS; ++w) {
+                    c.bits[w] &= ~o.bits[w];
+                }
+            }
+            else {
+                for (size_t k = 0; k < o.array.size(); ++k) {
+                    c.bits[o.array[k] >> 6] &= ~(uint64_t(1) << (o.array[k] & 63));
+                }
+            }
+            c.cardinality = count_bits(c.bits);
+        }
+        else {
+            vector<uint16_t> kept;
+            if (o.dense()) {
+                for (size_t k = 0; k < c.array.size(); ++k) {
+                    if (!test_bit(o.bits, c.array[k])) {
+                        kept.push_back(c.array[k]);
+                    }
+                }
+            }
+            else {
+                set_difference(c.array.begin(), c.array.end(),
+                               o.array.begin(), o.array.end(),
+                               back_inserter(kept));
+            }
+            c.array.swap(kept);
+            c.cardinality = c.array.size();
+        }
+        if (c.cardinality == 0) {
+            result.pop_back();
+        }
+        else {
+            normalize(c);
+        }
+    }
+    m_containers.swap(result);
+    return *this;
+}
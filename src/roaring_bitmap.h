@@ -0,0 +1,78 @@
+#ifndef ROARING_BITMAP_H
+#define ROARING_BITMAP_H
+
+#include <algorithm>
+#include <vector>
+#include <stdint.h>
+
+//------------------------------------------------------------------------------
+// Compressed set of 32 bit integers after the Roaring bitmap layout: values are
+// partitioned by their high 16 bits into containers, each holding the low 16
+// bits either as a sorted array (sparse) or as a 65536 bit bitset (dense).
+// Set operations on two bitsets are plain loops over 64 bit words, which the
+// compiler vectorizes.
+//------------------------------------------------------------------------------
+class Roaring_Bitmap {
+
+    public:
+        Roaring_Bitmap() {}
+
+        //----------------------------------------------------------------------
+        // @post value is a member of the set. Adding values in ascending order
+        //       appends without searching.
+        //----------------------------------------------------------------------
+        void add(uint32_t value);
+
+        //----------------------------------------------------------------------
+        // @post value is not a member of the set.
+        //----------------------------------------------------------------------
+        void remove(uint32_t value);
+
+        bool     contains(uint32_t value) const;
+        uint64_t cardinality()            const;
+        bool     empty()                  const { return m_containers.empty(); }
+        void     clear()                        { m_containers.clear(); }
+
+        //----------------------------------------------------------------------
+        // In place union, intersection and difference.
+        //----------------------------------------------------------------------
+        Roaring_Bitmap& operator|=(const Roaring_Bitmap& other);
+        Roaring_Bitmap& operator&=(const Roaring_Bitmap& other);
+        Roaring_Bitmap& operator-=(const Roaring_Bitmap& other);
+
+        //----------------------------------------------------------------------
+        // @param out Out vector of values.
+        // @post  All members are appended to the out vector in ascending order.
+        //----------------------------------------------------------------------
+        void values(std::vector<uint32_t>& out) const;
+
+        //----------------------------------------------------------------------
+        // @return The heap bytes held by the containers (as allocated).
+        //----------------------------------------------------------------------
+        size_t memory_used() const;
+
+    private:
+        struct Container {
+            uint16_t              key;
+            uint32_t              cardinality;
+            std::vector<uint16_t> array;    // Sorted; used while sparse
+            std::vector<uint64_t> bits;     // Used once dense
+
+            explicit Container(uint16_t k) : key(k), cardinality(0) {}
+            bool dense() const { return !bits.empty(); }
+
+            void swap(Container& other) {
+                std::swap(key, other.key);
+                std::swap(cardinality, other.cardinality);
+                array.swap(other.array);
+                bits.swap(other.bits);
+            }
+        };
+
+        Container* find(uint16_t key);
+        const Container* find(uint16_t key) const;
+
+        std::vector<Container> m_containers;    // Sorted by key
+};
+
+#endif
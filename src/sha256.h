@@ -0,0 +1,43 @@
+#ifndef SHA256_H
+#define SHA256_H
+
+#include <string>
+#include <stdint.h>
+
+//------------------------------------------------------------------------------
+// Incremental SHA-256 (FIPS 180-4) message digest.
+//------------------------------------------------------------------------------
+class SHA256 {
+
+    public:
+        static const size_t DIGEST_SIZE = 32;
+
+        SHA256();
+
+        //----------------------------------------------------------------------
+        // @post The bytes are appended to the message.
+        //----------------------------------------------------------------------
+        void update(const void* data, size_t size);
+
+        //----------------------------------------------------------------------
+        // @return The DIGEST_SIZE byte digest of the message so far.
+        // @post   The object is reset for a new message.
+        //----------------------------------------------------------------------
+        std::string digest();
+
+        //----------------------------------------------------------------------
+        // @return The digest of the message.
+        //----------------------------------------------------------------------
+        static std::string digest(const std::string& message);
+
+    private:
+        void reset();
+        void transform(const unsigned char* block);
+
+        uint32_t      m_state[8];
+        uint64_t      m_length;         // Bytes hashed so far
+        unsigned char m_block[64];
+        size_t        m_used;           // Bytes of m_block filled
+};
+
+#endif
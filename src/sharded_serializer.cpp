@@ -0,0 +1,599 @@
+#include "sharded_serializer.h"
+#include <algorithm>
+#include <climits>
+#include <map>
+#include <set>
+using namespace std;
+
+//------------------------------------------------------------------------------
+// One read of a single shard, run on the thread pool. The request fields are
+// copied from a prototype; the results are owned until handed to the caller.
+//------------------------------------------------------------------------------
+class Shard_Read : public Thread_Pool::Task {
+
+    public:
+        enum Op { READ, QUERY, BY_ID, BY_TITLE, RANGE, RECENT, FACETS,
+                  COUNT, COMPLETE, TAG_COUNTS };
+
+        explicit Shard_Read(Op o) : op(o), db(0), lock(0), index(0), tags(0),
+                                    query(0), ids(0), title(0), from(0), to(0),
+                                    limit(0), match(MATCH_ANY), total(0) {}
+
+        ~Shard_Read() {
+            for (size_t i = 0; i < items.size(); ++i) {
+                delete items[i];
+            }
+        }
+
+        virtual void run() {
+            Mutex_Lock guard(*lock);
+            switch (op) {
+                case READ:     db->read(*tags, items);                  break;
+                case QUERY:    db->query(*query, items);                break;
+                case BY_ID:    db->read_by_id((*ids)[index], items);    break;
+                case BY_TITLE: db->find_by_title(*title, items);        break;
+                case RANGE:    db->read_range(from, to, items);         break;
+                case RECENT:   db->read_recent(*tags, limit, items);    break;
+                case FACETS:   db->facets(*tags, counts);               break;
+                case COUNT:    total = db->count(*tags, match);         break;
+                case COMPLETE:
+                    db->complete_tags(*title, limit, titles);
+                    break;
+                case TAG_COUNTS:
+                    for (size_t i = 0; i < tags->size(); ++i) {
+                        counts.push_back(Tag_Count((*tags)[i],
+                                                   db->tag_count((*tags)[i])));
+                    }
+                    break;
+            }
+        }
+
+        Op                              op;
+        SQLite3_Serializer*             db;
+        pthread_mutex_t*                lock;
+        size_t                          index;
+        const vector<string>*           tags;
+        const Query*                    query;
+        const vector<vector<int> >*     ids;        // Local ids by shard
+        const string*                   title;
+        int64_t                         from;
+        int64_t                         to;
+        size_t                          limit;
+        Tag_Match                       match;
+        vector<Item*>                   items;
+        long                            total;
+        vector<Tag_Count>               counts;
+        vector<string>                  titles;
+};
+
+//------------------------------------------------------------------------------
+// Owns the reads of one fan out.
+//------------------------------------------------------------------------------
+struct Shard_Reads {
+    vector<Shard_Read*> reads;
+
+    ~Shard_Reads() {
+        for (size_t i = 0; i < reads.size(); ++i) {
+            delete reads[i];
+        }
+    }
+};
+
+//------------------------------------------------------------------------------
+// Orders Items oldest first, the reverse of Item_Newer.
+//------------------------------------------------------------------------------
+struct Item_Older {
+    bool operator()(const Item* lhs, const Item* rhs) const {
+        return Item_Newer()(rhs, lhs);
+    }
+};
+
+//------------------------------------------------------------------------------
+// Ctor: Opens the shards and builds the global tag dictionary.
+//------------------------------------------------------------------------------
+Sharded_Serializer::Sharded_Serializer(const vector<string>& db_specs,
+                                       const SQLite3_Options& options,
+                                       size_t threads)
+    throw(runtime_error) : m_pool(threads ? threads : db_specs.size()),
+                           m_next_tag_id(1),
+                           m_next_shard(0) {
+
+    pthread_mutex_init(&m_mutex, NULL);
+    try {
+        if (db_specs.empty()) {
+            throw runtime_error("A sharded serializer needs at least one shard");
+        }
+        for (size_t i = 0; i < db_specs.size(); ++i) {
+            Shard* shard = new Shard;
+            try {
+                shard->db = new SQLite3_Serializer(db_specs[i].c_str(), options);
+            }
+            catch (...) {
+                delete shard;
+                throw;
+            }
+            pthread_mutex_init(&shard->lock, NULL);
+            m_shards.push_back(shard);
+
+            vector<string> titles;
+            shard->db->tags(titles);
+            learn_tags(titles);
+        }
+    }
+    catch (...) {
+        for (size_t i = 0; i < m_shards.size(); ++i) {
+            delete m_shards[i]->db;
+            pthread_mutex_destroy(&m_shards[i]->lock);
+            delete m_shards[i];
+        }
+        pthread_mutex_destroy(&m_mutex);
+        throw;
+    }
+}
+
+//------------------------------------------------------------------------------
+// Dtor
+//------------------------------------------------------------------------------
+Sharded_Serializer::~Sharded_Serializer() {
+    for (size_t i = 0; i < m_shards.size(); ++i) {
+        delete m_shards[i]->db;
+        pthread_mutex_destroy(&m_shards[i]->lock);
+        delete m_shards[i];
+    }
+    pthread_mutex_destroy(&m_mutex);
+}
+
+//------------------------------------------------------------------------------
+// Run a copy of the request against every shard in parallel.
+//------------------------------------------------------------------------------
+void Sharded_Serializer::fan_out(const Shard_Read& request,
+                                 vector<Shard_Read*>& reads)
+    throw(runtime_error) {
+
+    vector<Thread_Pool::Task*> tasks;
+    for (size_t i = 0; i < m_shards.size(); ++i) {
+        Shard_Read* read = new Shard_Read(request.op);
+        reads.push_back(read);
+        read->db    = m_shards[i]->db;
+        read->lock  = &m_shards[i]->lock;
+        read->index = i;
+        read->tags  = request.tags;
+        read->query = request.query;
+        read->ids   = request.ids;
+        read->title = request.title;
+        read->from  = request.from;
+        read->to    = request.to;
+        read->limit = request.limit;
+        read->match = request.match;
+        tasks.push_back(read);
+    }
+    m_pool.run(tasks);
+}
+
+//------------------------------------------------------------------------------
+// Move the items of all reads to the out vector with global ids. Every shard
+// returns its items ordered by timestamp and then by id, and the local ids of a
+// shard are in the order of their global ids, so the runs are merged one by
+// one. Runs in no such order (items read by id) are only appended.
+//------------------------------------------------------------------------------
+void Sharded_Serializer::collect(vector<Shard_Read*>& reads,
+                                 Order order,
+                                 vector<Item*>& out_items)
+    throw(runtime_error) {
+
+    size_t shards = m_shards.size();
+    size_t first  = out_items.size();
+
+    // All ids are checked and the room reserved before any item moves, so
+    // that a throw leaves the out vector as it was
+    size_t total = 0;
+    for (size_t i = 0; i < reads.size(); ++i) {
+        vector<Item*>& items = reads[i]->items;
+        for (size_t j = 0; j < items.size(); ++j) {
+            if (items[j]->id > (INT_MAX - int(shards)) / int(shards)) {
+                throw runtime_error("Item id out of range for the shard count");
+            }
+        }
+        total += items.size();
+    }
+    out_items.reserve(first + total);
+    for (size_t i = 0; i < reads.size(); ++i) {
+        vector<Item*>& items = reads[i]->items;
+        size_t middle = out_items.size();
+        out_items.insert(out_items.end(), items.begin(), items.end());
+        items.clear();
+
+        for (size_t j = middle; j < out_items.size(); ++j) {
+            out_items[j]->id = out_items[j]->id * shards + reads[i]->index;
+        }
+        if (order == OLDEST_FIRST) {
+            inplace_merge(out_items.begin() + first, out_items.begin() + middle,
+                          out_items.end(), Item_Older());
+        }
+        else if (order == NEWEST_FIRST) {
+            inplace_merge(out_items.begin() + first, out_items.begin() + middle,
+                          out_items.end(), Item_Newer());
+        }
+    }
+}
+
+//------------------------------------------------------------------------------
+// Add unknown titles to the global tag dictionary.
+//------------------------------------------------------------------------------
+void Sharded_Serializer::learn_tags(const vector<string>& titles) {
+    Mutex_Lock lock(m_mutex);
+    for (size_t i = 0; i < titles.size(); ++i) {
+        if (!m_tags.find(titles[i])) {
+            m_tags.insert(m_next_tag_id++, titles[i]);
+        }
+    }
+}
+
+//------------------------------------------------------------------------------
+// Write the item to the shard owning it, or to the next shard in turn if it is
+// new. Only that shard is locked.
+//------------------------------------------------------------------------------
+void Sharded_Serializer::write(Item& record)
+    throw(runtime_error) {
+
+    int    id = record.id;
+    size_t shards = m_shards.size();
+    size_t index;
+    if (id == 0) {
+        Mutex_Lock lock(m_mutex);
+        index = m_next_shard++ % shards;
+    }
+    else {
+        index = id % shards;
+        record.id = id / shards;
+    }
+
+    Shard& shard = *m_shards[index];
+    try {
+        Mutex_Lock lock(shard.lock);
+        shard.db->write(record);
+    }
+    catch (...) {
+        record.id = id;
+        throw;
+    }
+    if (record.id > (INT_MAX - int(shards)) / int(shards)) {
+        throw runtime_error("Item id out of range for the shard count");
+    }
+    record.id = record.id * shards + index;
+    learn_tags(record.tags);
+}
+
+//------------------------------------------------------------------------------
+// Count in all shards; an Item lives in one shard only, so the counts add up.
+//------------------------------------------------------------------------------
+long Sharded_Serializer::count(const vector<string>& tags, Tag_Match mode)
+    throw(runtime_error) {
+
+    Shard_Read request(Shard_Read::COUNT);
+    request.tags  = &tags;
+    request.match = mode;
+
+    Shard_Reads reads;
+    fan_out(request, reads.reads);
+
+    long total = 0;
+    for (size_t i = 0; i < reads.reads.size(); ++i) {
+        total += reads.reads[i]->total;
+    }
+    return total;
+}
+
+//------------------------------------------------------------------------------
+// Ask the shards in turn, up to the first one using any of the tags.
+//------------------------------------------------------------------------------
+bool Sharded_Serializer::exists(const vector<string>& tags)
+    throw(runtime_error) {
+
+    for (size_t i = 0; i < m_shards.size(); ++i) {
+        Mutex_Lock lock(m_shards[i]->lock);
+        if (m_shards[i]->db->exists(tags)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+//------------------------------------------------------------------------------
+// Read the items with the tags from all shards.
+//------------------------------------------------------------------------------
+void Sharded_Serializer::read(const vector<string>& tags,
+                              vector<Item*>& out_items)
+    throw(runtime_error) {
+
+    Shard_Read request(Shard_Read::READ);
+    request.tags = &tags;
+
+    Shard_Reads reads;
+    fan_out(request, reads.reads);
+    collect(reads.reads, NEWEST_FIRST, out_items);
+}
+
+//------------------------------------------------------------------------------
+// Run the query against all shards.
+//------------------------------------------------------------------------------
+void Sharded_Serializer::query(const Query& q, vector<Item*>& out_items)
+    throw(runtime_error) {
+
+    Shard_Read request(Shard_Read::QUERY);
+    request.query = &q;
+
+    Shard_Reads reads;
+    fan_out(request, reads.reads);
+    collect(reads.reads, NEWEST_FIRST, out_items);
+}
+
+//------------------------------------------------------------------------------
+// Split the ids by shard, read them in parallel and restore the order of the
+// ids.
+//------------------------------------------------------------------------------
+void Sharded_Serializer::read_by_id(const vector<int>& ids,
+                                    vector<Item*>& out_items)
+    throw(runtime_error) {
+
+    size_t shards = m_shards.size();
+    vector<vector<int> > local_ids(shards);
+    for (size_t i = 0; i < ids.size(); ++i) {
+        if (ids[i] > 0) {
+            local_ids[ids[i] % shards].push_back(ids[i] / shards);
+        }
+    }
+    Shard_Read request(Shard_Read::BY_ID);
+    request.ids = &local_ids;
+
+    Shard_Reads reads;
+    fan_out(request, reads.reads);
+
+    vector<Item*> fetched;
+    map<int, Item*> by_id;
+    try {
+        collect(reads.reads, UNORDERED, fetched);
+    }
+    catch (...) {
+        for (size_t i = 0; i < fetched.size(); ++i) {
+            delete fetched[i];
+        }
+        throw;
+    }
+    for (size_t i = 0; i < fetched.size(); ++i) {
+        by_id[fetched[i]->id] = fetched[i];
+    }
+    for (size_t i = 0; i < ids.size(); ++i) {
+        map<int, Item*>::iterator it = by_id.find(ids[i]);
+        if (it != by_id.end() && it->second) {
+            out_items.push_back(it->second);
+            it->second = 0;
+        }
+    }
+}
+
+//------------------------------------------------------------------------------
+// Find the items with the title in all shards.
+//------------------------------------------------------------------------------
+void Sharded_Serializer::find_by_title(const string& title,
+                                       vector<Item*>& out_items)
+    throw(runtime_error) {
+
+    Shard_Read request(Shard_Read::BY_TITLE);
+    request.title = &title;
+
+    Shard_Reads reads;
+    fan_out(request, reads.reads);
+    collect(reads.reads, NEWEST_FIRST, out_items);
+}
+
+//------------------------------------------------------------------------------
+// Read the items modified within [from, to) from all shards, oldest first.
+//------------------------------------------------------------------------------
+void Sharded_Serializer::read_range(int64_t from, int64_t to,
+                                    vector<Item*>& out_items)
+    throw(runtime_error) {
+
+    Shard_Read request(Shard_Read::RANGE);
+    request.from = from;
+    request.to   = to;
+
+    Shard_Reads reads;
+    fan_out(request, reads.reads);
+    collect(reads.reads, OLDEST_FIRST, out_items);
+}
+
+//------------------------------------------------------------------------------
+// Read the limit most recent items of every shard and keep the limit most
+// recent of those.
+//------------------------------------------------------------------------------
+void Sharded_Serializer::read_recent(const vector<string>& tags,
+                                     size_t limit,
+                                     vector<Item*>& out_items)
+    throw(runtime_error) {
+
+    Shard_Read request(Shard_Read::RECENT);
+    request.tags  = &tags;
+    request.limit = limit;
+
+    Shard_Reads reads;
+    fan_out(request, reads.reads);
+
+    vector<Item*> merged;
+    try {
+        collect(reads.reads, NEWEST_FIRST, merged);
+    }
+    catch (...) {
+        for (size_t i = 0; i < merged.size(); ++i) {
+            delete merged[i];
+        }
+        throw;
+    }
+    for (size_t i = limit; i < merged.size(); ++i) {
+        delete merged[i];
+    }
+    if (merged.size() > limit) {
+        merged.resize(limit);
+    }
+    out_items.insert(out_items.end(), merged.begin(), merged.end());
+}
+
+//------------------------------------------------------------------------------
+// Trash the item in the shard owning it.
+//------------------------------------------------------------------------------
+void Sharded_Serializer::trash(const Item& record)
+    throw(runtime_error) {
+
+    size_t index = record.id % m_shards.size();
+    Item local(record);
+    local.id = record.id / m_shards.size();
+
+    Shard& shard = *m_shards[index];
+    Mutex_Lock lock(shard.lock);
+    shard.db->trash(local);
+}
+
+//------------------------------------------------------------------------------
+// Return the titles of the global tag dictionary.
+//------------------------------------------------------------------------------
+void Sharded_Serializer::tags(vector<string>& out_tags)
+    throw(runtime_error) {
+
+    Mutex_Lock lock(m_mutex);
+    m_tags.complete("", m_tags.size(), out_tags);
+}
+
+//------------------------------------------------------------------------------
+// Rank the completions of all shards by the sum of their counters in every
+// shard: each shard completes the prefix up to limit, and the counters of
+// just those candidates are then read from all shards. A tag ranks only if it
+// is among the first limit of some shard.
+//------------------------------------------------------------------------------
+void Sharded_Serializer::complete_tags(const string& prefix, size_t limit,
+                                       vector<string>& out_tags)
+    throw(runtime_error) {
+
+    if (limit == 0) {
+        return;
+    }
+    Shard_Read completing(Shard_Read::COMPLETE);
+    completing.title = &prefix;
+    completing.limit = limit;
+
+    Shard_Reads completions;
+    fan_out(completing, completions.reads);
+
+    set<string>    seen;
+    vector<string> candidates;
+    for (size_t i = 0; i < completions.reads.size(); ++i) {
+        const vector<string>& titles = completions.reads[i]->titles;
+        for (size_t j = 0; j < titles.size(); ++j) {
+            if (seen.insert(Tag_Dictionary::fold(titles[j])).second) {
+                candidates.push_back(titles[j]);
+            }
+        }
+    }
+    if (candidates.empty()) {
+        return;
+    }
+    Shard_Read counting(Shard_Read::TAG_COUNTS);
+    counting.tags = &candidates;
+
+    Shard_Reads counts;
+    fan_out(counting, counts.reads);
+
+    vector<Tag_Count> ranked;
+    for (size_t i = 0; i < candidates.size(); ++i) {
+        long sum = 0;
+        for (size_t j = 0; j < counts.reads.size(); ++j) {
+            sum += counts.reads[j]->counts[i].second;
+        }
+        ranked.push_back(Tag_Count(candidates[i], sum));
+    }
+    limit = min(limit, ranked.size());
+    partial_sort(ranked.begin(), ranked.begin() + limit, ranked.end(),
+                 Tag_Count_Rank());
+    for (size_t i = 0; i < limit; ++i) {
+        out_tags.push_back(ranked[i].first);
+    }
+}
+
+//------------------------------------------------------------------------------
+// Sum the maintained item counts of all shards.
+//------------------------------------------------------------------------------
+long Sharded_Serializer::tag_count(const string& tag)
+    throw(runtime_error) {
+
+    long count = 0;
+    for (size_t i = 0; i < m_shards.size(); ++i) {
+        Mutex_Lock lock(m_shards[i]->lock);
+        count += m_shards[i]->db->tag_count(tag);
+    }
+    return count;
+}
+
+//------------------------------------------------------------------------------
+// Count the matching items per tag in all shards and sum the counts by tag.
+//------------------------------------------------------------------------------
+void Sharded_Serializer::facets(const vector<string>& tags,
+                                vector<Tag_Count>& out_counts)
+    throw(runtime_error) {
+
+    Shard_Read request(Shard_Read::FACETS);
+    request.tags = &tags;
+
+    Shard_Reads reads;
+    fan_out(request, reads.reads);
+
+    map<string, Tag_Count> sums;
+    for (size_t i = 0; i < reads.reads.size(); ++i) {
+        const vector<Tag_Count>& counts = reads.reads[i]->counts;
+        for (size_t j = 0; j < counts.size(); ++j) {
+            Tag_Count& sum = sums[Tag_Dictionary::fold(counts[j].first)];
+            if (sum.first.empty()) {
+                sum.first = counts[j].first;
+            }
+            sum.second += counts[j].second;
+        }
+    }
+    size_t first = out_counts.size();
+    for (map<string, Tag_Count>::const_iterator it = sums.begin();
+         it != sums.end(); ++it) {
+        out_counts.push_back(it->second);
+    }
+    sort(out_counts.begin() + first, out_counts.end(), Tag_Count_Rank());
+}
+
+//------------------------------------------------------------------------------
+// Memory accounting
+//------------------------------------------------------------------------------
+SQLite3_Memory Sharded_Serializer::memory() {
+    SQLite3_Memory total;
+    for (size_t i = 0; i < m_shards.size(); ++i) {
+        Mutex_Lock lock(m_shards[i]->lock);
+        SQLite3_Memory shard = m_shards[i]->db->memory();
+        total.page_cache += shard.page_cache;
+        total.schema     += shard.schema;
+        total.statements += shard.statements;
+        total.tags       += shard.tags;
+        total.index      += shard.index;
+        if (i + 1 == m_shards.size()) {
+            total.heap_used      = shard.heap_used;
+            total.heap_highwater = shard.heap_highwater;
+            total.soft_limit     = shard.soft_limit;
+            total.hard_limit     = shard.hard_limit;
+        }
+    }
+    Mutex_Lock lock(m_mutex);
+    total.tags += m_tags.memory_used();
+    return total;
+}
+
+int64_t Sharded_Serializer::release_memory() {
+    int64_t released = 0;
+    for (size_t i = 0; i < m_shards.size(); ++i) {
+        Mutex_Lock lock(m_shards[i]->lock);
+        released += m_shards[i]->db->release_memory();
+    }
+    return released;
+}
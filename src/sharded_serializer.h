@@ -0,0 +1,134 @@
+#ifndef SHARDED_SERIALIZER_H
+#define SHARDED_SERIALIZER_H
+
+#include "sqlite3_serializer.h"
+#include "tag_dictionary.h"
+#include "thread_pool.h"
+class Shard_Read;
+
+//------------------------------------------------------------------------------
+// Serializer partitioning the Items over several SQLite3_Serializer shards,
+// each a database of its own. The shard of an Item follows from its id: the
+// global id of the Item with id local in shard s of N is local * N + s. New
+// Items are placed round robin.
+//
+// Reads are fanned out to all shards in parallel on a thread pool and the
+// per-shard results are merged in timestamp order. Each shard has its own
+// lock, so writes to different shards proceed concurrently; all methods may
+// be called from several threads at once.
+//------------------------------------------------------------------------------
+class Sharded_Serializer : public Serializer {
+
+    public:
+
+        //----------------------------------------------------------------------
+        // @param db_specs The filespecs of the shard databases. The number and
+        //                 order of the shards must not change between runs,
+        //                 as they determine the Item ids.
+        // @param options  Storage tuning applied to every shard.
+        // @param threads  The size of the read thread pool (0: one thread
+        //                 per shard).
+        // @post  All shards are open and the global tag dictionary holds the
+        //        tags of all shards.
+        // @throw If no shards are given or a shard cannot be opened.
+        //----------------------------------------------------------------------
+        Sharded_Serializer(const std::vector<std::string>& db_specs,
+                           const SQLite3_Options& options = SQLite3_Options(),
+                           size_t threads = 0)
+            throw(std::runtime_error);
+
+        ~Sharded_Serializer();
+
+        //----------------------------------------------------------------------
+        // Serializer interface. Only the shard owning the Item is involved in
+        // write() and trash(); all other methods combine every shard.
+        // Completions and tag counts sum the counters of all shards;
+        // completions rank the first limit completions of each shard.
+        //----------------------------------------------------------------------
+        virtual void write(Item& i)
+            throw(std::runtime_error);
+
+        virtual void read(const std::vector<std::string>& tags,
+                          std::vector<Item*>& items)
+            throw(std::runtime_error);
+
+        virtual long count(const std::vector<std::string>& tags, Tag_Match mode)
+            throw(std::runtime_error);
+
+        virtual bool exists(const std::vector<std::string>& tags)
+            throw(std::runtime_error);
+
+        virtual void query(const Query& q, std::vector<Item*>& items)
+            throw(std::runtime_error);
+
+        virtual void read_by_id(const std::vector<int>& ids,
+                                std::vector<Item*>& items)
+            throw(std::runtime_error);
+
+        virtual void find_by_title(const std::string& title,
+                                   std::vector<Item*>& items)
+            throw(std::runtime_error);
+
+        virtual void read_range(int64_t from, int64_t to,
+                                std::vector<Item*>& items)
+            throw(std::runtime_error);
+
+        virtual void read_recent(const std::vector<std::string>& tags,
+                                 size_t limit,
+                                 std::vector<Item*>& items)
+            throw(std::runtime_error);
+
+        virtual void trash(const Item& i)
+            throw(std::runtime_error);
+
+        virtual void tags(std::vector<std::string>& tags)
+            throw(std::runtime_error);
+
+        virtual void complete_tags(const std::string& prefix, size_t limit,
+                                   std::vector<std::string>& tags)
+            throw(std::runtime_error);
+
+        virtual long tag_count(const std::string& tag)
+            throw(std::runtime_error);
+
+        virtual void facets(const std::vector<std::string>& tags,
+                            std::vector<Tag_Count>& counts)
+            throw(std::runtime_error);
+
+        size_t shards() const { return m_shards.size(); }
+
+        //----------------------------------------------------------------------
+        // Memory accounting as in SQLite3_Serializer, summed over the shards
+        // (the heap figures are process wide and taken once). The global tag
+        // dictionary is counted with the tags.
+        //----------------------------------------------------------------------
+        SQLite3_Memory memory();
+        int64_t        release_memory();
+
+    private:
+        struct Shard {
+            SQLite3_Serializer* db;
+            pthread_mutex_t     lock;       // Serializes use of db
+        };
+
+        // The order of the items of each shard read, kept by collect()
+        enum Order { NEWEST_FIRST, OLDEST_FIRST, UNORDERED };
+
+        Sharded_Serializer(const Sharded_Serializer&);
+        Sharded_Serializer& operator=(const Sharded_Serializer&);
+
+        void fan_out(const Shard_Read&, std::vector<Shard_Read*>&)
+            throw(std::runtime_error);
+        void collect(std::vector<Shard_Read*>&, Order, std::vector<Item*>&)
+            throw(std::runtime_error);
+        void learn_tags(const std::vector<std::string>&);
+
+        std::vector<Shard*> m_shards;
+        Thread_Pool         m_pool;
+        pthread_mutex_t     m_mutex;        // Guards the members below
+        Tag_Dictionary      m_tags;         // Titles of the tags of all shards
+        int                 m_next_tag_id;
+        size_t              m_next_shard;
+};
+
+#endif
@@ -1,20 +1,39 @@
 #include "sqlite3_serializer.h"
+#include "query.h"
+#include "clock.h"
+#include "sha256.h"
 #include <sqlite3.h>
 #include <string>
+#include <algorithm>
+#include <map>
 #include <set>
 #include <cstring>
+#include <cstdlib>
+#include <unistd.h>
 using namespace std;
 
 //--------------------------------------------------------------------------------
 // Table creation statements
 //--------------------------------------------------------------------------------
 #define ITEM_DDL     "CREATE TABLE IF NOT EXISTS Item("\
-                        "ItemID INTEGER PRIMARY KEY, Title TEXT, Content TEXT, "\
-                        "Encrypted INTEGER, Timestamp TEXT);"
+                        "ItemID INTEGER PRIMARY KEY, Title TEXT, "\
+                        "ContentID INTEGER, Encrypted INTEGER, Timestamp INTEGER, "\
+                        "FOREIGN KEY(ContentID) REFERENCES Content(ContentID));"
+
+#define CONTENT_DDL  "CREATE TABLE IF NOT EXISTS Content("\
+                        "ContentID INTEGER PRIMARY KEY, Hash BLOB UNIQUE, "\
+                        "Size INTEGER, Refs INTEGER NOT NULL DEFAULT 0);"
+
+// Bodies are kept apart from the Content row that is updated as references
+// come and go, since updating a row rewrites all of it, body included.
+#define CONTENT_BODY_DDL "CREATE TABLE IF NOT EXISTS ContentBody("\
+                        "ContentID INTEGER PRIMARY KEY, Body TEXT, "\
+                        "FOREIGN KEY(ContentID) REFERENCES Content(ContentID));"
 
 #define TAG_DDL      "CREATE TABLE IF NOT EXISTS Tag("\
                         "TagID INTEGER PRIMARY KEY, "\
-                        "Title TEXT UNIQUE COLLATE NOCASE);"
+                        "Title TEXT UNIQUE COLLATE NOCASE, "\
+                        "ItemCount INTEGER NOT NULL DEFAULT 0);"
 
 #define ITEM_TAG_DDL "CREATE TABLE IF NOT EXISTS ItemTag("\
                         "ID INTEGER PRIMARY KEY, ItemID INTEGER, TagID INTEGER, "\
@@ -22,23 +41,260 @@ using namespace std;
                         "FOREIGN KEY(TagID) REFERENCES Tag(TagID));"
 
 #define TRASH_DDL    "CREATE TABLE IF NOT EXISTS TrashItem("\
-                        "ItemID INTEGER PRIMARY KEY, Title TEXT, Content TEXT, "\
-                        "Tags TEXT, Encrypted INTEGER, Timestamp TEXT);"
+                        "ItemID INTEGER PRIMARY KEY, Title TEXT, "\
+                        "ContentID INTEGER, Tags TEXT, Encrypted INTEGER, "\
+                        "Timestamp INTEGER, "\
+                        "FOREIGN KEY(ContentID) REFERENCES Content(ContentID));"
+
+// A counter bumped by every change to the rows the in-memory tag state is
+// loaded from, whichever connection makes it (Tag.ItemCount only changes along
+// with the ItemTag rows). Other commits, such as those of maintenance, leave it.
+#define TAG_VERSION_DDL "CREATE TABLE IF NOT EXISTS TagVersion("\
+                           "Version INTEGER NOT NULL);"
+
+#define TAG_VERSION_ROW "INSERT INTO TagVersion SELECT 0 "\
+                           "WHERE NOT EXISTS (SELECT * FROM TagVersion);"
 
 #define FKEYS_ON     "PRAGMA foreign_keys = ON;"
 
-#define SQLITE_DATE  "datetime('now', 'localtime')"
+//--------------------------------------------------------------------------------
+// Index creation statements
+//--------------------------------------------------------------------------------
+#define ITEM_TIMESTAMP_IDX "CREATE INDEX IF NOT EXISTS ItemTimestamp "\
+                              "ON Item(Timestamp);"
+
+#define ITEM_TITLE_IDX     "CREATE INDEX IF NOT EXISTS ItemTitle "\
+                              "ON Item(Title);"
+
+#define ITEM_TAG_TAG_IDX   "CREATE INDEX IF NOT EXISTS ItemTagTag "\
+                              "ON ItemTag(TagID, ItemID);"
+
+#define ITEM_TAG_ITEM_IDX  "CREATE INDEX IF NOT EXISTS ItemTagItem "\
+                              "ON ItemTag(ItemID);"
+
+//--------------------------------------------------------------------------------
+// Trigger creation statements. Created after migrate(), as rebuilding a table
+// drops its triggers.
+//--------------------------------------------------------------------------------
+#define TAG_VERSION_TRIGGER(name, event) \
+    "CREATE TRIGGER IF NOT EXISTS " name " AFTER " event " BEGIN "\
+        "UPDATE TagVersion SET Version = Version + 1; END;"
+
+const char* TAG_VERSION_TRIGGERS[] = {
+    TAG_VERSION_TRIGGER("ItemInserted",    "INSERT ON Item"),
+    TAG_VERSION_TRIGGER("ItemDeleted",     "DELETE ON Item"),
+    TAG_VERSION_TRIGGER("TagInserted",     "INSERT ON Tag"),
+    TAG_VERSION_TRIGGER("TagDeleted",      "DELETE ON Tag"),
+    TAG_VERSION_TRIGGER("ItemTagInserted", "INSERT ON ItemTag"),
+    TAG_VERSION_TRIGGER("ItemTagDeleted",  "DELETE ON ItemTag"),
+    0
+};
+
+#define ITEM_COLUMNS "Item.ItemID, Item.Title, ContentBody.Body, "\
+                     "Item.Encrypted, Item.Timestamp"
+
+// The item rows with their content, for selecting ITEM_COLUMNS
+#define ITEM_TABLES "Item LEFT JOIN ContentBody "\
+                    "ON ContentBody.ContentID = Item.ContentID "
+
+// Joins each item row with its tag titles (a NULL title for untagged items)
+#define ITEM_TAG_JOIN "FROM " ITEM_TABLES \
+                      "LEFT JOIN ItemTag ON ItemTag.ItemID = Item.ItemID "\
+                      "LEFT JOIN Tag ON Tag.TagID = ItemTag.TagID "
+
+//--------------------------------------------------------------------------------
+// Schema migrations. PRAGMA user_version holds the version a database was last
+// migrated to; migrate() applies every step above it in order.
+//--------------------------------------------------------------------------------
+#define SCHEMA_VERSION 5
+
+// Timestamps used to be stored as localtime TEXT from datetime('now',
+// 'localtime'). Rebuild both tables with INTEGER epoch microseconds.
+#define LOCALTIME_TO_USEC(col) "COALESCE(CAST(strftime('%s', " col ", 'utc') "\
+                                         "AS INTEGER), 0) * 1000000"
+
+const char* MIGRATION_V1[] = {
+    "CREATE TABLE ItemV1("
+        "ItemID INTEGER PRIMARY KEY, Title TEXT, Content TEXT, "
+        "Encrypted INTEGER, Timestamp INTEGER);",
+    "INSERT INTO ItemV1 SELECT ItemID, Title, Content, Encrypted, "
+        LOCALTIME_TO_USEC("Timestamp") " FROM Item;",
+    "DROP TABLE Item;",
+    "ALTER TABLE ItemV1 RENAME TO Item;",
+    "CREATE TABLE TrashItemV1("
+        "ItemID INTEGER PRIMARY KEY, Title TEXT, Content TEXT, "
+        "Tags TEXT, Encrypted INTEGER, Timestamp INTEGER);",
+    "INSERT INTO TrashItemV1 SELECT ItemID, Title, Content, Tags, Encrypted, "
+        LOCALTIME_TO_USEC("Timestamp") " FROM TrashItem;",
+    "DROP TABLE TrashItem;",
+    "ALTER TABLE TrashItemV1 RENAME TO TrashItem;",
+    0
+};
+
+// Tag.ItemCount holds the number of items associated with each tag.
+const char* MIGRATION_V2[] = {
+    "ALTER TABLE Tag ADD COLUMN ItemCount INTEGER NOT NULL DEFAULT 0;",
+    "UPDATE Tag SET ItemCount = "
+        "(SELECT COUNT(*) FROM ItemTag WHERE ItemTag.TagID = Tag.TagID);",
+    0
+};
+
+// Content is stored once per distinct body in the Content table, keyed by its
+// SHA-256 hash (the sha256() SQL function registered by open()) and reference
+// counted by the Item and TrashItem rows pointing at it. The bodies go straight
+// to the ContentBody table of version 4.
+#define CONTENT_OF(table) \
+    "(SELECT ContentID FROM Content WHERE Hash = sha256(" table ".Content))"
+
+#define ALL_CONTENT \
+    "(SELECT Content FROM Item UNION ALL SELECT Content FROM TrashItem) "
+
+const char* MIGRATION_V3[] = {
+    "INSERT OR IGNORE INTO Content(Hash, Size) "
+        "SELECT sha256(Content), length(CAST(Content AS BLOB)) "
+        "FROM " ALL_CONTENT "WHERE Content IS NOT NULL;",
+    "INSERT OR IGNORE INTO ContentBody(ContentID, Body) "
+        "SELECT " CONTENT_OF("Stored") ", Content "
+        "FROM " ALL_CONTENT "AS Stored WHERE Content IS NOT NULL;",
+    "CREATE TABLE ItemV3("
+        "ItemID INTEGER PRIMARY KEY, Title TEXT, "
+        "ContentID INTEGER, Encrypted INTEGER, Timestamp INTEGER, "
+        "FOREIGN KEY(ContentID) REFERENCES Content(ContentID));",
+    "INSERT INTO ItemV3 SELECT ItemID, Title, " CONTENT_OF("Item") ", "
+        "Encrypted, Timestamp FROM Item;",
+    "DROP TABLE Item;",
+    "ALTER TABLE ItemV3 RENAME TO Item;",
+    "CREATE TABLE TrashItemV3("
+        "ItemID INTEGER PRIMARY KEY, Title TEXT, "
+        "ContentID INTEGER, Tags TEXT, Encrypted INTEGER, Timestamp INTEGER, "
+        "FOREIGN KEY(ContentID) REFERENCES Content(ContentID));",
+    "INSERT INTO TrashItemV3 SELECT ItemID, Title, " CONTENT_OF("TrashItem") ", "
+        "Tags, Encrypted, Timestamp FROM TrashItem;",
+    "DROP TABLE TrashItem;",
+    "ALTER TABLE TrashItemV3 RENAME TO TrashItem;",
+    "CREATE TEMP TABLE ContentRefs(ContentID INTEGER PRIMARY KEY, Refs INTEGER);",
+    "INSERT INTO ContentRefs SELECT ContentID, COUNT(*) FROM "
+        "(SELECT ContentID FROM Item UNION ALL SELECT ContentID FROM TrashItem) "
+        "WHERE ContentID IS NOT NULL GROUP BY ContentID;",
+    "UPDATE Content SET Refs = (SELECT Refs FROM ContentRefs "
+        "WHERE ContentRefs.ContentID = Content.ContentID);",
+    "DROP TABLE ContentRefs;",
+    0
+};
+
+// Version 3 kept the bodies in the Content table; move them to ContentBody.
+const char* MIGRATION_V4[] = {
+    "INSERT INTO ContentBody(ContentID, Body) "
+        "SELECT ContentID, Body FROM Content;",
+    "CREATE TABLE ContentV4("
+        "ContentID INTEGER PRIMARY KEY, Hash BLOB UNIQUE, "
+        "Size INTEGER, Refs INTEGER NOT NULL DEFAULT 0);",
+    "INSERT INTO ContentV4 SELECT ContentID, Hash, Size, Refs FROM Content;",
+    "DROP TABLE Content;",
+    "ALTER TABLE ContentV4 RENAME TO Content;",
+    0
+};
+
+// Version 5 adds the TagVersion table and its triggers, which the DDL creates.
+
+//--------------------------------------------------------------------------------
+// PRAGMA values of the SQLite3_Options enumerations, indexed by enumerator.
+//--------------------------------------------------------------------------------
+const char* SYNCHRONOUS_PRAGMA[]  = { 0, "OFF", "NORMAL", "FULL", "EXTRA" };
+const char* JOURNAL_MODE_PRAGMA[] = { 0, "DELETE", "TRUNCATE", "PERSIST",
+                                      "MEMORY", "WAL", "OFF" };
+const char* TEMP_STORE_PRAGMA[]   = { 0, "FILE", "MEMORY" };
+
+
+// Maximum number of ids inlined into a single IN (...) list
+const size_t ID_BATCH = 500;
+
+//--------------------------------------------------------------------------------
+// The number of bytes of content moved per incremental BLOB read or write.
+//--------------------------------------------------------------------------------
+const size_t BLOB_CHUNK = 64 * 1024;
 
 //--------------------------------------------------------------------------------
 // Stateless utility functions
 //--------------------------------------------------------------------------------
-const char* tags2tag_str(const vector<string>& tags) {
-    static string rv; rv.clear();
-    for (size_t i = 0; i < tags.size(); ++i) {
-        rv += tags[i];
-        if (i + 1 < tags.size()) rv += " ";
+
+//--------------------------------------------------------------------------------
+// Returns a file: URI for the filespec, percent encoding the characters that
+// are special in URIs.
+//--------------------------------------------------------------------------------
+string file_uri(const char* db_spec) {
+    static const char* HEX = "0123456789ABCDEF";
+    string rv = "file:";
+    for (const char* c = db_spec; *c; ++c) {
+        if (*c == '%' || *c == '?' || *c == '#') {
+            rv += '%';
+            rv += HEX[(*c >> 4) & 0xF];
+            rv += HEX[*c & 0xF];
+        }
+        else {
+            rv += *c;
+        }
+    }
+    return rv;
+}
+
+//--------------------------------------------------------------------------------
+// SQL function sha256(X): the SHA-256 digest of the bytes of X as a BLOB, or
+// NULL if X is NULL.
+//--------------------------------------------------------------------------------
+void sha256_function(sqlite3_context* context, int, sqlite3_value** args) {
+    if (sqlite3_value_type(args[0]) == SQLITE_NULL) {
+        sqlite3_result_null(context);
+        return;
+    }
+    const void* data = sqlite3_value_blob(args[0]);
+    SHA256 hash;
+    hash.update(data, sqlite3_value_bytes(args[0]));
+    string digest = hash.digest();
+    sqlite3_result_blob(context, digest.data(), digest.size(), SQLITE_TRANSIENT);
+}
+
+//--------------------------------------------------------------------------------
+// Returns a comma separated list of count SQL parameter placeholders.
+//--------------------------------------------------------------------------------
+string placeholders(size_t count) {
+    string rv;
+    for (size_t i = 0; i < count; ++i) {
+        rv += (i == 0 ? "?" : ", ?");
+    }
+    return rv;
+}
+
+//--------------------------------------------------------------------------------
+// Deletes the items from first on and removes them from the vector.
+//--------------------------------------------------------------------------------
+void discard_items(vector<Item*>& items, size_t first) {
+    for (size_t i = first; i < items.size(); ++i) {
+        delete items[i];
+    }
+    items.resize(first);
+}
+
+//--------------------------------------------------------------------------------
+// Returns the text with the LIKE wildcards escaped by backslashes.
+//--------------------------------------------------------------------------------
+string escape_like(const string& text) {
+    string rv;
+    for (size_t i = 0; i < text.size(); ++i) {
+        if (text[i] == '%' || text[i] == '_' || text[i] == '\\') {
+            rv += '\\';
+        }
+        rv += text[i];
     }
-    return rv.c_str();
+    return rv;
+}
+
+//--------------------------------------------------------------------------------
+// Returns the text of a result column, or an empty string if it is NULL.
+//--------------------------------------------------------------------------------
+inline const char* column_text(sqlite3_stmt* statement, int column) {
+    const unsigned char* text = sqlite3_column_text(statement, column);
+    return text ? reinterpret_cast<const char*>(text) : "";
 }
 
 //--------------------------------------------------------------------------------
@@ -52,8 +308,11 @@ const char* tags2tag_str(const vector<string>& tags) {
 inline void SQLite3_Serializer::prepare(int count, ...) 
     throw(runtime_error) {
 
-    if (sqlite3_finalize(m_statement) != SQLITE_OK) {
-        throw runtime_error(sqlite3_errmsg(m_db));
+    // The result of finalizing is that of the last step, already reported
+    sqlite3_finalize(m_statement);
+    m_statement = 0;
+    if (m_maintenance) {
+        m_maintenance->touch(sqlite3_total_changes(m_db));
     }
     if (sqlite3_prepare_v2(
         m_db,
@@ -62,6 +321,8 @@ inline void SQLite3_Serializer::prepare(int count, ...)
         &m_statement,
         NULL) != SQLITE_OK) {
 
+        int rc = sqlite3_errcode(m_db);
+        m_busy = rc == SQLITE_BUSY || rc == SQLITE_LOCKED;
         throw runtime_error(sqlite3_errmsg(m_db));
     }
     va_list vargs;
@@ -78,9 +339,49 @@ inline void SQLite3_Serializer::prepare(int count, ...)
     va_end(vargs);
 }
 
+//--------------------------------------------------------------------------------
+// Sleeps before the next attempt to get a lock held by another connection. The
+// wait doubles with each attempt up to busy_backoff ms and is drawn from its
+// upper half, so that waiting connections do not retry in lockstep.
+//--------------------------------------------------------------------------------
+void SQLite3_Serializer::back_off(int attempt) {
+
+    int64_t limit = static_cast<int64_t>(m_options.busy_backoff) * 1000;
+    int64_t usec  = static_cast<int64_t>(1000) << min(attempt, 20);
+    if (usec > limit) {
+        usec = limit;
+    }
+    usec = usec / 2 + rand_r(&m_seed) % (usec / 2 + 1);
+
+    usleep(usec);
+    m_busy_waited += usec;
+    ++m_contention.busy_waits;
+    m_contention.wait_usec += usec;
+}
+
+//--------------------------------------------------------------------------------
+// SQLite busy handler: called while a lock is held by another connection.
+// @return Nonzero to try again, zero to fail with SQLITE_BUSY once busy_timeout
+//         ms have been spent waiting.
+//--------------------------------------------------------------------------------
+int SQLite3_Serializer::busy_handler(void* context, int count) {
+
+    SQLite3_Serializer* self = static_cast<SQLite3_Serializer*>(context);
+    if (count == 0) {
+        self->m_busy_waited = 0;
+    }
+    if (self->m_busy_waited >= 
+        static_cast<int64_t>(self->m_options.busy_timeout) * 1000) {
+        return 0;
+    }
+    self->back_off(count);
+    return 1;
+}
+
 //--------------------------------------------------------------------------------
 // Convenience function for stepping through the rows returned by a prepared
-// query.
+// query. Statements not writing to the database (reads, BEGIN, COMMIT) that
+// fail with SQLITE_BUSY are reset and retried up to busy_retries times.
 // @pre  m_statement has been prepared with prepare()
 // @post m_statement can be passed to sqlite3 column getters to inspect results.
 //--------------------------------------------------------------------------------
@@ -88,7 +389,19 @@ inline int SQLite3_Serializer::step()
     throw(runtime_error) {
 
     int rc =  sqlite3_step(m_statement);
+    for (int attempt = 0; rc == SQLITE_BUSY && 
+                          attempt < m_options.busy_retries &&
+                          sqlite3_stmt_readonly(m_statement); ++attempt) {
+        sqlite3_reset(m_statement);
+        ++m_contention.retries;
+        back_off(attempt);
+        rc = sqlite3_step(m_statement);
+    }
     if (rc != SQLITE_DONE && rc != SQLITE_ROW) {
+        m_busy = rc == SQLITE_BUSY || rc == SQLITE_LOCKED;
+        if (m_busy) {
+            ++m_contention.failures;
+        }
         throw runtime_error(sqlite3_errmsg(m_db));
     }
     return rc;
@@ -109,332 +422,1760 @@ inline void SQLite3_Serializer::exec(const char* query)
 
 //--------------------------------------------------------------------------------
 // Starts an SQL transaction.
+// @param write Whether the transaction writes. The write lock is then taken
+//       at once, so that it cannot fail to upgrade from a read lock half way
+//       through (a deadlock with another writer that no waiting resolves).
 // @post Any further calls to prepare() and step() form part of the currently
-//       active transaction.
-// @note Nested transaction are not supported.
-// @note All calls to this must be matched by a call to end_transaction();
+//       active transaction, and the in-memory tag state matches the database
+//       as the transaction sees it.
+// @note Nested transaction are not supported. Within a batch the statements
+//       join the batch transaction under a savepoint instead, so that a failed
+//       operation can be undone without the rest of the batch.
+// @note All calls to this must be matched by a call to end_transaction(), or
+//       to abort_transaction() if an exception escapes in between.
 //--------------------------------------------------------------------------------
-inline void SQLite3_Serializer::begin_transaction()
+inline void SQLite3_Serializer::begin_transaction(bool write)
     throw(std::runtime_error) {
 
-        exec("BEGIN TRANSACTION;");
+        m_busy = false;
+        if (m_batch) {
+            m_mark = m_pending.size();
+            exec("SAVEPOINT operation;");
+        }
+        else {
+            exec(write ? "BEGIN IMMEDIATE TRANSACTION;" : "BEGIN TRANSACTION;");
+            revalidate();
+        }
 }
 
 //--------------------------------------------------------------------------------
 // Ends an SQL transaction
-// @post All statements to the previous call to begin_transaction() are committed.
+// @post All statements to the previous call to begin_transaction() are committed
+//       and their tag changes applied (by commit_batch() within a batch).
 //--------------------------------------------------------------------------------
 inline void SQLite3_Serializer::end_transaction()
     throw(std::runtime_error) {
 
-        exec("COMMIT TRANSACTION;");
+        if (m_batch) {
+            exec("RELEASE operation;");
+        }
+        else {
+            commit();
+            apply_changes();
+        }
 }
 
 //--------------------------------------------------------------------------------
-// Ctor: Initialises the database connection and creates the schema if need be.
+// Undoes the transaction of an operation that threw after begin_transaction():
+// rolls it back (to its savepoint within a batch) and drops its tag changes, so
+// that the connection and the in-memory tag state are as before the operation.
+// If SQLite has already rolled back the whole batch (as it does on some I/O and
+// memory errors), the batch is closed.
+// @param attempt The attempts of the operation so far, if it may be run again
+//                (-1: it may not).
+// @return Whether to run the operation again: it failed for a lock held by
+//         another connection outside a batch, and has attempts left of
+//         options.busy_retries. The backoff wait has then been taken.
+// @note Never throws; a failing ROLLBACK leaves nothing to undo.
 //--------------------------------------------------------------------------------
-SQLite3_Serializer::SQLite3_Serializer(const char* db_spec) 
-    throw(runtime_error) : m_db(0),
-                           m_statement(0),
-                           m_error_msg(0),
-                           m_query("") {
+bool SQLite3_Serializer::abort_transaction(int attempt) {
 
-    if ((sqlite3_open(db_spec, &m_db) != SQLITE_OK)) {
-        throw runtime_error(string(sqlite3_errmsg(m_db)));
+    bool busy = m_busy;
+    m_busy = false;
+    sqlite3_finalize(m_statement);
+    m_statement = 0;
+    if (m_batch) {
+        if (sqlite3_get_autocommit(m_db)) {
+            m_batch = false;
+            m_pending.clear();
+        }
+        else {
+            sqlite3_exec(m_db, "ROLLBACK TO operation; RELEASE operation;",
+                         0, 0, 0);
+            m_pending.resize(m_mark);
+        }
+        return false;
     }
-    begin_transaction();
-    exec(ITEM_DDL);
-    exec(TAG_DDL);
-    exec(ITEM_TAG_DDL);
-    exec(TRASH_DDL);
-    exec(FKEYS_ON);
-    end_transaction();
-}
-
-//--------------------------------------------------------------------------------
-// Dtor: Closes the database connection.
-//--------------------------------------------------------------------------------
-SQLite3_Serializer::~SQLite3_Serializer() {
-    if (m_db) {
-        sqlite3_close(m_db);
+    if (!sqlite3_get_autocommit(m_db)) {
+        sqlite3_exec(m_db, "ROLLBACK TRANSACTION;", 0, 0, 0);
     }
-    if (m_error_msg) {
-        sqlite3_free(m_error_msg);
+    m_pending.clear();
+    if (!busy || attempt < 0 || attempt >= m_options.busy_retries) {
+        return false;
     }
+    ++m_contention.retries;
+    back_off(attempt);
+    return true;
 }
 
 //--------------------------------------------------------------------------------
-// Inserts or updates an existing item.
+// Reloads the tag dictionary and index if another connection has changed tags
+// since they were loaded (or a reload failed half way). PRAGMA data_version
+// only changes with the commits of other connections, and the data of an
+// immutable database never does; TagVersion then tells the commits that left
+// the tags alone (such as those of the maintenance thread) from the others.
+// @pre A transaction is active, so that the version and the tables read agree.
 //--------------------------------------------------------------------------------
-void SQLite3_Serializer::write(Item& record) 
+void SQLite3_Serializer::revalidate()
     throw(runtime_error) {
 
-    if (record.id == 0) {
-        insert(record);
+    int64_t version = m_data_version;
+    if (!m_options.immutable) {
+        exec("PRAGMA data_version;");
+        version = sqlite3_column_int64(m_statement, 0);
     }
-    else {
-        update(record);
+    if (!m_stale && version == m_data_version) {
+        return;
+    }
+    if (!m_stale && tag_version() == m_tag_version) {
+        m_data_version = version;
+        return;
     }
+    m_stale = true;
+    load_tags();
+    load_index();
+    m_tag_version = tag_version();
+    m_data_version = version;
+    m_stale = false;
 }
 
 //--------------------------------------------------------------------------------
-// Inserts an Item, Tags and all ItemTags to the database,
+// @return The TagVersion counter as the active transaction sees it.
 //--------------------------------------------------------------------------------
-void SQLite3_Serializer::insert(Item& record) 
+int64_t SQLite3_Serializer::tag_version()
     throw(runtime_error) {
 
-    begin_transaction();
-    m_query.str("");
-    m_query << "INSERT INTO Item(Title, Content, Encrypted, Timestamp) "
-               "VALUES(?, ?, " << record.encrypted << ", " << SQLITE_DATE << ");";
-    prepare(2, record.title.c_str(), record.content.c_str());
-    step();
-    record.id = sqlite3_last_insert_rowid(m_db);
-    write_tags(record);
-    end_transaction();
+    exec("SELECT Version FROM TagVersion;");
+    return sqlite3_column_int64(m_statement, 0);
 }
 
 //--------------------------------------------------------------------------------
-// For each tag, insert it and associate it if it is new, else check if an
-// association exists with the current item and insert it if it doesn't.
+// Commits the transaction, noting the TagVersion its tag changes (if any) leave
+// behind, so that revalidate() does not take them for those of another
+// connection.
 //--------------------------------------------------------------------------------
-void SQLite3_Serializer::write_tags(const Item& record) 
+void SQLite3_Serializer::commit()
     throw(runtime_error) {
 
-    for (size_t i = 0; i < record.tags.size(); ++i) {
-        const char* current_tag = record.tags[i].c_str();
-
-        m_query.str("SELECT TagID from Tag WHERE Title = ?;");
-        prepare(1, current_tag);
-        step();
+    int64_t tag_version = m_pending.empty() ? m_tag_version
+                                            : this->tag_version();
+    exec("COMMIT TRANSACTION;");
+    m_tag_version = tag_version;
+}
 
-        int tag_id = sqlite3_column_int(m_statement, 0);
-        if (tag_id == 0) {
-            m_query.str( "INSERT INTO Tag(Title) VALUES(?);");
-            prepare(1, current_tag);
-            step();
-            tag_id = sqlite3_last_insert_rowid(m_db);
-            insert_itemtag(record.id, tag_id);
+//--------------------------------------------------------------------------------
+// Applies the tag changes of a committed transaction to the dictionary and the
+// index.
+//--------------------------------------------------------------------------------
+void SQLite3_Serializer::apply_changes() {
+    for (size_t i = 0; i < m_pending.size(); ++i) {
+        const Tag_Change& change = m_pending[i];
+        if (!change.title.empty()) {
+            m_tags.insert(change.tag_id, change.title, change.delta);
+            continue;
+        }
+        if (change.tag_id) {
+            m_tags.add_uses(change.tag_id, change.delta);
+        }
+        if (!m_index || !change.item_id) {
+            continue;
+        }
+        if (!change.tag_id && change.delta > 0) {
+            m_index->add_item(change.item_id);
+        }
+        else if (!change.tag_id) {
+            m_index->remove_item(change.item_id, vector<int>());
+        }
+        else if (change.delta > 0) {
+            m_index->add(change.item_id, change.tag_id);
         }
         else {
-            m_query.str("");
-            m_query << "SELECT ID from ItemTag "
-                       "WHERE ItemID = " << record.id <<
-                       " AND   TagID =  " << tag_id << ";";
-
-            prepare(0);
-            step();
-
-            if (sqlite3_column_int(m_statement, 0) == 0) {
-                insert_itemtag(record.id, tag_id);
-            }
+            m_index->remove(change.item_id, change.tag_id);
         }
     }
+    m_pending.clear();
 }
 
 //--------------------------------------------------------------------------------
-// Inserts a relation between an Item and a Tag into the ItemTag table.
-//--------------------------------------------------------------------------------
-void SQLite3_Serializer::insert_itemtag(const int& item_id, const int& tag_id) 
-    throw(runtime_error) {
-
-    m_query.str("");
-    m_query << "INSERT INTO ItemTag(ItemID, TagID) VALUES(" << item_id << "," 
-                                                            << tag_id << ");";
-    prepare(0);
-    step();
+Maintenance_Stats SQLite3_Serializer::maintenance() const {
+    return m_maintenance ? m_maintenance->stats() : Maintenance_Stats();
 }
 
 //--------------------------------------------------------------------------------
-// Updates an existing item as well as all tag relations
+// Memory accounting
 //--------------------------------------------------------------------------------
-void SQLite3_Serializer::update(const Item& record) 
-    throw(runtime_error) {
+SQLite3_Memory SQLite3_Serializer::memory() const {
+    SQLite3_Memory memory;
+    int current, highwater;
 
-    begin_transaction();
-    m_query.str("");
-    m_query << "UPDATE Item set Title = ?, Content = ?, Encrypted = " 
-            << record.encrypted << ", Timestamp = " << SQLITE_DATE 
-            << " WHERE ItemID = " << record.id << ";";
+    sqlite3_db_status(m_db, SQLITE_DBSTATUS_CACHE_USED, &current, &highwater, 0);
+    memory.page_cache = current;
+    sqlite3_db_status(m_db, SQLITE_DBSTATUS_SCHEMA_USED, &current, &highwater, 0);
+    memory.schema = current;
+    sqlite3_db_status(m_db, SQLITE_DBSTATUS_STMT_USED, &current, &highwater, 0);
+    memory.statements = current;
 
-    prepare(2, record.title.c_str(), record.content.c_str());
-    step();
-    
-    delete_itemtags(record);
-    write_tags(record);
-    end_transaction();
+    memory.tags  = m_tags.memory_used();
+    memory.index = m_index ? m_index->memory_used() : 0;
+
+    sqlite3_int64 used, peak;
+    sqlite3_status64(SQLITE_STATUS_MEMORY_USED, &used, &peak, 0);
+    memory.heap_used      = used;
+    memory.heap_highwater = peak;
+    memory.soft_limit     = sqlite3_soft_heap_limit64(-1);
+    memory.hard_limit     = sqlite3_hard_heap_limit64(-1);
+    return memory;
+}
+
+int64_t SQLite3_Serializer::release_memory() {
+    sqlite3_int64 before = sqlite3_memory_used();
+    sqlite3_finalize(m_statement);
+    m_statement = 0;
+    sqlite3_db_release_memory(m_db);
+    return max<int64_t>(before - sqlite3_memory_used(), 0);
+}
+
+void SQLite3_Serializer::set_heap_limits(int64_t soft, int64_t hard) {
+    sqlite3_soft_heap_limit64(soft);
+    sqlite3_hard_heap_limit64(hard);
 }
 
 //--------------------------------------------------------------------------------
-// For each existing tag associated with the item, remove the relation if the 
-// item is no longer associated with the tag.
+// Batch transactions
 //--------------------------------------------------------------------------------
-void SQLite3_Serializer::delete_itemtags(const Item& record)
+void SQLite3_Serializer::begin_batch()
     throw(runtime_error) {
-    
-    // Put the items's tags into a set to check more efficiently whether 
-    // or not each tag in the DB has a relation to the item.
-    // NOTE: This suggests a set would be a better datastructure to use
-    //       for the Item data type. That way you're guaranteed no duplicates.
-    set<const char*> tag_set;
-    vector<int> delete_cache;
-    for (size_t i = 0; i < record.tags.size(); ++i) {
-        tag_set.insert(record.tags[i].c_str());
-    }
 
-    m_query.str("");
-    m_query << "SELECT Title, ID from Tag "
-               "JOIN (SELECT * FROM ItemTag WHERE ItemID = " << record.id << ") "
-                     "AS OldRelations "
-               "ON Tag.TagID = OldRelations.TagID;";
-    prepare(0);
+    if (m_batch) {
+        throw runtime_error("A batch is already open");
+    }
+    try {
+        begin_transaction(true);
+    }
+    catch (const exception&) {
+        abort_transaction();
+        throw;
+    }
+    m_batch = true;
+}
 
-    while (step() == SQLITE_ROW) {
-        if (tag_set.find(
-                reinterpret_cast<const char*>(sqlite3_column_text(m_statement, 0))
-            ) == tag_set.end()) {
+//--------------------------------------------------------------------------------
+// A batch that fails to commit is rolled back, so that the connection is not
+// left inside its transaction.
+//--------------------------------------------------------------------------------
+void SQLite3_Serializer::commit_batch()
+    throw(runtime_error) {
 
-            delete_cache.push_back(sqlite3_column_int(m_statement, 1));
-        }
+    try {
+        commit();
     }
-    for (size_t i = 0; i < delete_cache.size(); ++i) {
-        m_query.str("");
-        m_query << "DELETE FROM ItemTag WHERE ID = " << delete_cache[i];
-        prepare(0);
-        step();
+    catch (const exception&) {
+        rollback_batch();
+        throw;
     }
+    m_batch = false;
+    apply_changes();
 }
 
 //--------------------------------------------------------------------------------
-// Read all items associated with the given tags into the output parameter.
+// The tag changes of the batch were never applied, so they are simply dropped.
+// A batch that SQLite has already rolled back needs nothing more.
 //--------------------------------------------------------------------------------
-void SQLite3_Serializer::read(const vector<string>& tags, 
-                              vector<Item*>& out_items)
+void SQLite3_Serializer::rollback_batch()
     throw(runtime_error) {
 
-    if (tags.empty()) {
-        return;
+    m_batch = false;
+    m_pending.clear();
+    if (!sqlite3_get_autocommit(m_db)) {
+        exec("ROLLBACK TRANSACTION;");
     }
-    begin_transaction();
-    // TODO: Add option for matching all or one of the tags
-    // Select all items matching the tags
-    m_query.str("");
-    m_query << "SELECT DISTINCT Item.ItemID, Item.Title, Item.Content, "
-                               "Item.Encrypted, Item.Timestamp "
-               "FROM Item "
-               "JOIN ItemTag "
-                    "ON Item.ItemID = ItemTag.ItemID "
-               "WHERE ItemTag.TagID IN "
-                    "(SELECT TagID FROM Tag WHERE Tag.Title = ";
+}
 
-    for (size_t i = 0; i < tags.size(); ++i) {
-        m_query << "?";
-        m_query << (i + 1 == tags.size() ? ");" : " OR Tag.Title = ");
+//--------------------------------------------------------------------------------
+// Brings an existing database up to SCHEMA_VERSION.
+// @param created Whether the tables were just created by the current DDL, in
+//                which case there is nothing to migrate.
+// @pre  A transaction is active and all tables exist.
+// @post PRAGMA user_version equals SCHEMA_VERSION.
+//--------------------------------------------------------------------------------
+void SQLite3_Serializer::migrate(bool created)
+    throw(std::runtime_error) {
+
+    int version = SCHEMA_VERSION;
+    if (!created) {
+        exec("PRAGMA user_version;");
+        version = sqlite3_column_int(m_statement, 0);
+        if (version >= SCHEMA_VERSION) {
+            return;
+        }
+    }
+    if (version < 1) {
+        for (const char** sql = MIGRATION_V1; *sql; ++sql) {
+            exec(*sql);
+        }
     }
-    //------
-    // HACK: This isn't necessary with C++11x variadic template args
-    //       so refine it during the sweep.
+    if (version < 2) {
+        for (const char** sql = MIGRATION_V2; *sql; ++sql) {
+            exec(*sql);
+        }
+    }
+    if (version < 3) {
+        for (const char** sql = MIGRATION_V3; *sql; ++sql) {
+            exec(*sql);
+        }
+    }
+    else if (version < 4) {     // MIGRATION_V3 writes the version 4 layout
+        for (const char** sql = MIGRATION_V4; *sql; ++sql) {
+            exec(*sql);
+        }
+    }
+    m_query.str("");
+    m_query << "PRAGMA user_version = " << SCHEMA_VERSION << ";";
     prepare(0);
+    step();
+}
+
+//--------------------------------------------------------------------------------
+// Binds each tag as a text parameter of m_statement, starting at parameter
+// index first.
+// @pre m_statement is prepared and the tags outlive it.
+//--------------------------------------------------------------------------------
+inline void SQLite3_Serializer::bind_tags(const vector<string>& tags, int first) {
     for (size_t i = 0; i < tags.size(); ++i) {
         sqlite3_bind_text(
             m_statement, 
-            i + 1, 
+            first + i, 
             tags[i].c_str(),
             tags[i].size(), 
             SQLITE_STATIC
         );
     }
-    //------
+}
+
+//--------------------------------------------------------------------------------
+// Steps through m_statement, appending an Item for each row.
+// @pre m_statement is prepared with a query selecting ITEM_COLUMNS.
+//--------------------------------------------------------------------------------
+void SQLite3_Serializer::fetch_items(vector<Item*>& out_items)
+    throw(runtime_error) {
 
     while (step() == SQLITE_ROW) {
         out_items.push_back(new Item);
         Item& item = *out_items.back();
 
-        item.id = sqlite3_column_int(m_statement, 0);
-
-        item.title = 
-            reinterpret_cast<const char*>(sqlite3_column_text(m_statement, 1));
-
-        item.content = 
-            reinterpret_cast<const char*>(sqlite3_column_text(m_statement, 2));
-
+        item.id        = sqlite3_column_int(m_statement, 0);
+        item.title     = column_text(m_statement, 1);
+        item.content.assign(column_text(m_statement, 2),
+                            sqlite3_column_bytes(m_statement, 2));
         item.encrypted = sqlite3_column_int(m_statement, 3);
-
-        item.timestamp = 
-            reinterpret_cast<const char*>(sqlite3_column_text(m_statement, 4));
+        item.timestamp = sqlite3_column_int64(m_statement, 4);
     }
+}
 
-    // Select the tags for each item
-    // TODO: Evaluate inefficiency of this and redo if needed
-    m_query.str("");
-    m_query << "SELECT Title from Tag "
-               "JOIN ItemTag ON Tag.TagID = ItemTag.TagID "
-               "WHERE ItemTag.ItemID = "
-               "(SELECT ItemID from Item WHERE Item.Title = ?);";
+//--------------------------------------------------------------------------------
+// Steps through m_statement, appending an Item for each run of rows with the same
+// ItemID and collecting the tag titles of the run.
+// @pre m_statement is prepared with a query selecting ITEM_COLUMNS and Tag.Title
+//      with ITEM_TAG_JOIN, ordered so that the rows of an item are adjacent.
+//--------------------------------------------------------------------------------
+void SQLite3_Serializer::fetch_tagged_items(vector<Item*>& out_items)
+    throw(runtime_error) {
 
-    for (size_t i = 0; i < out_items.size(); ++i) {
-        prepare(1, out_items[i]->title.c_str());
-        while (step() == SQLITE_ROW) {
-            out_items[i]->tags.push_back(
-                reinterpret_cast<const char*>(sqlite3_column_text(m_statement, 0))
-            );
+    Item* item = 0;
+    while (step() == SQLITE_ROW) {
+        int id = sqlite3_column_int(m_statement, 0);
+        if (!item || item->id != id) {
+            out_items.push_back(item = new Item);
+            item->id        = id;
+            item->title     = column_text(m_statement, 1);
+            item->content.assign(column_text(m_statement, 2),
+                                 sqlite3_column_bytes(m_statement, 2));
+            item->encrypted = sqlite3_column_int(m_statement, 3);
+            item->timestamp = sqlite3_column_int64(m_statement, 4);
+        }
+        if (sqlite3_column_type(m_statement, 5) != SQLITE_NULL) {
+            item->tags.push_back(column_text(m_statement, 5));
         }
     }
-    end_transaction();
 }
 
 //--------------------------------------------------------------------------------
-// Move the item i, from the Item table to the TrashItem table and timestamp the
-// transaction
-// @pre  The parameter record is assumed to contain the most recent data of the
-//       item.
-// @post The data in the record is inserted into the trash table, removed from
-//       the item table, and its tag relations removed from itemtags
-// @note Currently tag relations are not preserved for trashed items (mainly due
-//       to laziness). The tags are however stored as a space separated string
-//       in the trash item table, so you can parse them and restore them if need
-//       be.
+// Loads the tags of items[first..] with one query per ID_BATCH items rather
+// than one per item.
 //--------------------------------------------------------------------------------
-void SQLite3_Serializer::trash(const Item& record) 
+void SQLite3_Serializer::fetch_tags(vector<Item*>& items, size_t first)
     throw(runtime_error) {
 
-    begin_transaction();
+    map<int, Item*> by_id;
+    for (size_t i = first; i < items.size(); ++i) {
+        by_id[items[i]->id] = items[i];
+    }
+    map<int, Item*>::iterator it = by_id.begin();
+    while (it != by_id.end()) {
+        m_query.str("");
+        m_query << "SELECT ItemTag.ItemID, Tag.Title FROM ItemTag "
+                   "JOIN Tag ON Tag.TagID = ItemTag.TagID "
+                   "WHERE ItemTag.ItemID IN (";
 
-    m_query.str("");
-    m_query << "DELETE FROM Item WHERE ItemID = "    << record.id << "; ";
+        for (size_t n = 0; it != by_id.end() && n < ID_BATCH; ++it, ++n) {
+            m_query << (n == 0 ? "" : ",") << it->first;
+        }
+        m_query << ") ORDER BY ItemTag.ID;";
+        prepare(0);
 
-    prepare(0);
-    step();
+        while (step() == SQLITE_ROW) {
+            by_id[sqlite3_column_int(m_statement, 0)]->tags.push_back(
+                column_text(m_statement, 1)
+            );
+        }
+    }
+}
 
-    m_query.str("");
-    m_query << "DELETE FROM ItemTag WHERE ItemID = " << record.id << ";";
-    prepare(0);
-    step();
+//--------------------------------------------------------------------------------
+// SQLite3_Options
+//--------------------------------------------------------------------------------
+SQLite3_Options::SQLite3_Options() : page_size(0),
+                                     cache_size(0),
+                                     mmap_size(0),
+                                     synchronous(SYNC_DEFAULT),
+                                     journal_mode(JOURNAL_DEFAULT),
+                                     temp_store(TEMP_DEFAULT),
+                                     read_only(false),
+                                     immutable(false),
+                                     tag_index(false),
+                                     busy_timeout(0),
+                                     busy_backoff(100),
+                                     busy_retries(0) {
+}
 
-    m_query.str("");
-    m_query << "INSERT INTO TrashItem(Title, Content, Tags, Encrypted, Timestamp)"
-               " VALUES(?, ?, ?, " << record.encrypted << ", " 
-                                   << SQLITE_DATE << ");";
+SQLite3_Options SQLite3_Options::durable() {
+    SQLite3_Options options;
+    options.synchronous  = SYNC_FULL;
+    options.journal_mode = JOURNAL_WAL;
+    options.busy_timeout = 5000;
+    options.busy_retries = 3;
+    return options;
+}
 
-    prepare(3, record.title.c_str(), record.content.c_str(), 
-                                     tags2tag_str(record.tags));
-    step();
+SQLite3_Options SQLite3_Options::bulk_load() {
+    SQLite3_Options options;
+    options.page_size    = 16384;
+    options.cache_size   = -256 * 1024;
+    options.synchronous  = SYNC_OFF;
+    options.journal_mode = JOURNAL_MEMORY;
+    options.temp_store   = TEMP_MEMORY;
+    return options;
+}
 
-    end_transaction();
+SQLite3_Options SQLite3_Options::read_mostly() {
+    SQLite3_Options options;
+    options.cache_size   = -64 * 1024;
+    options.mmap_size    = 256 * 1024 * 1024;
+    options.temp_store   = TEMP_MEMORY;
+    options.read_only    = true;
+    options.tag_index    = true;
+    return options;
 }
 
 //--------------------------------------------------------------------------------
-// Read all tags in the Tag table into the output parameter.
+// Opens the connection according to the read-only and immutable options.
 //--------------------------------------------------------------------------------
-void SQLite3_Serializer::tags(vector<string>& out_tags) 
+void SQLite3_Serializer::open(const char* db_spec)
     throw(runtime_error) {
 
-    m_query.str("SELECT Title from Tag;");
-    prepare(0);
-    while (step() == SQLITE_ROW) {
-        out_tags.push_back(
+    int flags = SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE;
+    string filename = db_spec;
+
+    if (m_options.read_only || m_options.immutable) {
+        flags = SQLITE_OPEN_READONLY;
+    }
+    if (m_options.immutable) {
+        flags |= SQLITE_OPEN_URI;
+        filename = file_uri(db_spec) + "?immutable=1";
+    }
+    if (sqlite3_open_v2(filename.c_str(), &m_db, flags, NULL) != SQLITE_OK) {
+        throw runtime_error(string(sqlite3_errmsg(m_db)));
+    }
+    if (sqlite3_create_function(m_db, "sha256", 1,
+                                SQLITE_UTF8 | SQLITE_DETERMINISTIC, NULL,
+                                sha256_function, NULL, NULL) != SQLITE_OK) {
+        throw runtime_error(string(sqlite3_errmsg(m_db)));
+    }
+    if (m_options.busy_timeout > 0) {
+        sqlite3_busy_handler(m_db, busy_handler, this);
+    }
+}
+
+//--------------------------------------------------------------------------------
+// Applies the tuning PRAGMAs. The page size, auto vacuum and journal mode are
+// properties of the database file, so they are left alone on read-only
+// connections; the first two only take effect on a new database.
+// @pre No transaction is active (the journal mode cannot change within one).
+//--------------------------------------------------------------------------------
+void SQLite3_Serializer::apply_options()
+    throw(runtime_error) {
+
+    bool writable = !m_options.read_only && !m_options.immutable;
+
+    if (writable && m_options.page_size) {
+        m_query.str("");
+        m_query << "PRAGMA page_size = " << m_options.page_size << ";";
+        prepare(0);
+        step();
+    }
+    if (writable && m_options.maintenance.vacuum_pages > 0) {
+        exec("PRAGMA auto_vacuum = INCREMENTAL;");
+    }
+    if (m_options.cache_size) {
+        m_query.str("");
+        m_query << "PRAGMA cache_size = " << m_options.cache_size << ";";
+        prepare(0);
+        step();
+    }
+    if (m_options.mmap_size) {
+        m_query.str("");
+        m_query << "PRAGMA mmap_size = " << m_options.mmap_size << ";";
+        prepare(0);
+        step();
+    }
+    if (m_options.synchronous != SQLite3_Options::SYNC_DEFAULT) {
+        m_query.str("");
+        m_query << "PRAGMA synchronous = " 
+                << SYNCHRONOUS_PRAGMA[m_options.synchronous] << ";";
+        prepare(0);
+        step();
+    }
+    if (writable && m_options.journal_mode != SQLite3_Options::JOURNAL_DEFAULT) {
+        m_query.str("");
+        m_query << "PRAGMA journal_mode = " 
+                << JOURNAL_MODE_PRAGMA[m_options.journal_mode] << ";";
+        prepare(0);
+        step();
+    }
+    if (m_options.temp_store != SQLite3_Options::TEMP_DEFAULT) {
+        m_query.str("");
+        m_query << "PRAGMA temp_store = " 
+                << TEMP_STORE_PRAGMA[m_options.temp_store] << ";";
+        prepare(0);
+        step();
+    }
+}
+
+//--------------------------------------------------------------------------------
+// Ctor: Initialises the database connection and creates the schema if need be.
+//--------------------------------------------------------------------------------
+SQLite3_Serializer::SQLite3_Serializer(const char* db_spec,
+                                       const SQLite3_Options& options) 
+    throw(runtime_error) : m_db(0),
+                           m_statement(0),
+                           m_error_msg(0),
+                           m_query(""),
+                           m_options(options),
+                           m_index(options.tag_index ? new Tag_Index : 0),
+                           m_data_version(0),
+                           m_tag_version(0),
+                           m_stale(true),
+                           m_mark(0),
+                           m_batch(false),
+                           m_busy(false),
+                           m_busy_waited(0),
+                           m_seed(static_cast<unsigned int>(epoch_usec()) ^
+                                  static_cast<unsigned int>(getpid())),
+                           m_maintenance(0) {
+
+    bool writable = !m_options.read_only && !m_options.immutable;
+
+    try {
+        open(db_spec);
+        apply_options();
+
+        // begin_transaction() would load the tag state before the tables exist
+        exec(writable ? "BEGIN IMMEDIATE TRANSACTION;" : "BEGIN TRANSACTION;");
+        if (!writable) {
+            exec("PRAGMA user_version;");
+            if (sqlite3_column_int(m_statement, 0) != SCHEMA_VERSION) {
+                throw runtime_error("The database schema is out of date and "
+                                    "cannot be migrated read-only");
+            }
+        }
+        else {
+            exec("SELECT COUNT(*) FROM sqlite_master WHERE name = 'Item';");
+            bool created = sqlite3_column_int(m_statement, 0) == 0;
+            exec(CONTENT_DDL);
+            exec(CONTENT_BODY_DDL);
+            exec(ITEM_DDL);
+            exec(TAG_DDL);
+            exec(ITEM_TAG_DDL);
+            exec(TRASH_DDL);
+            exec(TAG_VERSION_DDL);
+            exec(TAG_VERSION_ROW);
+            migrate(created);
+            exec(ITEM_TIMESTAMP_IDX);
+            exec(ITEM_TITLE_IDX);
+            exec(ITEM_TAG_TAG_IDX);
+            exec(ITEM_TAG_ITEM_IDX);
+            for (const char** sql = TAG_VERSION_TRIGGERS; *sql; ++sql) {
+                exec(*sql);
+            }
+            exec(FKEYS_ON);
+        }
+        revalidate();
+        end_transaction();
+
+        const char* filename = sqlite3_db_filename(m_db, "main");
+        if (writable && m_options.maintenance.interval > 0 &&
+            filename && *filename) {
+            m_maintenance = new Maintenance_Scheduler(filename,
+                                                      m_options.maintenance);
+        }
+    }
+    catch (const exception&) {
+        sqlite3_finalize(m_statement);
+        sqlite3_close(m_db);
+        delete m_index;
+        throw;
+    }
+}
+
+//--------------------------------------------------------------------------------
+// Loads every tag and its usage count into the in-memory tag dictionary.
+//--------------------------------------------------------------------------------
+void SQLite3_Serializer::load_tags()
+    throw(runtime_error) {
+
+    m_tags.clear();
+    m_query.str("SELECT TagID, Title, ItemCount FROM Tag;");
+    prepare(0);
+    while (step() == SQLITE_ROW) {
+        m_tags.insert(
+            sqlite3_column_int(m_statement, 0),
+            column_text(m_statement, 1),
+            sqlite3_column_int(m_statement, 2)
+        );
+    }
+}
+
+//--------------------------------------------------------------------------------
+// Builds the in-memory tag index (if enabled) from the Item and ItemTag tables.
+// Rows are read in id order so that the bitmaps are filled by appending.
+//--------------------------------------------------------------------------------
+void SQLite3_Serializer::load_index()
+    throw(runtime_error) {
+
+    if (!m_index) {
+        return;
+    }
+    m_index->clear();
+    m_query.str("SELECT ItemID FROM Item ORDER BY ItemID;");
+    prepare(0);
+    while (step() == SQLITE_ROW) {
+        m_index->add_item(sqlite3_column_int(m_statement, 0));
+    }
+    m_query.str("SELECT TagID, ItemID FROM ItemTag ORDER BY TagID, ItemID;");
+    prepare(0);
+    while (step() == SQLITE_ROW) {
+        m_index->add(
+            sqlite3_column_int(m_statement, 1),
+            sqlite3_column_int(m_statement, 0)
+        );
+    }
+}
+
+//--------------------------------------------------------------------------------
+// Dtor: Closes the database connection.
+//--------------------------------------------------------------------------------
+SQLite3_Serializer::~SQLite3_Serializer() {
+    delete m_maintenance;
+    delete m_index;
+    sqlite3_finalize(m_statement);
+    if (m_db) {
+        sqlite3_close(m_db);
+    }
+    if (m_error_msg) {
+        sqlite3_free(m_error_msg);
+    }
+}
+
+//--------------------------------------------------------------------------------
+// Inserts or updates an existing item.
+//--------------------------------------------------------------------------------
+void SQLite3_Serializer::write(Item& record) 
+    throw(runtime_error) {
+
+    int     id        = record.id;
+    int64_t timestamp = record.timestamp;
+    for (int attempt = 0; ; ++attempt) {
+        try {
+            begin_transaction(true);
+            int content_id = acquire_content(record.content);
+            if (record.id == 0) {
+                insert(record, content_id);
+            }
+            else {
+                update(record, content_id);
+            }
+            end_transaction();
+            return;
+        }
+        catch (const exception&) {
+            record.id        = id;
+            record.timestamp = timestamp;
+            if (!abort_transaction(attempt)) {
+                throw;
+            }
+        }
+    }
+}
+
+//--------------------------------------------------------------------------------
+// Inserts or updates an existing item, streaming in its content. A failure
+// rolls back the whole write; as the source cannot be read twice, it is not
+// retried.
+//--------------------------------------------------------------------------------
+void SQLite3_Serializer::write(Item& record, Byte_Source& content, int64_t size)
+    throw(runtime_error) {
+
+    int     id        = record.id;
+    int64_t timestamp = record.timestamp;
+    try {
+        begin_transaction(true);
+        int content_id = stream_content(content, size);
+        if (record.id == 0) {
+            insert(record, content_id);
+        }
+        else {
+            update(record, content_id);
+        }
+        end_transaction();
+    }
+    catch (const exception&) {
+        record.id        = id;
+        record.timestamp = timestamp;
+        abort_transaction();
+        throw;
+    }
+}
+
+//--------------------------------------------------------------------------------
+// Inserts an Item, Tags and all ItemTags to the database,
+// @pre A write transaction is active and content_id holds a reference counted
+//      for the Item.
+//--------------------------------------------------------------------------------
+void SQLite3_Serializer::insert(Item& record, int content_id) 
+    throw(runtime_error) {
+
+    record.timestamp = epoch_usec();
+    m_query.str("");
+    m_query << "INSERT INTO Item(Title, ContentID, Encrypted, Timestamp) "
+               "VALUES(?, " << content_id << ", " << record.encrypted << ", " 
+                            << record.timestamp << ");";
+    prepare(1, record.title.c_str());
+    step();
+    record.id = sqlite3_last_insert_rowid(m_db);
+    Tag_Change change = { record.id, 0, 1, "" };
+    m_pending.push_back(change);
+    write_tags(record, false);
+}
+
+//--------------------------------------------------------------------------------
+// Brings the tag relations of the item in line with its tags. The tags are
+// diffed against the stored relations by case folded title (as the NOCASE
+// collation of Tag.Title compares them), so that unchanged relations are left
+// alone, and the removed and added relations are each applied with a constant
+// number of set-based statements.
+// @param update Whether the item may have stored relations (else all its tags
+//               are added).
+//--------------------------------------------------------------------------------
+void SQLite3_Serializer::write_tags(const Item& record, bool update) 
+    throw(runtime_error) {
+
+    map<string, string> added;
+    for (size_t i = 0; i < record.tags.size(); ++i) {
+        added.insert(make_pair(Tag_Dictionary::fold(record.tags[i]), 
+                               record.tags[i]));
+    }
+
+    vector<int> removed;
+    if (update) {
+        m_query.str("");
+        m_query << "SELECT Tag.TagID, Tag.Title FROM ItemTag "
+                   "JOIN Tag ON Tag.TagID = ItemTag.TagID "
+                   "WHERE ItemTag.ItemID = " << record.id << ";";
+        prepare(0);
+        while (step() == SQLITE_ROW) {
+            if (added.erase(Tag_Dictionary::fold(column_text(m_statement, 1))) 
+                == 0) {
+                removed.push_back(sqlite3_column_int(m_statement, 0));
+            }
+        }
+    }
+    relate_tags(record.id, removed, -1);
+
+    vector<string> titles;
+    for (map<string, string>::const_iterator it = added.begin(); 
+         it != added.end(); ++it) {
+        titles.push_back(it->second);
+    }
+    vector<int> tag_ids;
+    find_tags(titles, tag_ids);
+    relate_tags(record.id, tag_ids, 1);
+}
+
+//--------------------------------------------------------------------------------
+// Looks up the TagIDs of the titles, creating the tags that do not exist yet,
+// with one INSERT and one SELECT per ID_BATCH titles.
+//--------------------------------------------------------------------------------
+void SQLite3_Serializer::find_tags(const vector<string>& titles, 
+                                   vector<int>& tag_ids)
+    throw(runtime_error) {
+
+    for (size_t first = 0; first < titles.size(); first += ID_BATCH) {
+        vector<string> batch(titles.begin() + first,
+                             titles.begin() + min(first + ID_BATCH, 
+                                                  titles.size()));
+        m_query.str("");
+        m_query << "INSERT OR IGNORE INTO Tag(Title) VALUES ";
+        for (size_t i = 0; i < batch.size(); ++i) {
+            m_query << (i == 0 ? "(?)" : ", (?)");
+        }
+        m_query << ";";
+        prepare(0);
+        bind_tags(batch, 1);
+        step();
+
+        m_query.str("");
+        m_query << "SELECT TagID, Title, ItemCount FROM Tag "
+                   "WHERE Title IN (" << placeholders(batch.size()) << ");";
+        prepare(0);
+        bind_tags(batch, 1);
+        while (step() == SQLITE_ROW) {
+            int tag_id = sqlite3_column_int(m_statement, 0);
+            const char* title = column_text(m_statement, 1);
+
+            // The tag is new (possibly to an earlier, pending write of the
+            // batch, whose counts the row already includes)
+            if (m_tags.find(title) != tag_id) {
+                Tag_Change change = { 0, tag_id,
+                                      sqlite3_column_int(m_statement, 2),
+                                      title };
+                m_pending.push_back(change);
+            }
+            tag_ids.push_back(tag_id);
+        }
+    }
+}
+
+//--------------------------------------------------------------------------------
+// Adds (delta 1) or removes (delta -1) the relations between the item and the 
+// tags, and adjusts the tag counters, the dictionary and the index (on commit)
+// to match.
+//--------------------------------------------------------------------------------
+void SQLite3_Serializer::relate_tags(int item_id, const vector<int>& tag_ids, 
+                                     int delta)
+    throw(runtime_error) {
+
+    if (tag_ids.empty()) {
+        return;
+    }
+    stringstream list;
+    for (size_t i = 0; i < tag_ids.size(); ++i) {
+        list << (i == 0 ? "" : ", ") << tag_ids[i];
+    }
+
+    m_query.str("");
+    if (delta > 0) {
+        m_query << "INSERT INTO ItemTag(ItemID, TagID) VALUES ";
+        for (size_t i = 0; i < tag_ids.size(); ++i) {
+            m_query << (i == 0 ? "(" : ", (") << item_id << ", " 
+                                              << tag_ids[i] << ")";
+        }
+        m_query << ";";
+    }
+    else {
+        m_query << "DELETE FROM ItemTag WHERE ItemID = " << item_id 
+                << " AND TagID IN (" << list.str() << ");";
+    }
+    prepare(0);
+    step();
+
+    m_query.str("");
+    m_query << "UPDATE Tag SET ItemCount = ItemCount + (" << delta << ") "
+               "WHERE TagID IN (" << list.str() << ");";
+    prepare(0);
+    step();
+
+    for (size_t i = 0; i < tag_ids.size(); ++i) {
+        Tag_Change change = { item_id, tag_ids[i], delta, "" };
+        m_pending.push_back(change);
+    }
+}
+
+//--------------------------------------------------------------------------------
+// Updates an existing item as well as all tag relations
+// @pre A write transaction is active and content_id holds a reference counted
+//      for the Item.
+//--------------------------------------------------------------------------------
+void SQLite3_Serializer::update(Item& record, int content_id) 
+    throw(runtime_error) {
+
+    int old_content_id = item_content(record.id);
+
+    record.timestamp = epoch_usec();
+    m_query.str("");
+    m_query << "UPDATE Item set Title = ?, ContentID = " << content_id 
+            << ", Encrypted = " << record.encrypted 
+            << ", Timestamp = " << record.timestamp
+            << " WHERE ItemID = " << record.id << ";";
+
+    prepare(1, record.title.c_str());
+    step();
+    // Thrown before anything else changes, so that the transaction is rolled
+    // back with the content reference acquired for the item
+    if (sqlite3_changes(m_db) != 1) {
+        throw runtime_error("No such item");
+    }
+    if (old_content_id) {
+        release_content(old_content_id);
+    }
+    
+    write_tags(record, true);
+}
+
+//--------------------------------------------------------------------------------
+// Returns the ContentID of an identical body, or stores the body if there is
+// none, and counts a new reference to it. Only the hash is compared, so a body
+// that is already stored is not written again.
+//--------------------------------------------------------------------------------
+int SQLite3_Serializer::acquire_content(const string& body)
+    throw(runtime_error) {
+
+    string hash = SHA256::digest(body);
+    int content_id = share_content(hash);
+    if (content_id) {
+        return content_id;
+    }
+    m_query.str("");
+    m_query << "INSERT INTO Content(Hash, Size, Refs) "
+               "VALUES(?, " << body.size() << ", 1);";
+    prepare(0);
+    sqlite3_bind_blob(m_statement, 1, hash.data(), hash.size(), SQLITE_STATIC);
+    step();
+    content_id = sqlite3_last_insert_rowid(m_db);
+
+    m_query.str("");
+    m_query << "INSERT INTO ContentBody(ContentID, Body) "
+               "VALUES(" << content_id << ", ?);";
+    prepare(0);
+    sqlite3_bind_text(m_statement, 1, body.data(), body.size(), SQLITE_STATIC);
+    step();
+    return content_id;
+}
+
+//--------------------------------------------------------------------------------
+// Stores a body read from the source as acquire_content() does. The body is
+// written into a zero filled BLOB of the given size a chunk at a time and
+// hashed as it goes; if an identical body turns out to be stored already, the
+// new rows are deleted again and the existing ones are referenced instead.
+// The BLOB is the last column of its row, so SQLite does not expand it in
+// memory when inserting it.
+//--------------------------------------------------------------------------------
+int SQLite3_Serializer::stream_content(Byte_Source& source, int64_t size)
+    throw(runtime_error) {
+
+    m_query.str("");
+    m_query << "INSERT INTO Content(Hash, Size, Refs) "
+               "VALUES(NULL, " << size << ", 1);";
+    prepare(0);
+    step();
+    int content_id = sqlite3_last_insert_rowid(m_db);
+
+    m_query.str("");
+    m_query << "INSERT INTO ContentBody(ContentID, Body) "
+               "VALUES(" << content_id << ", zeroblob(" << size << "));";
+    prepare(0);
+    step();
+
+    SHA256 hash;
+    sqlite3_blob* blob = 0;
+    try {
+        if (sqlite3_blob_open(m_db, "main", "ContentBody", "Body", content_id,
+                              1, &blob) != SQLITE_OK) {
+            throw runtime_error(sqlite3_errmsg(m_db));
+        }
+        vector<char> buffer(BLOB_CHUNK);
+        int64_t offset = 0;
+        size_t count;
+        while ((count = source.read(&buffer[0], buffer.size())) > 0) {
+            if (static_cast<int64_t>(count) > size - offset) {
+                throw runtime_error("The content is longer than its size");
+            }
+            if (sqlite3_blob_write(blob, &buffer[0], count,
+                                   offset) != SQLITE_OK) {
+                throw runtime_error(sqlite3_errmsg(m_db));
+            }
+            hash.update(&buffer[0], count);
+            offset += count;
+        }
+        if (offset != size) {
+            throw runtime_error("The content is shorter than its size");
+        }
+        if (sqlite3_blob_close(blob) != SQLITE_OK) {
+            blob = 0;
+            throw runtime_error(sqlite3_errmsg(m_db));
+        }
+    }
+    catch (const exception&) {
+        sqlite3_blob_close(blob);
+        delete_content(content_id);
+        throw;
+    }
+
+    string digest = hash.digest();
+    int shared_id = share_content(digest);
+    if (shared_id) {
+        delete_content(content_id);
+        return shared_id;
+    }
+    m_query.str("");
+    m_query << "UPDATE Content SET Hash = ? WHERE ContentID = " << content_id
+            << ";";
+    prepare(0);
+    sqlite3_bind_blob(m_statement, 1, digest.data(), digest.size(),
+                      SQLITE_STATIC);
+    step();
+    return content_id;
+}
+
+//--------------------------------------------------------------------------------
+// Returns the ContentID of the body with the hash, counting a new reference to
+// it, or 0 if no such body is stored.
+//--------------------------------------------------------------------------------
+int SQLite3_Serializer::share_content(const string& hash)
+    throw(runtime_error) {
+
+    m_query.str("SELECT ContentID FROM Content WHERE Hash = ?;");
+    prepare(0);
+    sqlite3_bind_blob(m_statement, 1, hash.data(), hash.size(), SQLITE_STATIC);
+    if (step() != SQLITE_ROW) {
+        return 0;
+    }
+    int content_id = sqlite3_column_int(m_statement, 0);
+    m_query.str("");
+    m_query << "UPDATE Content SET Refs = Refs + 1 "
+               "WHERE ContentID = " << content_id << ";";
+    prepare(0);
+    step();
+    return content_id;
+}
+
+//--------------------------------------------------------------------------------
+// Drops a reference to the content, deleting the body with the last one.
+//--------------------------------------------------------------------------------
+void SQLite3_Serializer::release_content(int content_id)
+    throw(runtime_error) {
+
+    m_query.str("");
+    m_query << "UPDATE Content SET Refs = Refs - 1 "
+               "WHERE ContentID = " << content_id << ";";
+    prepare(0);
+    step();
+
+    m_query.str("");
+    m_query << "SELECT Refs FROM Content WHERE ContentID = " << content_id << ";";
+    prepare(0);
+    if (step() == SQLITE_ROW && sqlite3_column_int(m_statement, 0) <= 0) {
+        delete_content(content_id);
+    }
+}
+
+//--------------------------------------------------------------------------------
+// Deletes a stored body along with its Content row.
+//--------------------------------------------------------------------------------
+void SQLite3_Serializer::delete_content(int content_id)
+    throw(runtime_error) {
+
+    m_query.str("");
+    m_query << "DELETE FROM ContentBody WHERE ContentID = " << content_id << ";";
+    prepare(0);
+    step();
+
+    m_query.str("");
+    m_query << "DELETE FROM Content WHERE ContentID = " << content_id << ";";
+    prepare(0);
+    step();
+}
+
+//--------------------------------------------------------------------------------
+// Returns the ContentID of a stored item, or 0 if there is no such item.
+//--------------------------------------------------------------------------------
+int SQLite3_Serializer::item_content(int item_id)
+    throw(runtime_error) {
+
+    m_query.str("");
+    m_query << "SELECT ContentID FROM Item WHERE ItemID = " << item_id << ";";
+    prepare(0);
+    return step() == SQLITE_ROW ? sqlite3_column_int(m_statement, 0) : 0;
+}
+
+//--------------------------------------------------------------------------------
+// Fetches the rows and tags of the given ItemIDs, ID_BATCH ids per statement,
+// and orders the fetched items newest first.
+//--------------------------------------------------------------------------------
+void SQLite3_Serializer::fetch_by_ids(const Roaring_Bitmap& ids,
+                                      vector<Item*>& out_items)
+    throw(runtime_error) {
+
+    vector<uint32_t> id_list;
+    ids.values(id_list);
+
+    size_t first = out_items.size();
+    for (size_t i = 0; i < id_list.size(); i += ID_BATCH) {
+        m_query.str("");
+        m_query << "SELECT " ITEM_COLUMNS " FROM " ITEM_TABLES
+                   "WHERE Item.ItemID IN (";
+        for (size_t j = i; j < id_list.size() && j < i + ID_BATCH; ++j) {
+            m_query << (j == i ? "" : ",") << id_list[j];
+        }
+        m_query << ");";
+        prepare(0);
+        fetch_items(out_items);
+    }
+    fetch_tags(out_items, first);
+    sort(out_items.begin() + first, out_items.end(), Item_Newer());
+}
+
+//--------------------------------------------------------------------------------
+// Read all items associated with the given tags into the output parameter.
+//--------------------------------------------------------------------------------
+void SQLite3_Serializer::read(const vector<string>& tags, 
+                              vector<Item*>& out_items)
+    throw(runtime_error) {
+
+    if (tags.empty()) {
+        return;
+    }
+    size_t first = out_items.size();
+    for (int attempt = 0; ; ++attempt) {
+        try {
+            begin_transaction();
+            // The index lags behind the uncommitted writes of a batch
+            if (m_index && m_pending.empty()) {
+                Roaring_Bitmap matches;
+                m_index->any(tags, m_tags, matches);
+                fetch_by_ids(matches, out_items);
+                end_transaction();
+                return;
+            }
+            // TODO: Add option for matching all or one of the tags
+            // Select all items matching the tags
+            m_query.str("");
+            m_query << "SELECT " ITEM_COLUMNS " "
+                       "FROM " ITEM_TABLES
+                       "WHERE Item.ItemID IN "
+                            "(SELECT ItemID FROM ItemTag WHERE TagID IN "
+                                "(SELECT TagID FROM Tag WHERE Title IN ("
+                    << placeholders(tags.size()) << "))) "
+                       "ORDER BY Item.Timestamp DESC, Item.ItemID DESC;";
+            prepare(0);
+            bind_tags(tags, 1);
+
+            fetch_items(out_items);
+            fetch_tags(out_items, first);
+            end_transaction();
+            return;
+        }
+        catch (const exception&) {
+            discard_items(out_items, first);
+            if (!abort_transaction(attempt)) {
+                throw;
+            }
+        }
+    }
+}
+
+//--------------------------------------------------------------------------------
+// Count the items matching the tags without fetching them. Titles equal but for
+// case name the same tag, so they are counted once; an all filter with a title
+// that names no tag then matches nothing, as no item reaches the tag count.
+//--------------------------------------------------------------------------------
+long SQLite3_Serializer::count(const vector<string>& tags, Tag_Match mode)
+    throw(runtime_error) {
+
+    set<string> titles;
+    for (size_t i = 0; i < tags.size(); ++i) {
+        titles.insert(Tag_Dictionary::fold(tags[i]));
+    }
+    if (titles.empty()) {
+        return 0;
+    }
+    if (titles.size() == 1) {
+        return tag_count(tags[0]);
+    }
+    for (int attempt = 0; ; ++attempt) {
+        try {
+            long count = 0;
+            begin_transaction();
+            if (m_index && m_pending.empty()) {
+                Roaring_Bitmap matches;
+                if (mode == MATCH_ALL) {
+                    m_index->all(tags, m_tags, matches);
+                }
+                else {
+                    m_index->any(tags, m_tags, matches);
+                }
+                count = matches.cardinality();
+            }
+            else {
+                m_query.str("");
+                if (mode == MATCH_ALL) {
+                    m_query << "SELECT COUNT(*) FROM "
+                                 "(SELECT ItemID FROM ItemTag WHERE TagID IN ";
+                }
+                else {
+                    m_query << "SELECT COUNT(DISTINCT ItemID) FROM ItemTag "
+                               "WHERE TagID IN ";
+                }
+                m_query << "(SELECT TagID FROM Tag WHERE Title IN ("
+                        << placeholders(tags.size()) << "))";
+                if (mode == MATCH_ALL) {
+                    m_query << " GROUP BY ItemID HAVING COUNT(DISTINCT TagID) = "
+                            << titles.size() << ")";
+                }
+                m_query << ";";
+                prepare(0);
+                bind_tags(tags, 1);
+                step();
+                count = static_cast<long>(sqlite3_column_int64(m_statement, 0));
+            }
+            end_transaction();
+            return count;
+        }
+        catch (const exception&) {
+            if (!abort_transaction(attempt)) {
+                throw;
+            }
+        }
+    }
+}
+
+//--------------------------------------------------------------------------------
+bool SQLite3_Serializer::exists(const vector<string>& tags)
+    throw(runtime_error) {
+
+    if (tags.empty()) {
+        return false;
+    }
+    m_query.str("");
+    m_query << "SELECT EXISTS(SELECT 1 FROM ItemTag WHERE TagID IN "
+                   "(SELECT TagID FROM Tag WHERE Title IN ("
+            << placeholders(tags.size()) << ")));";
+    prepare(0);
+    bind_tags(tags, 1);
+    step();
+    bool found = sqlite3_column_int(m_statement, 0) != 0;
+
+    // A statement left on a row would hold its read lock
+    sqlite3_reset(m_statement);
+    return found;
+}
+
+//--------------------------------------------------------------------------------
+// Appends the SQL condition equivalent to the query node to m_query, adding the
+// values of its text parameters to params in order.
+//--------------------------------------------------------------------------------
+void SQLite3_Serializer::compile(const Query_Node& node, vector<string>& params) {
+    switch (node.type) {
+        case Query_Node::ANY_TAG:
+        case Query_Node::ALL_TAGS:
+            m_query << "Item.ItemID IN "
+                         "(SELECT ItemID FROM ItemTag WHERE TagID IN "
+                             "(SELECT TagID FROM Tag WHERE Title IN ("
+                    << placeholders(node.values.size()) << "))";
+            if (node.type == Query_Node::ALL_TAGS) {
+                m_query << " GROUP BY ItemID HAVING COUNT(DISTINCT TagID) = "
+                        << node.values.size();
+            }
+            m_query << ")";
+            params.insert(params.end(), node.values.begin(), node.values.end());
+            break;
+
+        case Query_Node::TITLE:
+            m_query << "Item.Title LIKE ? ESCAPE '\\'";
+            params.push_back("%" + escape_like(node.values[0]) + "%");
+            break;
+
+        case Query_Node::AFTER:
+            m_query << "Item.Timestamp >= " << node.time;
+            break;
+
+        case Query_Node::BEFORE:
+            m_query << "Item.Timestamp < " << node.time;
+            break;
+
+        case Query_Node::NOT:
+            m_query << "NOT (";
+            compile(*node.children[0], params);
+            m_query << ")";
+            break;
+
+        case Query_Node::AND:
+        case Query_Node::OR:
+            m_query << "(";
+            for (size_t i = 0; i < node.children.size(); ++i) {
+                if (i > 0) {
+                    m_query << (node.type == Query_Node::AND ? " AND " : " OR ");
+                }
+                compile(*node.children[i], params);
+            }
+            m_query << ")";
+            break;
+    }
+}
+
+//--------------------------------------------------------------------------------
+// Read all items matching the query into the output parameter.
+//--------------------------------------------------------------------------------
+void SQLite3_Serializer::query(const Query& q, vector<Item*>& out_items)
+    throw(runtime_error) {
+
+    size_t first = out_items.size();
+    for (int attempt = 0; ; ++attempt) {
+        try {
+            begin_transaction();
+            if (m_index && m_pending.empty() && q.root().tags_only()) {
+                Roaring_Bitmap matches;
+                m_index->evaluate(q.root(), m_tags, matches);
+                fetch_by_ids(matches, out_items);
+                end_transaction();
+                return;
+            }
+            vector<string> params;
+            m_query.str("");
+            m_query << "SELECT " ITEM_COLUMNS " FROM " ITEM_TABLES "WHERE ";
+            compile(q.root(), params);
+            m_query << " ORDER BY Item.Timestamp DESC, Item.ItemID DESC;";
+            prepare(0);
+            bind_tags(params, 1);
+
+            fetch_items(out_items);
+            fetch_tags(out_items, first);
+            end_transaction();
+            return;
+        }
+        catch (const exception&) {
+            discard_items(out_items, first);
+            if (!abort_transaction(attempt)) {
+                throw;
+            }
+        }
+    }
+}
+
+//--------------------------------------------------------------------------------
+// Read the items with the given ids, ID_BATCH ids per joined statement, and put
+// them in the order of the ids.
+//--------------------------------------------------------------------------------
+void SQLite3_Serializer::read_by_id(const vector<int>& ids,
+                                    vector<Item*>& out_items)
+    throw(runtime_error) {
+
+    vector<Item*> fetched;
+    for (int attempt = 0; ; ++attempt) {
+        try {
+            begin_transaction();
+            for (size_t i = 0; i < ids.size(); i += ID_BATCH) {
+                m_query.str("");
+                m_query << "SELECT " ITEM_COLUMNS ", Tag.Title " ITEM_TAG_JOIN
+                           "WHERE Item.ItemID IN (";
+                for (size_t j = i; j < ids.size() && j < i + ID_BATCH; ++j) {
+                    m_query << (j == i ? "" : ",") << ids[j];
+                }
+                m_query << ") ORDER BY Item.ItemID, ItemTag.ID;";
+                prepare(0);
+                fetch_tagged_items(fetched);
+            }
+            end_transaction();
+            break;
+        }
+        catch (const exception&) {
+            discard_items(fetched, 0);
+            if (!abort_transaction(attempt)) {
+                throw;
+            }
+        }
+    }
+
+    map<int, Item*> by_id;
+    for (size_t i = 0; i < fetched.size(); ++i) {
+        by_id[fetched[i]->id] = fetched[i];
+    }
+    for (size_t i = 0; i < ids.size(); ++i) {
+        map<int, Item*>::iterator it = by_id.find(ids[i]);
+        if (it != by_id.end() && it->second) {
+            out_items.push_back(it->second);
+            it->second = 0;
+        }
+    }
+}
+
+//--------------------------------------------------------------------------------
+// Read the items with exactly the given title, newest first.
+//--------------------------------------------------------------------------------
+void SQLite3_Serializer::find_by_title(const string& title,
+                                       vector<Item*>& out_items)
+    throw(runtime_error) {
+
+    size_t first = out_items.size();
+    for (int attempt = 0; ; ++attempt) {
+        try {
+            begin_transaction();
+            m_query.str("");
+            m_query << "SELECT " ITEM_COLUMNS ", Tag.Title " ITEM_TAG_JOIN
+                       "WHERE Item.Title = ? "
+                       "ORDER BY Item.Timestamp DESC, Item.ItemID DESC, "
+                                "ItemTag.ID;";
+            prepare(0);
+            sqlite3_bind_text(m_statement, 1, title.c_str(), title.size(),
+                              SQLITE_STATIC);
+            fetch_tagged_items(out_items);
+            end_transaction();
+            return;
+        }
+        catch (const exception&) {
+            discard_items(out_items, first);
+            if (!abort_transaction(attempt)) {
+                throw;
+            }
+        }
+    }
+}
+
+//--------------------------------------------------------------------------------
+// Read all items modified within [from, to) into the output parameter.
+//--------------------------------------------------------------------------------
+void SQLite3_Serializer::read_range(int64_t from, int64_t to,
+                                    vector<Item*>& out_items)
+    throw(runtime_error) {
+
+    size_t first = out_items.size();
+    for (int attempt = 0; ; ++attempt) {
+        try {
+            begin_transaction();
+            m_query.str("");
+            m_query << "SELECT " ITEM_COLUMNS " FROM " ITEM_TABLES
+                       "WHERE Item.Timestamp >= " << from << 
+                       " AND  Item.Timestamp <  " << to << 
+                       " ORDER BY Item.Timestamp, Item.ItemID;";
+            prepare(0);
+
+            fetch_items(out_items);
+            fetch_tags(out_items, first);
+            end_transaction();
+            return;
+        }
+        catch (const exception&) {
+            discard_items(out_items, first);
+            if (!abort_transaction(attempt)) {
+                throw;
+            }
+        }
+    }
+}
+
+//--------------------------------------------------------------------------------
+// Read the limit most recently modified items associated with any of the tags
+// into the output parameter. The items are scanned newest first by the
+// Timestamp index (whose entries end in the ItemID), each probing ItemTagTag
+// for a relation, so that the scan stops at the limit instead of sorting all
+// the tagged items.
+//--------------------------------------------------------------------------------
+void SQLite3_Serializer::read_recent(const vector<string>& tags,
+                                     size_t limit,
+                                     vector<Item*>& out_items)
+    throw(runtime_error) {
+
+    if (tags.empty() || limit == 0) {
+        return;
+    }
+    size_t first = out_items.size();
+    for (int attempt = 0; ; ++attempt) {
+        try {
+            begin_transaction();
+            m_query.str("");
+            m_query << "SELECT " ITEM_COLUMNS " FROM " ITEM_TABLES
+                       "WHERE EXISTS "
+                            "(SELECT 1 FROM ItemTag "
+                             "WHERE ItemTag.ItemID = Item.ItemID "
+                             "AND   ItemTag.TagID IN "
+                                "(SELECT TagID FROM Tag WHERE Title IN ("
+                    << placeholders(tags.size()) << "))) "
+                       "ORDER BY Item.Timestamp DESC, Item.ItemID DESC "
+                       "LIMIT " << limit << ";";
+            prepare(0);
+            bind_tags(tags, 1);
+
+            fetch_items(out_items);
+            fetch_tags(out_items, first);
+            end_transaction();
+            return;
+        }
+        catch (const exception&) {
+            discard_items(out_items, first);
+            if (!abort_transaction(attempt)) {
+                throw;
+            }
+        }
+    }
+}
+
+//--------------------------------------------------------------------------------
+// Move the item i, from the Item table to the TrashItem table and timestamp the
+// transaction
+// @pre  The parameter record is assumed to contain the most recent data of the
+//       item.
+// @post The data in the record is inserted into the trash table, removed from
+//       the item table, and its tag relations removed from itemtags
+// @note Currently tag relations are not preserved for trashed items (mainly due
+//       to laziness). The tags are however stored as a space separated string
+//       in the trash item table, so you can parse them and restore them if need
+//       be.
+//--------------------------------------------------------------------------------
+void SQLite3_Serializer::trash(const Item& record) 
+    throw(runtime_error) {
+
+    for (int attempt = 0; ; ++attempt) {
+        try {
+            begin_transaction(true);
+            move_to_trash(record);
+            end_transaction();
+            return;
+        }
+        catch (const exception&) {
+            if (!abort_transaction(attempt)) {
+                throw;
+            }
+        }
+    }
+}
+
+//--------------------------------------------------------------------------------
+// Moves the item from the Item table to the TrashItem table, releasing its tag
+// relations.
+// @pre A write transaction is active.
+//--------------------------------------------------------------------------------
+void SQLite3_Serializer::move_to_trash(const Item& record) 
+    throw(runtime_error) {
+
+    // The reference of the item to its content passes to the trash row
+    int content_id = item_content(record.id);
+    if (!content_id) {
+        content_id = acquire_content(record.content);
+    }
+    m_query.str("");
+    m_query << "DELETE FROM Item WHERE ItemID = "    << record.id << "; ";
+
+    prepare(0);
+    step();
+
+    m_query.str("");
+    m_query << "SELECT TagID FROM ItemTag WHERE ItemID = " << record.id << ";";
+    prepare(0);
+    while (step() == SQLITE_ROW) {
+        Tag_Change change = { record.id, sqlite3_column_int(m_statement, 0), -1,
+                              "" };
+        m_pending.push_back(change);
+    }
+    Tag_Change removal = { record.id, 0, -1, "" };
+    m_pending.push_back(removal);
+
+    m_query.str("");
+    m_query << "UPDATE Tag SET ItemCount = ItemCount - "
+                    "(SELECT COUNT(*) FROM ItemTag "
+                     "WHERE ItemTag.ItemID = " << record.id << 
+                     " AND  ItemTag.TagID  = Tag.TagID) "
+               "WHERE TagID IN "
+                    "(SELECT TagID FROM ItemTag WHERE ItemID = " << record.id << ");";
+    prepare(0);
+    step();
+
+    m_query.str("");
+    m_query << "DELETE FROM ItemTag WHERE ItemID = " << record.id << ";";
+    prepare(0);
+    step();
+
+    m_query.str("");
+    m_query << "INSERT INTO TrashItem(Title, ContentID, Tags, Encrypted, "
+                                     "Timestamp)"
+               " VALUES(?, " << content_id << ", ?, " << record.encrypted << ", " 
+                                                       << epoch_usec() << ");";
+
+    // Built here, as connections on other threads trash at the same time
+    string tag_str;
+    for (size_t i = 0; i < record.tags.size(); ++i) {
+        tag_str += (i == 0 ? "" : " ") + record.tags[i];
+    }
+    prepare(2, record.title.c_str(), tag_str.c_str());
+    step();
+}
+
+//--------------------------------------------------------------------------------
+// Read all tags in the Tag table into the output parameter.
+//--------------------------------------------------------------------------------
+void SQLite3_Serializer::tags(vector<string>& out_tags) 
+    throw(runtime_error) {
+
+    m_query.str("SELECT Title from Tag;");
+    prepare(0);
+    while (step() == SQLITE_ROW) {
+        out_tags.push_back(
             reinterpret_cast<const char*>(sqlite3_column_text(m_statement, 0))
         );
 
     }
 }
+
+//--------------------------------------------------------------------------------
+// Complete a tag prefix from the in-memory tag dictionary, or from the Tag table
+// in the same order while the dictionary lags behind the open batch.
+//--------------------------------------------------------------------------------
+void SQLite3_Serializer::complete_tags(const string& prefix, size_t limit,
+                                       vector<string>& out_tags)
+    throw(runtime_error) {
+
+    if (limit == 0) {
+        return;
+    }
+    size_t first = out_tags.size();
+    for (int attempt = 0; ; ++attempt) {
+        try {
+            begin_transaction();
+            if (m_pending.empty()) {
+                m_tags.complete(prefix, limit, out_tags);
+            }
+            else {
+                string pattern = escape_like(prefix) + "%";
+                m_query.str("");
+                m_query << "SELECT Title FROM Tag WHERE Title LIKE ? "
+                           "ESCAPE '\\' ORDER BY ItemCount DESC, Title "
+                           "LIMIT " << limit << ";";
+                prepare(1, pattern.c_str());
+                while (step() == SQLITE_ROW) {
+                    out_tags.push_back(column_text(m_statement, 0));
+                }
+            }
+            end_transaction();
+            return;
+        }
+        catch (const exception&) {
+            out_tags.resize(first);
+            if (!abort_transaction(attempt)) {
+                throw;
+            }
+        }
+    }
+}
+
+//--------------------------------------------------------------------------------
+// Return the maintained item count of a tag.
+//--------------------------------------------------------------------------------
+long SQLite3_Serializer::tag_count(const string& tag)
+    throw(runtime_error) {
+
+    m_query.str("SELECT ItemCount FROM Tag WHERE Title = ?;");
+    prepare(1, tag.c_str());
+    long count = step() == SQLITE_ROW ? sqlite3_column_int64(m_statement, 0) : 0;
+
+    // A statement left on a row would hold its read lock
+    sqlite3_reset(m_statement);
+    return count;
+}
+
+//--------------------------------------------------------------------------------
+// Count the items matching the filter per co-occurring tag. Without a filter the
+// maintained counters are returned as they are; otherwise the relations of the
+// matching items are aggregated in one pass over the ItemTag indexes.
+//--------------------------------------------------------------------------------
+void SQLite3_Serializer::facets(const vector<string>& tags,
+                                vector<Tag_Count>& out_counts)
+    throw(runtime_error) {
+
+    size_t first = out_counts.size();
+    m_query.str("");
+    if (tags.empty()) {
+        m_query << "SELECT Title, ItemCount FROM Tag WHERE ItemCount > 0;";
+        prepare(0);
+    }
+    else {
+        m_query << "SELECT Tag.Title, COUNT(*) FROM ItemTag "
+                   "JOIN Tag ON Tag.TagID = ItemTag.TagID "
+                   "WHERE ItemTag.ItemID IN "
+                        "(SELECT ItemID FROM ItemTag WHERE TagID IN "
+                            "(SELECT TagID FROM Tag WHERE Title IN ("
+                << placeholders(tags.size()) << "))) "
+                   "GROUP BY ItemTag.TagID;";
+        prepare(0);
+        bind_tags(tags, 1);
+    }
+    while (step() == SQLITE_ROW) {
+        out_counts.push_back(Tag_Count(
+            column_text(m_statement, 0),
+            sqlite3_column_int64(m_statement, 1)
+        ));
+    }
+    sort(out_counts.begin() + first, out_counts.end(), Tag_Count_Rank());
+}
+
+//--------------------------------------------------------------------------------
+// Writes the content of an item to the sink through a Content_Reader.
+//--------------------------------------------------------------------------------
+void SQLite3_Serializer::read_content(int id, Byte_Sink& content)
+    throw(runtime_error) {
+
+    Content_Reader reader(*this, id);
+    copy_bytes(reader, content);
+}
+
+//--------------------------------------------------------------------------------
+// Content_Reader: Opens a read-only BLOB handle on the body of the item, if it
+// has one.
+//--------------------------------------------------------------------------------
+Content_Reader::Content_Reader(SQLite3_Serializer& db, int id)
+    throw(runtime_error) : m_db(db.m_db),
+                           m_blob(0),
+                           m_size(0),
+                           m_offset(0) {
+
+    db.m_query.str("");
+    db.m_query << "SELECT ContentID FROM Item WHERE ItemID = " << id << ";";
+    db.prepare(0);
+    if (db.step() != SQLITE_ROW) {
+        throw runtime_error("No such item");
+    }
+    if (sqlite3_column_type(db.m_statement, 0) == SQLITE_NULL) {
+        return;
+    }
+    if (sqlite3_blob_open(m_db, "main", "ContentBody", "Body",
+                          sqlite3_column_int(db.m_statement, 0), 0,
+                          &m_blob) != SQLITE_OK) {
+        throw runtime_error(sqlite3_errmsg(m_db));
+    }
+    m_size = sqlite3_blob_bytes(m_blob);
+}
+
+Content_Reader::~Content_Reader() {
+    sqlite3_blob_close(m_blob);
+}
+
+size_t Content_Reader::read(char* buffer, size_t size)
+    throw(runtime_error) {
+
+    int count = static_cast<int>(min<int64_t>(size, m_size - m_offset));
+    if (count == 0) {
+        return 0;
+    }
+    if (sqlite3_blob_read(m_blob, buffer, count, m_offset) != SQLITE_OK) {
+        throw runtime_error(sqlite3_errmsg(m_db));
+    }
+    m_offset += count;
+    return count;
+}
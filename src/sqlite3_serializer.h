@@ -2,10 +2,101 @@
 #define SQLITE3_SERIALIZER_H
 
 #include "recap.h"
+#include "tag_dictionary.h"
+#include "tag_index.h"
+#include "byte_stream.h"
+#include "maintenance.h"
 #include <sstream>
 #include <cstdarg>
 struct sqlite3;
 struct sqlite3_stmt;
+struct sqlite3_blob;
+struct Query_Node;
+
+//------------------------------------------------------------------------------
+// Storage tuning applied when a SQLite3_Serializer opens its database. The
+// default constructed options keep SQLite's stock settings; the presets suit
+// the typical deployments.
+//------------------------------------------------------------------------------
+struct SQLite3_Options {
+
+    enum Synchronous  { SYNC_DEFAULT, SYNC_OFF, SYNC_NORMAL, SYNC_FULL,
+                        SYNC_EXTRA };
+    enum Journal_Mode { JOURNAL_DEFAULT, JOURNAL_DELETE, JOURNAL_TRUNCATE,
+                        JOURNAL_PERSIST, JOURNAL_MEMORY, JOURNAL_WAL,
+                        JOURNAL_OFF };
+    enum Temp_Store   { TEMP_DEFAULT, TEMP_FILE, TEMP_MEMORY };
+
+    int          page_size;     // Bytes, for new databases (0: default)
+    int          cache_size;    // As PRAGMA cache_size: pages if positive,
+                                // KiB if negative (0: default)
+    int64_t      mmap_size;     // Bytes of the file to memory map (0: none)
+    Synchronous  synchronous;
+    Journal_Mode journal_mode;
+    Temp_Store   temp_store;
+    bool         read_only;     // Open read-only; the schema must be current
+    bool         immutable;     // Read-only and the file never changes, so
+                                // no locking or change detection is done
+    bool         tag_index;     // Keep an in-memory bitmap index of ItemTag
+    int          busy_timeout;  // Milliseconds to wait for a lock held by
+                                // another connection (0: fail at once)
+    int          busy_backoff;  // Longest single wait in milliseconds; waits
+                                // double from 1 ms up to it, with jitter
+    int          busy_retries;  // Times a statement or operation still
+                                // failing with SQLITE_BUSY after the wait is
+                                // retried
+    Maintenance_Options maintenance;    // Background upkeep of the file
+
+    SQLite3_Options();
+
+    //--------------------------------------------------------------------------
+    // Presets
+    //   durable:     WAL journal, every commit synced to disk, and waits of up
+    //                to 5 s for other writers.
+    //   bulk_load:   No syncing and an in-memory journal with a large cache;
+    //                a crash during the load can corrupt the database.
+    //   read_mostly: Read-only, memory mapped, large cache and tag index. The
+    //                index is rebuilt on the first read after a writer has
+    //                committed, so it pays off where writes are rare.
+    //--------------------------------------------------------------------------
+    static SQLite3_Options durable();
+    static SQLite3_Options bulk_load();
+    static SQLite3_Options read_mostly();
+};
+
+//------------------------------------------------------------------------------
+// Counters of lock contention with other connections to the same database.
+//------------------------------------------------------------------------------
+struct SQLite3_Contention {
+    uint64_t busy_waits;    // Backoff waits for a lock
+    uint64_t wait_usec;     // Total time spent in them
+    uint64_t retries;       // Statements or operations retried after
+                            // SQLITE_BUSY
+    uint64_t failures;      // Statements failed with SQLITE_BUSY
+
+    SQLite3_Contention() : busy_waits(0), wait_usec(0), retries(0),
+                           failures(0) {}
+};
+
+//------------------------------------------------------------------------------
+// Memory held on behalf of a connection, in bytes. The heap figures are those
+// of SQLite in the whole process, shared by all connections.
+//------------------------------------------------------------------------------
+struct SQLite3_Memory {
+    int64_t page_cache;     // Page cache of the connection
+    int64_t schema;         // Parsed schema of the connection
+    int64_t statements;     // Prepared statements of the connection
+    int64_t tags;           // In-memory tag dictionary (estimated)
+    int64_t index;          // In-memory tag index (estimated; 0 without)
+    int64_t heap_used;      // SQLite heap of the process
+    int64_t heap_highwater; // Highest heap_used so far
+    int64_t soft_limit;     // Heap limits of the process (0: none)
+    int64_t hard_limit;
+
+    SQLite3_Memory() : page_cache(0), schema(0), statements(0), tags(0),
+                       index(0), heap_used(0), heap_highwater(0),
+                       soft_limit(0), hard_limit(0) {}
+};
 
 //------------------------------------------------------------------------------
 // SQLite3 implementation of the serialization interface.
@@ -16,36 +107,231 @@ class SQLite3_Serializer : public Serializer {
 
         //----------------------------------------------------------------------
         // @param db_spec The filespec of the database
-        // @post  A connection to the database is established and the table
-        //        schemas are created (if necessary).
+        // @param options Storage tuning. With options.tag_index, tag filters
+        //                in read() and tag only queries are resolved from an
+        //                in-memory bitmap index and only the matching rows
+        //                are fetched from the DB. The index follows the
+        //                committed writes of this connection and is rebuilt
+        //                whenever another connection has committed, so it
+        //                suits files written mostly through one connection.
+        // @post  A connection to the database is established, the options
+        //        are applied and the table schemas are created (if necessary
+        //        and not opened read-only).
+        // @throw If the database cannot be opened, or is opened read-only
+        //        while its schema is out of date.
         //----------------------------------------------------------------------
-        SQLite3_Serializer(const char* db_spec)
+        SQLite3_Serializer(const char* db_spec,
+                           const SQLite3_Options& options = SQLite3_Options())
             throw(std::runtime_error);
 
         ~SQLite3_Serializer();
 
+        //----------------------------------------------------------------------
+        // Batches. Between begin_batch() and commit_batch() all reads and
+        // writes run in a single transaction instead of one each, so that a
+        // batch is committed (and synced) once. An operation failing within
+        // the batch is undone alone and the batch stays open, unless SQLite
+        // has rolled back the whole transaction (on some I/O and memory
+        // errors); the batch is then closed.
+        //
+        // @post  begin_batch:    A transaction is open.
+        //        commit_batch:   The changes of the batch are committed and
+        //                        applied to the in-memory tag state. If the
+        //                        commit fails, they are rolled back instead.
+        //        rollback_batch: The changes of the batch are discarded.
+        // @throw If a batch is already open (begin_batch), or the transaction
+        //        cannot be started, committed or rolled back.
+        //----------------------------------------------------------------------
+        virtual void begin_batch()
+            throw(std::runtime_error);
+        virtual void commit_batch()
+            throw(std::runtime_error);
+        virtual void rollback_batch()
+            throw(std::runtime_error);
+
+        //----------------------------------------------------------------------
+        // Writes take the database write lock when their transaction begins
+        // (BEGIN IMMEDIATE), so two writers never deadlock half way. With
+        // options.busy_timeout, a locked database is waited for with jittered
+        // exponential backoff, and reads, BEGIN and COMMIT statements still
+        // failing afterwards are retried up to options.busy_retries times.
+        // An operation failing for any reason is rolled back whole (to its
+        // savepoint within a batch), and outside a batch one failing for a
+        // lock is then run again, up to options.busy_retries times.
+        //
+        // @return The lock contention met by this connection so far.
+        //----------------------------------------------------------------------
+        const SQLite3_Contention& contention() const { return m_contention; }
+
+        //----------------------------------------------------------------------
+        // With options.maintenance.interval set on a writable database file,
+        // checkpoints, ANALYZE and incremental vacuum run in the background
+        // while the connection is idle (see Maintenance_Scheduler). Every
+        // statement of this connection ends a running slice first.
+        //
+        // @return The maintenance work done so far (none without a thread).
+        //----------------------------------------------------------------------
+        Maintenance_Stats maintenance() const;
+
+        //----------------------------------------------------------------------
+        // @return The memory held by this connection and its in-memory tag
+        //         state, and the heap usage and limits of SQLite.
+        //----------------------------------------------------------------------
+        SQLite3_Memory memory() const;
+
+        //----------------------------------------------------------------------
+        // For hosts under memory pressure: finalizes the cached statement and
+        // frees the page cache of the connection as far as possible (pages
+        // of an open batch stay). Later reads fill the cache again.
+        // @return The bytes returned to the heap (process wide, so other
+        //         threads allocating meanwhile skew it).
+        //----------------------------------------------------------------------
+        int64_t release_memory();
+
+        //----------------------------------------------------------------------
+        // @param soft Heap size above which SQLite frees cache pages before
+        //             allocating more (0: no limit).
+        // @param hard Heap size above which SQLite allocations fail, so that
+        //             operations throw instead of growing the process
+        //             (0: no limit).
+        // @post  The limits apply to all connections of the process.
+        //----------------------------------------------------------------------
+        static void set_heap_limits(int64_t soft, int64_t hard);
+
         //----------------------------------------------------------------------
         // @param i The Item to be written.
         // @pre   The Item has no blank or empty fields.
         // @post  The Item is serialized and a new Item is created or an
         //        existing Item is updated. If a new item is created,
         //        the Item parameter has its id field updated.
-        // @throw If cannot write through the DB connection.
+        // @throw If cannot write through the DB connection, or the id of the
+        //        Item is not stored; nothing is written then.
         //----------------------------------------------------------------------
         virtual void write(Item& i) 
             throw(std::runtime_error);
 
+        //----------------------------------------------------------------------
+        // @param i       The Item to be written; its content field is ignored.
+        // @param content The content of the Item.
+        // @param size    The number of bytes in content.
+        // @post  As write(Item&), but the content is streamed into the DB a
+        //        chunk at a time through the incremental BLOB API (and hashed
+        //        on the way), so its size does not bound the memory used.
+        // @throw If cannot write through the DB connection, or content does
+        //        not hold exactly size bytes.
+        //----------------------------------------------------------------------
+        void write(Item& i, Byte_Source& content, int64_t size)
+            throw(std::runtime_error);
+
+        //----------------------------------------------------------------------
+        // @param id      The ItemID.
+        // @param content Out sink for the content of the Item.
+        // @post  The content of the Item is written to the sink a chunk at a
+        //        time, straight from the DB (see Content_Reader).
+        // @throw If there is no such Item or cannot read via the DB connection.
+        //----------------------------------------------------------------------
+        void read_content(int id, Byte_Sink& content)
+            throw(std::runtime_error);
+
         //----------------------------------------------------------------------
         // @param tags    An in vector of tag strings.
         // @param items   An out vector to store the Items.
         // @post  All Items associated with the tags are returned in the out 
-        //        parameter.
+        //        parameter, newest first.
         // @throw If cannot read via the DB connection
         //----------------------------------------------------------------------
         virtual void read(const std::vector<std::string>& tags, 
                           std::vector<Item*>& items) 
 
             throw(std::runtime_error);
+
+        //----------------------------------------------------------------------
+        // @param tags An in vector of tag strings.
+        // @param mode Whether Items must be associated with any or all of
+        //             the tags.
+        // @return The number of Items matching the tags. A single tag is
+        //         answered from its maintained Tag.ItemCount, several from
+        //         the tag index (if enabled) or by one aggregate over the
+        //         ItemTagTag index; the Item table is never read.
+        // @throw If cannot read via the DB connection
+        //----------------------------------------------------------------------
+        virtual long count(const std::vector<std::string>& tags, Tag_Match mode)
+            throw(std::runtime_error);
+
+        //----------------------------------------------------------------------
+        // @param tags An in vector of tag strings.
+        // @return Whether any Item is associated with any of the tags. The
+        //         ItemTagTag index is probed up to the first relation.
+        // @throw If cannot read via the DB connection
+        //----------------------------------------------------------------------
+        virtual bool exists(const std::vector<std::string>& tags)
+            throw(std::runtime_error);
+
+        //----------------------------------------------------------------------
+        // @param q     A parsed boolean tag query (see query.h).
+        // @param items An out vector to store the Items.
+        // @post  All Items matching the query are returned in the out 
+        //        parameter, newest first. The query is compiled into the
+        //        WHERE clause of a single SELECT.
+        // @throw If cannot read via the DB connection
+        //----------------------------------------------------------------------
+        virtual void query(const Query& q, std::vector<Item*>& items)
+            throw(std::runtime_error);
+
+        //----------------------------------------------------------------------
+        // @param ids   An in vector of ItemIDs.
+        // @param items An out vector to store the Items.
+        // @post  The stored Items with the ids are returned in the out
+        //        parameter, in the order of the ids. Unknown and repeated ids
+        //        are skipped. Each batch of ids is fetched together with the
+        //        tags by a single joined SELECT.
+        // @throw If cannot read via the DB connection
+        //----------------------------------------------------------------------
+        virtual void read_by_id(const std::vector<int>& ids,
+                                std::vector<Item*>& items)
+            throw(std::runtime_error);
+
+        //----------------------------------------------------------------------
+        // @param title The exact (case sensitive) Item title.
+        // @param items An out vector to store the Items.
+        // @post  All Items with the title are returned in the out parameter,
+        //        newest first, fetched with their tags by a single joined
+        //        SELECT served by the ItemTitle index.
+        // @throw If cannot read via the DB connection
+        //----------------------------------------------------------------------
+        virtual void find_by_title(const std::string& title,
+                                   std::vector<Item*>& items)
+            throw(std::runtime_error);
+
+        //----------------------------------------------------------------------
+        // @param from  Inclusive lower bound in microseconds since the epoch.
+        // @param to    Exclusive upper bound in microseconds since the epoch.
+        // @param items An out vector to store the Items.
+        // @post  All Items last modified within [from, to) are returned in
+        //        the out parameter, oldest first (by id on equal timestamps).
+        //        Served by the Timestamp index.
+        // @throw If cannot read via the DB connection
+        //----------------------------------------------------------------------
+        virtual void read_range(int64_t from, int64_t to,
+                                std::vector<Item*>& items)
+            throw(std::runtime_error);
+
+        //----------------------------------------------------------------------
+        // @param tags  An in vector of tag strings.
+        // @param limit The maximum number of Items to return.
+        // @param items An out vector to store the Items.
+        // @post  The limit most recently modified Items associated with any
+        //        of the tags are returned in the out parameter, newest first.
+        //        The Timestamp index is walked backwards until limit tagged
+        //        Items are found, so the cost grows with the untagged Items
+        //        newer than them: cheap for common tags, a full scan for tags
+        //        with fewer than limit Items.
+        // @throw If cannot read via the DB connection
+        //----------------------------------------------------------------------
+        virtual void read_recent(const std::vector<std::string>& tags,
+                                 size_t limit,
+                                 std::vector<Item*>& items)
+            throw(std::runtime_error);
         
         //---------------------------------------------------------------------
         // @param i The item to be deleted
@@ -63,24 +349,159 @@ class SQLite3_Serializer : public Serializer {
         virtual void tags(std::vector<std::string>& tags) 
             throw(std::runtime_error);
 
+        //---------------------------------------------------------------------
+        // @param prefix The (case insensitive) start of the tag titles.
+        // @param limit  The maximum number of tags to return.
+        // @param tags   Out vector of tag strings
+        // @post  Up to limit tags starting with prefix are loaded into the 
+        //        out vector, most used first. Served from an in-memory index
+        //        loaded when the connection is opened and kept up to date by
+        //        the committed writes of this connection; it is reloaded when
+        //        another connection commits tag changes.
+        //        Within a batch with uncommitted tag changes the Tag table is
+        //        queried instead.
+        //---------------------------------------------------------------------
+        virtual void complete_tags(const std::string& prefix, size_t limit,
+                                   std::vector<std::string>& tags)
+            throw(std::runtime_error);
+
+        //---------------------------------------------------------------------
+        // @param tag The tag title.
+        // @return The number of Items associated with the tag, read from the
+        //         counter maintained in Tag.ItemCount (a single lookup in the
+        //         Title index).
+        //---------------------------------------------------------------------
+        virtual long tag_count(const std::string& tag)
+            throw(std::runtime_error);
+
+        //---------------------------------------------------------------------
+        // @param tags   An in vector of tag strings to filter by (any match).
+        // @param counts Out vector of tags and Item counts.
+        // @post  For every tag associated with an Item matching the filter,
+        //        the number of matching Items associated with it is loaded
+        //        into the out vector, highest count first. An empty filter
+        //        is answered from the maintained Tag.ItemCount counters;
+        //        otherwise a single aggregate query over ItemTag is run.
+        //        Either way tags without matching Items are left out.
+        // @throw If errors occur querying the DB.
+        //---------------------------------------------------------------------
+        virtual void facets(const std::vector<std::string>& tags,
+                            std::vector<Tag_Count>& counts)
+            throw(std::runtime_error);
+
     private:
+        friend class Content_Reader;
+
         // Helper functions
         int  step()                                 throw(std::runtime_error);
         void exec(const char*)                      throw(std::runtime_error);
-        void begin_transaction()                    throw(std::runtime_error);
+        void begin_transaction(bool = false)        throw(std::runtime_error);
         void end_transaction()                      throw(std::runtime_error);
+        bool abort_transaction(int = -1);
         void prepare(int, ...)                      throw(std::runtime_error);
-        void insert(Item&)                          throw(std::runtime_error);
-        void update(const Item&)                    throw(std::runtime_error);
-        void write_tags(const Item&)                throw(std::runtime_error);
-        void delete_itemtags(const Item&)           throw(std::runtime_error);
-        void insert_itemtag(const int&, const int&) throw(std::runtime_error);
+        void insert(Item&, int)                     throw(std::runtime_error);
+        void update(Item&, int)                     throw(std::runtime_error);
+        void move_to_trash(const Item&)             throw(std::runtime_error);
+        void write_tags(const Item&, bool)          throw(std::runtime_error);
+        void find_tags(const std::vector<std::string>&, std::vector<int>&)
+                                                    throw(std::runtime_error);
+        void relate_tags(int, const std::vector<int>&, int)
+                                                    throw(std::runtime_error);
+        int  acquire_content(const std::string&)    throw(std::runtime_error);
+        int  stream_content(Byte_Source&, int64_t)  throw(std::runtime_error);
+        int  share_content(const std::string&)      throw(std::runtime_error);
+        void release_content(int)                   throw(std::runtime_error);
+        void delete_content(int)                    throw(std::runtime_error);
+        int  item_content(int)                      throw(std::runtime_error);
+        void migrate(bool)                          throw(std::runtime_error);
+        void load_tags()                            throw(std::runtime_error);
+        void revalidate()                           throw(std::runtime_error);
+        int64_t tag_version()                       throw(std::runtime_error);
+        void commit()                               throw(std::runtime_error);
+        void apply_changes();
+        void load_index()                           throw(std::runtime_error);
+        void open(const char*)                      throw(std::runtime_error);
+        void apply_options()                        throw(std::runtime_error);
+        void bind_tags(const std::vector<std::string>&, int);
+        void compile(const Query_Node&, std::vector<std::string>&);
+        void fetch_items(std::vector<Item*>&)       throw(std::runtime_error);
+        void fetch_tagged_items(std::vector<Item*>&)
+                                                    throw(std::runtime_error);
+        void fetch_tags(std::vector<Item*>&, size_t)
+                                                    throw(std::runtime_error);
+        void fetch_by_ids(const Roaring_Bitmap&, std::vector<Item*>&)
+                                                    throw(std::runtime_error);
+        void back_off(int);
+        static int busy_handler(void*, int);
+
+        // A change of the in-memory tag state made by the open transaction,
+        // applied once it has committed
+        struct Tag_Change {
+            int         item_id;    // The item (un)related to the tag, or
+                                    // added or removed (0: none)
+            int         tag_id;     // 0: the item itself changes
+            long        delta;      // +1 or -1, or the uses of a new tag
+            std::string title;      // Set for a tag new to the dictionary
+        };
 
         sqlite3*      m_db;
         sqlite3_stmt* m_statement;
         char*         m_error_msg;
 
         std::stringstream  m_query;
+        SQLite3_Options    m_options;
+        Tag_Dictionary     m_tags;
+        Tag_Index*         m_index;
+        std::vector<Tag_Change> m_pending;  // Changes awaiting COMMIT
+        int64_t            m_data_version;  // PRAGMA data_version last seen
+        int64_t            m_tag_version;   // TagVersion the tag state matches
+        bool               m_stale;         // The tag state must be reloaded
+        size_t             m_mark;          // m_pending at the savepoint of
+                                            // the operation within a batch
+        bool               m_batch;         // A batch transaction is open
+        bool               m_busy;          // The operation failed for a lock
+        SQLite3_Contention m_contention;
+        int64_t            m_busy_waited;   // Microseconds, current wait
+        unsigned int       m_seed;          // Backoff jitter
+        Maintenance_Scheduler* m_maintenance;
+};
+
+//------------------------------------------------------------------------------
+// Reads the content of a stored Item a chunk at a time through an incremental
+// BLOB handle, so that a large body is never copied whole into memory. The
+// reader holds a read lock on the DB while open. If the Item is written or
+// trashed through the same connection meanwhile, further reads throw.
+//------------------------------------------------------------------------------
+class Content_Reader : public Byte_Source {
+
+    public:
+        //----------------------------------------------------------------------
+        // @param db The connection the Item is read through; must outlive the
+        //           reader.
+        // @param id The ItemID.
+        // @throw If there is no such Item or cannot read via the DB connection.
+        //----------------------------------------------------------------------
+        Content_Reader(SQLite3_Serializer& db, int id)
+            throw(std::runtime_error);
+
+        ~Content_Reader();
+
+        virtual size_t read(char* buffer, size_t size)
+            throw(std::runtime_error);
+
+        //----------------------------------------------------------------------
+        // @return The size of the content in bytes.
+        //----------------------------------------------------------------------
+        int64_t size() const { return m_size; }
+
+    private:
+        Content_Reader(const Content_Reader&);
+        Content_Reader& operator=(const Content_Reader&);
+
+        sqlite3*      m_db;
+        sqlite3_blob* m_blob;
+        int64_t       m_size;
+        int64_t       m_offset;
 };
 
 #endif 
@@ -0,0 +1,114 @@
+#include "tag_dictionary.h"
+#include "memory_usage.h"
+#include <algorithm>
+using namespace std;
+
+//------------------------------------------------------------------------------
+// Orders completion candidates by descending usage, then by title.
+//------------------------------------------------------------------------------
+struct Tag_Dictionary_Rank {
+    template <typename It>
+    bool operator()(const It& lhs, const It& rhs) const {
+        if (lhs->second.uses != rhs->second.uses) {
+            return lhs->second.uses > rhs->second.uses;
+        }
+        return lhs->first < rhs->first;
+    }
+};
+
+//------------------------------------------------------------------------------
+string Tag_Dictionary::fold(const string& title) {
+    string rv(title);
+    for (size_t i = 0; i < rv.size(); ++i) {
+        if (rv[i] >= 'A' && rv[i] <= 'Z') {
+            rv[i] += 'a' - 'A';
+        }
+    }
+    return rv;
+}
+
+//------------------------------------------------------------------------------
+void Tag_Dictionary::insert(int id, const string& title, long uses) {
+    map<int, Key_Map::iterator>::iterator old = m_ids.find(id);
+    if (old != m_ids.end()) {
+        m_keys.erase(old->second);
+        m_ids.erase(old);
+    }
+    Entry entry = { id, title, uses };
+    m_ids[id] = m_keys.insert(make_pair(fold(title), entry)).first;
+}
+
+//------------------------------------------------------------------------------
+int Tag_Dictionary::find(const string& title) const {
+    Key_Map::const_iterator it = m_keys.find(fold(title));
+    return it == m_keys.end() ? 0 : it->second.id;
+}
+
+//------------------------------------------------------------------------------
+string Tag_Dictionary::title(int id) const {
+    map<int, Key_Map::iterator>::const_iterator it = m_ids.find(id);
+    return it == m_ids.end() ? string() : it->second->second.title;
+}
+
+//------------------------------------------------------------------------------
+void Tag_Dictionary::add_uses(int id, long delta) {
+    map<int, Key_Map::iterator>::iterator it = m_ids.find(id);
+    if (it != m_ids.end()) {
+        long& uses = it->second->second.uses;
+        uses = max(0L, uses + delta);
+    }
+}
+
+//------------------------------------------------------------------------------
+long Tag_Dictionary::uses(int id) const {
+    map<int, Key_Map::iterator>::const_iterator it = m_ids.find(id);
+    return it == m_ids.end() ? 0 : it->second->second.uses;
+}
+
+//------------------------------------------------------------------------------
+// The folded keys are sorted, so the matches of a prefix form one contiguous
+// range. Only iterators into that range are ranked; titles are copied for the
+// returned entries alone.
+//------------------------------------------------------------------------------
+void Tag_Dictionary::complete(const string& prefix, size_t limit,
+                              vector<string>& out) const {
+    if (limit == 0) {
+        return;
+    }
+    string key = fold(prefix);
+
+    vector<Key_Map::const_iterator> matches;
+    for (Key_Map::const_iterator it = m_keys.lower_bound(key);
+         it != m_keys.end() && it->first.compare(0, key.size(), key) == 0;
+         ++it) {
+
+        matches.push_back(it);
+    }
+    size_t count = min(limit, matches.size());
+    partial_sort(matches.begin(), matches.begin() + count, matches.end(),
+                 Tag_Dictionary_Rank());
+
+    for (size_t i = 0; i < count; ++i) {
+        out.push_back(matches[i]->second.title);
+    }
+}
+
+//------------------------------------------------------------------------------
+// Both maps count a node per tag; titles are counted by their capacity.
+//------------------------------------------------------------------------------
+size_t Tag_Dictionary::memory_used() const {
+    size_t bytes = m_ids.size() * (MAP_NODE_OVERHEAD + 
+                                   sizeof(map<int, Key_Map::iterator>::
+                                          value_type));
+    for (Key_Map::const_iterator it = m_keys.begin(); it != m_keys.end(); ++it) {
+        bytes += MAP_NODE_OVERHEAD + sizeof(*it) + it->first.capacity() +
+                 it->second.title.capacity();
+    }
+    return bytes;
+}
+
+//------------------------------------------------------------------------------
+void Tag_Dictionary::clear() {
+    m_ids.clear();
+    m_keys.clear();
+}
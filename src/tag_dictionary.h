@@ -0,0 +1,87 @@
+#ifndef TAG_DICTIONARY_H
+#define TAG_DICTIONARY_H
+
+#include <map>
+#include <string>
+#include <vector>
+
+//------------------------------------------------------------------------------
+// In-memory dictionary of tags keyed both by TagID and by case folded title.
+// Each tag carries a usage count (the number of Items associated with it),
+// which is used to rank prefix completions.
+//------------------------------------------------------------------------------
+class Tag_Dictionary {
+
+    public:
+
+        //----------------------------------------------------------------------
+        // @param id    The TagID.
+        // @param title The tag title.
+        // @param uses  The number of Items associated with the tag.
+        // @post  The tag can be found by id or by title. An existing entry
+        //        with the same id is replaced.
+        //----------------------------------------------------------------------
+        void insert(int id, const std::string& title, long uses = 0);
+
+        //----------------------------------------------------------------------
+        // @param title The tag title (case insensitive).
+        // @return The TagID, or 0 if the tag is unknown.
+        //----------------------------------------------------------------------
+        int find(const std::string& title) const;
+
+        //----------------------------------------------------------------------
+        // @param id The TagID.
+        // @return The tag title, or an empty string if the tag is unknown.
+        //----------------------------------------------------------------------
+        std::string title(int id) const;
+
+        //----------------------------------------------------------------------
+        // @param id    The TagID.
+        // @param delta The change in the number of associated Items.
+        // @post  The usage count of a known tag is adjusted (never below 0).
+        //----------------------------------------------------------------------
+        void add_uses(int id, long delta);
+
+        //----------------------------------------------------------------------
+        // @param id The TagID.
+        // @return The number of Items associated with the tag.
+        //----------------------------------------------------------------------
+        long uses(int id) const;
+
+        //----------------------------------------------------------------------
+        // @param prefix The (case insensitive) start of the tag titles.
+        // @param limit  The maximum number of titles to return.
+        // @param out    Out vector of tag titles.
+        // @post  Up to limit titles starting with prefix are appended to the
+        //        out vector, most used first and alphabetically among equals.
+        //----------------------------------------------------------------------
+        void complete(const std::string& prefix, size_t limit,
+                      std::vector<std::string>& out) const;
+
+        size_t size() const { return m_ids.size(); }
+        void   clear();
+
+        //----------------------------------------------------------------------
+        // @return The estimated heap bytes held by the dictionary.
+        //----------------------------------------------------------------------
+        size_t memory_used() const;
+
+        //----------------------------------------------------------------------
+        // @return The title folded the way SQLite's NOCASE collation does
+        //         (ASCII characters only).
+        //----------------------------------------------------------------------
+        static std::string fold(const std::string& title);
+
+    private:
+        struct Entry {
+            int         id;
+            std::string title;
+            long        uses;
+        };
+        typedef std::map<std::string, Entry> Key_Map;
+
+        Key_Map                          m_keys;
+        std::map<int, Key_Map::iterator> m_ids;
+};
+
+#endif
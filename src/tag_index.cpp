@@ -0,0 +1,171 @@
+#include "tag_index.h"
+#include "tag_dictionary.h"
+#include "memory_usage.h"
+#include "query.h"
+#include <algorithm>
+using namespace std;
+
+//------------------------------------------------------------------------------
+// Orders postings by ascending cardinality, so that intersections start from
+// the smallest set.
+//------------------------------------------------------------------------------
+struct Postings_Smaller {
+    bool operator()(const Roaring_Bitmap* lhs, const Roaring_Bitmap* rhs) const {
+        return lhs->cardinality() < rhs->cardinality();
+    }
+};
+
+//------------------------------------------------------------------------------
+// Maintenance
+//------------------------------------------------------------------------------
+void Tag_Index::add_item(int item_id) {
+    m_items.add(item_id);
+}
+
+//------------------------------------------------------------------------------
+void Tag_Index::remove_item(int item_id, const vector<int>& tag_ids) {
+    for (size_t i = 0; i < tag_ids.size(); ++i) {
+        remove(item_id, tag_ids[i]);
+    }
+    m_items.remove(item_id);
+}
+
+//------------------------------------------------------------------------------
+void Tag_Index::add(int item_id, int tag_id) {
+    m_postings[tag_id].add(item_id);
+}
+
+//------------------------------------------------------------------------------
+void Tag_Index::remove(int item_id, int tag_id) {
+    map<int, Roaring_Bitmap>::iterator it = m_postings.find(tag_id);
+    if (it != m_postings.end()) {
+        it->second.remove(item_id);
+        if (it->second.empty()) {
+            m_postings.erase(it);
+        }
+    }
+}
+
+//------------------------------------------------------------------------------
+void Tag_Index::clear() {
+    m_postings.clear();
+    m_items.clear();
+}
+
+//------------------------------------------------------------------------------
+size_t Tag_Index::memory_used() const {
+    size_t bytes = m_items.memory_used() + m_empty.memory_used();
+    map<int, Roaring_Bitmap>::const_iterator it = m_postings.begin();
+    for (; it != m_postings.end(); ++it) {
+        bytes += MAP_NODE_OVERHEAD + sizeof(*it) + it->second.memory_used();
+    }
+    return bytes;
+}
+
+//------------------------------------------------------------------------------
+const Roaring_Bitmap& Tag_Index::postings(int tag_id) const {
+    map<int, Roaring_Bitmap>::const_iterator it = m_postings.find(tag_id);
+    return it == m_postings.end() ? m_empty : it->second;
+}
+
+//------------------------------------------------------------------------------
+// Lookups
+//------------------------------------------------------------------------------
+void Tag_Index::any(const vector<string>& tags, const Tag_Dictionary& dict,
+                    Roaring_Bitmap& out) const {
+    out.clear();
+    for (size_t i = 0; i < tags.size(); ++i) {
+        out |= postings(dict.find(tags[i]));
+    }
+}
+
+//------------------------------------------------------------------------------
+void Tag_Index::all(const vector<string>& tags, const Tag_Dictionary& dict,
+                    Roaring_Bitmap& out) const {
+    out.clear();
+    if (tags.empty()) {
+        return;
+    }
+    vector<const Roaring_Bitmap*> lists;
+    for (size_t i = 0; i < tags.size(); ++i) {
+        lists.push_back(&postings(dict.find(tags[i])));
+    }
+    sort(lists.begin(), lists.end(), Postings_Smaller());
+
+    out = *lists[0];
+    for (size_t i = 1; i < lists.size() && !out.empty(); ++i) {
+        out &= *lists[i];
+    }
+}
+
+//------------------------------------------------------------------------------
+// Negations under an AND are applied as differences from the other operands;
+// only a NOT standing on its own is taken as a complement of all items.
+//------------------------------------------------------------------------------
+void Tag_Index::evaluate(const Query_Node& node, const Tag_Dictionary& dict,
+                         Roaring_Bitmap& out,
+                         const Leaf_Evaluator* leaves) const
+    throw(runtime_error) {
+
+    switch (node.type) {
+        case Query_Node::ANY_TAG:
+            any(node.values, dict, out);
+            return;
+
+        case Query_Node::ALL_TAGS:
+            all(node.values, dict, out);
+            return;
+
+        case Query_Node::NOT: {
+            Roaring_Bitmap negated;
+            evaluate(*node.children[0], dict, negated, leaves);
+            out = m_items;
+            out -= negated;
+            return;
+        }
+        case Query_Node::OR: {
+            out.clear();
+            for (size_t i = 0; i < node.children.size(); ++i) {
+                Roaring_Bitmap operand;
+                evaluate(*node.children[i], dict, operand, leaves);
+                out |= operand;
+            }
+            return;
+        }
+        case Query_Node::AND: {
+            vector<const Query_Node*> positive, negative;
+            for (size_t i = 0; i < node.children.size(); ++i) {
+                const Query_Node* child = node.children[i];
+                if (child->type == Query_Node::NOT) {
+                    negative.push_back(child->children[0]);
+                }
+                else {
+                    positive.push_back(child);
+                }
+            }
+            if (positive.empty()) {
+                out = m_items;
+            }
+            else {
+                evaluate(*positive[0], dict, out, leaves);
+            }
+            for (size_t i = 1; i < positive.size() && !out.empty(); ++i) {
+                Roaring_Bitmap operand;
+                evaluate(*positive[i], dict, operand, leaves);
+                out &= operand;
+            }
+            for (size_t i = 0; i < negative.size() && !out.empty(); ++i) {
+                Roaring_Bitmap operand;
+                evaluate(*negative[i], dict, operand, leaves);
+                out -= operand;
+            }
+            return;
+        }
+        default:
+            if (!leaves) {
+                throw runtime_error("Query cannot be answered by the tag index");
+            }
+            leaves->evaluate_leaf(node, out);
+            return;
+    }
+}
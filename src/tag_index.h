@@ -0,0 +1,92 @@
+#ifndef TAG_INDEX_H
+#define TAG_INDEX_H
+
+#include "roaring_bitmap.h"
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+class Tag_Dictionary;
+struct Query_Node;
+
+//------------------------------------------------------------------------------
+// In-memory inverted index from TagID to the compressed set of associated
+// ItemIDs (one posting bitmap per tag), plus the set of all live ItemIDs.
+// Tag filters are answered with bitmap unions, intersections and differences
+// without touching the database.
+//------------------------------------------------------------------------------
+class Tag_Index {
+
+    public:
+
+        //----------------------------------------------------------------------
+        // Answers the query predicates that do not test tags (title and time)
+        // on behalf of evaluate().
+        //----------------------------------------------------------------------
+        class Leaf_Evaluator {
+            public:
+                virtual ~Leaf_Evaluator() {}
+                virtual void evaluate_leaf(const Query_Node& node,
+                                           Roaring_Bitmap& out) const
+                    throw(std::runtime_error) = 0;
+        };
+
+        //----------------------------------------------------------------------
+        // Maintenance. remove_item() needs the tags the item was associated
+        // with so that only their postings are visited.
+        //----------------------------------------------------------------------
+        void add_item(int item_id);
+        void remove_item(int item_id, const std::vector<int>& tag_ids);
+        void add(int item_id, int tag_id);
+        void remove(int item_id, int tag_id);
+        void clear();
+
+        //----------------------------------------------------------------------
+        // @return The estimated heap bytes held by the index.
+        //----------------------------------------------------------------------
+        size_t memory_used() const;
+
+        //----------------------------------------------------------------------
+        // @return The ItemIDs associated with the tag (empty if unknown).
+        //----------------------------------------------------------------------
+        const Roaring_Bitmap& postings(int tag_id) const;
+
+        //----------------------------------------------------------------------
+        // @return All live ItemIDs.
+        //----------------------------------------------------------------------
+        const Roaring_Bitmap& items() const { return m_items; }
+
+        //----------------------------------------------------------------------
+        // @param tags  Tag titles, resolved through dict.
+        // @param dict  The tag dictionary of the indexed store.
+        // @param out   Out bitmap.
+        // @post  out holds the ItemIDs associated with any (any()) or all
+        //        (all()) of the tags.
+        //----------------------------------------------------------------------
+        void any(const std::vector<std::string>& tags,
+                 const Tag_Dictionary& dict, Roaring_Bitmap& out) const;
+        void all(const std::vector<std::string>& tags,
+                 const Tag_Dictionary& dict, Roaring_Bitmap& out) const;
+
+        //----------------------------------------------------------------------
+        // @param node   A query tree.
+        // @param dict   The tag dictionary of the indexed store.
+        // @param out    Out bitmap.
+        // @param leaves Evaluator for the predicates that do not test tags.
+        // @post  out holds the ItemIDs matching the query.
+        // @throw If the query tests anything other than tags and no leaf
+        //        evaluator is given.
+        //----------------------------------------------------------------------
+        void evaluate(const Query_Node& node, const Tag_Dictionary& dict,
+                      Roaring_Bitmap& out,
+                      const Leaf_Evaluator* leaves = 0) const
+            throw(std::runtime_error);
+
+    private:
+        std::map<int, Roaring_Bitmap> m_postings;
+        Roaring_Bitmap                m_items;
+        Roaring_Bitmap                m_empty;
+};
+
+#endif
@@ -0,0 +1,124 @@
+//-----------------------------------------------------------------------------
+#include "test_keyring.h"
+//-----------------------------------------------------------------------------
+#include <gpgme.h>
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <ftw.h>
+//-----------------------------------------------------------------------------
+using namespace std;
+
+//-----------------------------------------------------------------------------
+// The user id of the generated key.
+//-----------------------------------------------------------------------------
+const char* TEST_KEY_UID = "Recap Test <test@recap.invalid>";
+
+//-----------------------------------------------------------------------------
+// Removes one entry of the home directory, children first.
+//-----------------------------------------------------------------------------
+int remove_entry(const char* path, const struct stat*, int, struct FTW*) {
+    return remove(path);
+}
+
+//-----------------------------------------------------------------------------
+// Ctor
+//
+// Creates the home with owner-only permissions (as GnuPG insists on) and
+// points GNUPGHOME to it before any GPGME context is made.
+//-----------------------------------------------------------------------------
+Test_Keyring::Test_Keyring()
+    throw (runtime_error)
+
+    : m_had_home(getenv("GNUPGHOME") != NULL) {
+
+    if (m_had_home) {
+        m_saved_home = getenv("GNUPGHOME");
+    }
+    char dir[] = "/tmp/recap-gnupg-XXXXXX";
+    if (!mkdtemp(dir)) {
+        throw runtime_error(string("Failed to create the test keyring: ") +
+                            strerror(errno));
+    }
+    m_home = dir;
+    setenv("GNUPGHOME", m_home.c_str(), 1);
+
+    try {
+        generate_key();
+    }
+    catch (const exception&) {
+        remove_home();
+        throw;
+    }
+}
+
+//-----------------------------------------------------------------------------
+// Dtor
+//-----------------------------------------------------------------------------
+Test_Keyring::~Test_Keyring() {
+    remove_home();
+}
+
+//-----------------------------------------------------------------------------
+// Generates the primary key and then the encryption subkey; elliptic curve
+// keys are made in milliseconds, where RSA ones may take seconds.
+//-----------------------------------------------------------------------------
+void Test_Keyring::generate_key()
+    throw (runtime_error) {
+
+    gpgme_check_version(NULL);
+
+    gpgme_ctx_t context = 0;
+    gpgme_key_t key = 0;
+    gpgme_error_t error = gpgme_new(&context);
+    const char* failed = "Failed to create a GPGME context";
+
+    if (!error) {
+        failed = "Failed to generate the test key";
+        error = gpgme_op_createkey(context, TEST_KEY_UID, "ed25519", 0, 0,
+                                   NULL, GPGME_CREATE_SIGN |
+                                         GPGME_CREATE_NOPASSWD |
+                                         GPGME_CREATE_NOEXPIRE);
+    }
+    if (!error) {
+        m_fingerprint = gpgme_op_genkey_result(context)->fpr;
+        error = gpgme_get_key(context, m_fingerprint.c_str(), &key, 1);
+    }
+    if (!error) {
+        failed = "Failed to generate the test encryption subkey";
+        error = gpgme_op_createsubkey(context, key, "cv25519", 0, 0,
+                                      GPGME_CREATE_ENCR |
+                                      GPGME_CREATE_NOPASSWD |
+                                      GPGME_CREATE_NOEXPIRE);
+    }
+    if (key) {
+        gpgme_key_release(key);
+    }
+    if (context) {
+        gpgme_release(context);
+    }
+    if (error) {
+        throw runtime_error(string(failed) + ": " + gpgme_strerror(error));
+    }
+}
+
+//-----------------------------------------------------------------------------
+// The agent started for the home is stopped first, so that it does not
+// linger holding the key (and its socket in the directory).
+//-----------------------------------------------------------------------------
+void Test_Keyring::remove_home() {
+    string kill = "gpgconf --homedir '" + m_home + "' --kill all "
+                  ">/dev/null 2>&1";
+    if (system(kill.c_str()) == -1) {
+        perror("Failed to stop the test keyring agent");
+    }
+    nftw(m_home.c_str(), remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+
+    if (m_had_home) {
+        setenv("GNUPGHOME", m_saved_home.c_str(), 1);
+    }
+    else {
+        unsetenv("GNUPGHOME");
+    }
+}
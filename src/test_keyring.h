@@ -0,0 +1,47 @@
+#ifndef TEST_KEYRING_H
+#define TEST_KEYRING_H
+//-----------------------------------------------------------------------------
+#include <stdexcept>
+#include <string>
+//-----------------------------------------------------------------------------
+
+//-----------------------------------------------------------------------------
+// A throwaway GnuPG home holding one key without a passphrase, so that tests
+// and benchmarks neither depend on nor touch the keyring of the user running
+// them. GNUPGHOME points to it while the object lives: GPGME_Wrappers must be
+// created after the keyring and destroyed before it.
+//-----------------------------------------------------------------------------
+class Test_Keyring {
+
+    public:
+
+        //---------------------------------------------------------------------
+        // @post   A temporary GnuPG home exists with an ed25519 signing key
+        //         and a cv25519 encryption subkey, and GNUPGHOME is set to it.
+        // @throw  If the directory or the key cannot be created.
+        //---------------------------------------------------------------------
+        Test_Keyring()
+            throw (std::runtime_error);
+
+        //---------------------------------------------------------------------
+        // @post   The GnuPG daemons of the home are stopped, the directory is
+        //         removed and GNUPGHOME is restored.
+        //---------------------------------------------------------------------
+        ~Test_Keyring();
+
+        const std::string& home() const        { return m_home; }
+        const std::string& fingerprint() const { return m_fingerprint; }
+
+    private:
+        Test_Keyring(const Test_Keyring&);
+        Test_Keyring& operator=(const Test_Keyring&);
+
+        void generate_key() throw (std::runtime_error);
+        void remove_home();
+
+        std::string m_home;
+        std::string m_fingerprint;
+        std::string m_saved_home;       // GNUPGHOME before, if it was set
+        bool        m_had_home;
+};
+#endif
@@ -1,16 +1,54 @@
 #include "sqlite3_serializer.h"
+#include "query.h"
+#include "clock.h"
 #include <string.h>
+#include <stdlib.h>
+#include <ctype.h>
 #include <string>
 #include <iostream>
+#include <sstream>
 #include <vector>
+#include <map>
 using namespace std;
 
+//------------------------------------------------------------------------------
+// A pipeline command: named string fields, multi-valued for tag lists.
+//------------------------------------------------------------------------------
+typedef map<string, vector<string> > Fields;
+
+//------------------------------------------------------------------------------
+// The outcome of a pipeline command. members holds the extra JSON members of
+// the result (with leading commas); wrote is set by execute().
+//------------------------------------------------------------------------------
+struct Result {
+    size_t  line;
+    string  cmd;
+    bool    ok;
+    bool    wrote;
+    string  error;
+    int64_t usec;
+    string  members;
+};
+
 //------------------------------------------------------------------------------
 // Prototypes
 //------------------------------------------------------------------------------
 void usage(char** argv);
 void cleanup(vector<Item*>& items);
+void print_items(const vector<Item*>& items);
 void parse_tags(const char* in_tags, vector<string>& out_list);
+int  pipeline(SQLite3_Serializer& sr, size_t batch_size);
+void end_batch(SQLite3_Serializer& sr, vector<Result>& batch, bool commit,
+               size_t& batches, size_t& failed);
+void write_results(const vector<Result>& results, size_t& failed);
+void parse_command(const string& line, Fields& fields);
+void parse_json(const string& line, Fields& fields);
+void split_words(const string& line, vector<string>& words);
+void execute(SQLite3_Serializer& sr, Fields& fields, bool& wrote,
+             ostream& result);
+string field(Fields& fields, const char* name);
+string json_str(const string& str);
+void json_items(const vector<Item*>& items, ostream& out);
 
 //------------------------------------------------------------------------------
 // Main function
@@ -18,7 +56,8 @@ void parse_tags(const char* in_tags, vector<string>& out_list);
 int main(int argc, char** argv) {
     if (argc < 3 || (strcmp(argv[2], "-c") && 
                      strcmp(argv[2], "-u") &&
-                     strcmp(argv[2], "-r") && strcmp(argv[2], "-t"))) {
+                     strcmp(argv[2], "-r") && strcmp(argv[2], "-t") &&
+                     strcmp(argv[2], "-q") && strcmp(argv[2], "-p"))) {
         usage(argv);
         return 1;
     }
@@ -26,9 +65,19 @@ int main(int argc, char** argv) {
     vector<Item*> items;
     vector<string> tags;
     try {
-        Serializer* sr = new SQLite3_Serializer(argv[1]);
+        SQLite3_Serializer* sr = new SQLite3_Serializer(argv[1]);
 
-        if (strcmp(argv[2], "-t") == 0) {
+        if (strcmp(argv[2], "-p") == 0) {
+            if (argc > 4) {
+                usage(argv);
+                return 1;
+            }
+            int batch_size = argc == 4 ? atoi(argv[3]) : 1;
+            int rv = pipeline(*sr, batch_size > 0 ? batch_size : 1);
+            delete sr;
+            return rv;
+        }
+        else if (strcmp(argv[2], "-t") == 0) {
             sr->tags(tags);
             cout << "---Tags---" << endl;
             for (size_t i = 0; i < tags.size(); ++i) {
@@ -42,12 +91,12 @@ int main(int argc, char** argv) {
             }
             parse_tags(argv[5], tags);
 
-            Item record = {
-                0,
-                argv[3],
-                argv[4],
-                tags
-            };
+            Item record;
+            record.id        = 0;
+            record.encrypted = false;
+            record.title     = argv[3];
+            record.content   = argv[4];
+            record.tags      = tags;
             sr->write(record);
         }
         else if (strcmp(argv[2], "-r") == 0) {
@@ -57,46 +106,27 @@ int main(int argc, char** argv) {
             }
             parse_tags(argv[3], tags);
             sr->read(tags, items);
-
-            if (items.empty()) {
-                cout << "No results found" << endl;
-            }
-            else {
-                cout << "|Title\t|Content\t|Tags\t|" << endl;
-                for (size_t i = 0; i < items.size(); ++i) {
-                    cout << "|" << items[i]->title << "\t|" 
-                         << items[i]->content << "\t|";
-
-                    for (size_t j = 0; j < items[i]->tags.size(); ++j) {
-                        cout << items[i]->tags[j];
-                        cout << (j + 1 == items[i]->tags.size() ? "|" : ", ");
-                    }
-                    cout << endl;
-                }
+            print_items(items);
+        }
+        else if (strcmp(argv[2], "-q") == 0) {
+            if (argc != 4) {
+                usage(argv);
+                return 1;
             }
+            sr->query(Query(argv[3]), items);
+            print_items(items);
         }
-        // Big dirty hack: The way this is going you probably want to knock up a unit
-        //                 test suite for the core (even though unit tests *suck*).
         else if (strcmp(argv[2], "-u") == 0) {
             if (argc != 7) {
                 usage(argv);
                 return 1;
             }
-            vector<string> all_tags;
-            sr->tags(all_tags);
-            sr->read(all_tags, items);
-
-            Item* the_item = 0;
-            for (size_t i = 0; i < items.size(); ++i) {
-                if (strcmp(items[i]->title.c_str(), argv[3]) == 0) {
-                    the_item = items[i];
-                    break;
-                }
-            }
-            if (!the_item) {
+            sr->find_by_title(argv[3], items);
+            if (items.empty()) {
                 cout << "The item was not found" << endl;
                 return 1;
             }
+            Item* the_item = items[0];
 
             parse_tags(argv[6], tags);
 
@@ -124,6 +154,27 @@ void cleanup(vector<Item*>& items) {
     }
 }
 
+//------------------------------------------------------------------------------
+// Display the items as a table
+//------------------------------------------------------------------------------
+void print_items(const vector<Item*>& items) {
+    if (items.empty()) {
+        cout << "No results found" << endl;
+        return;
+    }
+    cout << "|Title\t|Content\t|Tags\t|" << endl;
+    for (size_t i = 0; i < items.size(); ++i) {
+        cout << "|" << items[i]->title << "\t|" 
+             << items[i]->content << "\t|";
+
+        for (size_t j = 0; j < items[i]->tags.size(); ++j) {
+            cout << items[i]->tags[j];
+            cout << (j + 1 == items[i]->tags.size() ? "|" : ", ");
+        }
+        cout << endl;
+    }
+}
+
 //------------------------------------------------------------------------------
 // Display the usage string
 //------------------------------------------------------------------------------
@@ -131,7 +182,20 @@ void usage(char** argv) {
     cout << "Usage: " << argv[0] 
          << "\tDATABASE\n\t\t\t[ -c 'TITLE' 'CONTENT' 'TAG1, TAG2, ...] |\n'"
             "\t\t\t[ -r 'TAG1, TAG2, ...'] | \n\t\t\t[ -t ] | "
-            "\n\t\t\t[ -u 'OLD_TITLE' 'NEW_TITLE' 'NEW_CONTENT' 'TAG1, TAG2, ...'"
+            "\n\t\t\t[ -q '(TAG1 OR TAG2) AND NOT TAG3'] | "
+            "\n\t\t\t[ -u 'OLD_TITLE' 'NEW_TITLE' 'NEW_CONTENT' 'TAG1, TAG2, ...'] | "
+            "\n\t\t\t[ -p [BATCH_SIZE] ]"
+            "\n\nPipeline mode (-p) reads one command per line from stdin, either"
+            "\nas the options above without the dash and shell style quoting"
+            "\n(c 'TITLE' 'CONTENT' 'TAG1, TAG2') or as an NDJSON object:"
+            "\n  {\"cmd\":\"c\",\"title\":..,\"content\":..,\"tags\":[..]}"
+            "\n  {\"cmd\":\"u\",\"old_title\":..,\"title\":..,\"content\":..,"
+            "\"tags\":[..]}"
+            "\n  {\"cmd\":\"r\",\"tags\":[..]}  {\"cmd\":\"q\",\"query\":..}"
+            "  {\"cmd\":\"t\"}"
+            "\nOne NDJSON result with its timing in usec is written per command."
+            "\nBATCH_SIZE commands share a transaction; a failed write rolls its"
+            "\nbatch back."
          << endl;
 }
 
@@ -159,3 +223,487 @@ void parse_tags(const char* tagstr, vector<string>& out_tags) {
         out_tags.push_back(curr_tag);
     }
 }
+
+//------------------------------------------------------------------------------
+// Pipeline mode: execute the commands on stdin against the open connection,
+// batch_size commands per transaction, writing one NDJSON result per command,
+// one per batch and a final summary.
+//------------------------------------------------------------------------------
+int pipeline(SQLite3_Serializer& sr, size_t batch_size) {
+    vector<Result> batch;
+    size_t  line_no = 0, commands = 0, failed = 0, batches = 0;
+    int64_t started = epoch_usec();
+    string  line;
+
+    while (getline(cin, line)) {
+        ++line_no;
+        size_t first = line.find_first_not_of(" \t\r");
+        if (first == string::npos || line[first] == '#') {
+            continue;
+        }
+        // A command that fails before its batch is opened is written alone
+        bool open = batch_size == 1 || !batch.empty();
+
+        Result result;
+        result.line  = line_no;
+        result.ok    = true;
+        result.wrote = false;
+        Fields fields;
+        stringstream members;
+
+        int64_t start = epoch_usec();
+        try {
+            parse_command(line, fields);
+            result.cmd = field(fields, "cmd");
+            if (!open) {
+                sr.begin_batch();
+                open = true;
+            }
+            execute(sr, fields, result.wrote, members);
+        }
+        catch (const exception& e) {
+            result.ok    = false;
+            result.error = e.what();
+            if (!fields["cmd"].empty()) {
+                result.cmd = fields["cmd"][0];
+            }
+        }
+        result.usec    = epoch_usec() - start;
+        result.members = members.str();
+        batch.push_back(result);
+        ++commands;
+
+        if (batch_size == 1 || !open) {
+            write_results(batch, failed);
+            batch.clear();
+        }
+        // A failed write is undone alone, but a batch commits all of its
+        // writes or none; the reads before it stand
+        else if (!result.ok && result.wrote) {
+            stringstream reason;
+            reason << "Rolled back with line " << line_no;
+            for (size_t i = 0; i + 1 < batch.size(); ++i) {
+                if (batch[i].ok && batch[i].wrote) {
+                    batch[i].ok      = false;
+                    batch[i].error   = reason.str();
+                    batch[i].members = "";
+                }
+            }
+            end_batch(sr, batch, false, batches, failed);
+        }
+        else if (batch.size() == batch_size) {
+            end_batch(sr, batch, true, batches, failed);
+        }
+    }
+    if (!batch.empty()) {
+        end_batch(sr, batch, true, batches, failed);
+    }
+    cout << "{\"commands\":" << commands
+         << ",\"failed\":" << failed
+         << ",\"usec\":" << epoch_usec() - started << "}" << endl;
+    return failed ? 1 : 0;
+}
+
+//------------------------------------------------------------------------------
+// Commit the batch, or roll it back, and write its results. A batch that fails
+// to commit is rolled back by commit_batch(), failing all of its commands.
+//------------------------------------------------------------------------------
+void end_batch(SQLite3_Serializer& sr, vector<Result>& batch, bool commit,
+               size_t& batches, size_t& failed) {
+    int64_t start = epoch_usec();
+    try {
+        if (commit) {
+            sr.commit_batch();
+        }
+        else {
+            sr.rollback_batch();
+        }
+    }
+    catch (const exception& e) {
+        for (size_t i = 0; i < batch.size(); ++i) {
+            if (commit || batch[i].ok) {
+                batch[i].ok      = false;
+                batch[i].error   = e.what();
+                batch[i].members = "";
+            }
+        }
+        commit = false;
+    }
+    write_results(batch, failed);
+    cout << "{\"batch\":" << ++batches
+         << ",\"commands\":" << batch.size()
+         << ",\"committed\":" << (commit ? "true" : "false")
+         << ",\"commit_usec\":" << epoch_usec() - start << "}" << endl;
+    batch.clear();
+}
+
+//------------------------------------------------------------------------------
+// Write one NDJSON line per result.
+//------------------------------------------------------------------------------
+void write_results(const vector<Result>& results, size_t& failed) {
+    for (size_t i = 0; i < results.size(); ++i) {
+        const Result& r = results[i];
+        cout << "{\"line\":" << r.line
+             << ",\"cmd\":"  << json_str(r.cmd)
+             << ",\"ok\":"   << (r.ok ? "true" : "false")
+             << ",\"usec\":" << r.usec;
+        if (!r.ok) {
+            cout << ",\"error\":" << json_str(r.error);
+            ++failed;
+        }
+        cout << r.members << "}\n";
+    }
+    cout.flush();
+}
+
+//------------------------------------------------------------------------------
+// Execute one parsed command. wrote is set once the Serializer is asked to
+// write, after which a failure may have changed the database.
+//------------------------------------------------------------------------------
+void execute(SQLite3_Serializer& sr, Fields& fields, bool& wrote,
+             ostream& result) {
+    string cmd = field(fields, "cmd");
+    vector<Item*> items;
+    try {
+        if (cmd == "t") {
+            vector<string> tags;
+            sr.tags(tags);
+            result << ",\"tags\":[";
+            for (size_t i = 0; i < tags.size(); ++i) {
+                result << (i ? "," : "") << json_str(tags[i]);
+            }
+            result << "]";
+        }
+        else if (cmd == "c") {
+            Item record;
+            record.id        = 0;
+            record.encrypted = false;
+            record.title     = field(fields, "title");
+            record.content   = field(fields, "content");
+            record.tags      = fields["tags"];
+            wrote = true;
+            sr.write(record);
+            result << ",\"id\":" << record.id;
+        }
+        else if (cmd == "r") {
+            sr.read(fields["tags"], items);
+            json_items(items, result);
+        }
+        else if (cmd == "q") {
+            sr.query(Query(field(fields, "query")), items);
+            json_items(items, result);
+        }
+        else if (cmd == "u") {
+            sr.find_by_title(field(fields, "old_title"), items);
+            if (items.empty()) {
+                throw runtime_error("The item was not found");
+            }
+            Item& record = *items[0];
+            record.title   = field(fields, "title");
+            record.content = field(fields, "content");
+            record.tags    = fields["tags"];
+            wrote = true;
+            sr.write(record);
+            result << ",\"id\":" << record.id;
+        }
+        else {
+            throw runtime_error("Unknown command: " + cmd);
+        }
+    }
+    catch (...) {
+        cleanup(items);
+        throw;
+    }
+    cleanup(items);
+}
+
+//------------------------------------------------------------------------------
+// @return The first value of the named field.
+// @throw  If the field is missing.
+//------------------------------------------------------------------------------
+string field(Fields& fields, const char* name) {
+    Fields::const_iterator it = fields.find(name);
+    if (it == fields.end() || it->second.empty()) {
+        throw runtime_error(string("Missing field: ") + name);
+    }
+    return it->second[0];
+}
+
+//------------------------------------------------------------------------------
+// Parse a pipeline line: an NDJSON object, or a command letter (with or without
+// the leading dash) followed by the arguments of the matching option.
+//------------------------------------------------------------------------------
+void parse_command(const string& line, Fields& fields) {
+    if (line[line.find_first_not_of(" \t")] == '{') {
+        parse_json(line, fields);
+        return;
+    }
+    vector<string> words;
+    split_words(line, words);
+    if (words.empty() || words[0].empty()) {
+        throw runtime_error("Missing command");
+    }
+
+    string cmd = words[0][0] == '-' ? words[0].substr(1) : words[0];
+    fields["cmd"].push_back(cmd);
+    const char* names[4] = { 0, 0, 0, 0 };
+    size_t count = 0;
+    if (cmd == "c") {
+        names[0] = "title"; names[1] = "content"; names[2] = "tags";
+        count = 3;
+    }
+    else if (cmd == "r") {
+        names[0] = "tags";
+        count = 1;
+    }
+    else if (cmd == "q") {
+        names[0] = "query";
+        count = 1;
+    }
+    else if (cmd == "u") {
+        names[0] = "old_title"; names[1] = "title"; names[2] = "content";
+        names[3] = "tags";
+        count = 4;
+    }
+    else if (cmd != "t") {
+        throw runtime_error("Unknown command: " + cmd);
+    }
+    if (words.size() != count + 1) {
+        throw runtime_error("Wrong number of arguments for " + cmd);
+    }
+    for (size_t i = 0; i < count; ++i) {
+        if (strcmp(names[i], "tags") == 0) {
+            parse_tags(words[i + 1].c_str(), fields["tags"]);
+        }
+        else {
+            fields[names[i]].push_back(words[i + 1]);
+        }
+    }
+}
+
+//------------------------------------------------------------------------------
+// Split a line into words at white space, honouring single and double quotes
+// and backslash escapes the way a shell does.
+//------------------------------------------------------------------------------
+void split_words(const string& line, vector<string>& words) {
+    string word;
+    bool in_word = false;
+    char quote = 0;
+    for (size_t i = 0; i < line.size(); ++i) {
+        char c = line[i];
+        if (quote) {
+            if (c == quote) {
+                quote = 0;
+            }
+            else if (c == '\\' && quote == '"' && i + 1 < line.size()) {
+                word += line[++i];
+            }
+            else {
+                word += c;
+            }
+        }
+        else if (c == '\'' || c == '"') {
+            quote = c;
+            in_word = true;
+        }
+        else if (c == '\\' && i + 1 < line.size()) {
+            word += line[++i];
+            in_word = true;
+        }
+        else if (c == ' ' || c == '\t' || c == '\r') {
+            if (in_word) {
+                words.push_back(word);
+                word.clear();
+                in_word = false;
+            }
+        }
+        else {
+            word += c;
+            in_word = true;
+        }
+    }
+    if (quote) {
+        throw runtime_error("Unterminated quote");
+    }
+    if (in_word) {
+        words.push_back(word);
+    }
+}
+
+//------------------------------------------------------------------------------
+// Scanner for the flat JSON objects accepted by the pipeline mode.
+//------------------------------------------------------------------------------
+class Json_Scanner {
+
+    public:
+        explicit Json_Scanner(const string& text) : m_text(text), m_pos(0) {}
+
+        bool at_end() {
+            skip();
+            return m_pos == m_text.size();
+        }
+
+        void skip() {
+            while (m_pos < m_text.size() &&
+                   isspace(static_cast<unsigned char>(m_text[m_pos]))) {
+                ++m_pos;
+            }
+        }
+        bool accept(char c) {
+            skip();
+            if (m_pos < m_text.size() && m_text[m_pos] == c) {
+                ++m_pos;
+                return true;
+            }
+            return false;
+        }
+        void expect(char c) {
+            if (!accept(c)) {
+                throw runtime_error(string("Invalid JSON: expected ") + c);
+            }
+        }
+        string str() {
+            expect('"');
+            string rv;
+            while (m_pos < m_text.size() && m_text[m_pos] != '"') {
+                char c = m_text[m_pos++];
+                if (c != '\\') {
+                    rv += c;
+                    continue;
+                }
+                if (m_pos == m_text.size()) {
+                    break;
+                }
+                c = m_text[m_pos++];
+                switch (c) {
+                    case 'n': rv += '\n'; break;
+                    case 't': rv += '\t'; break;
+                    case 'r': rv += '\r'; break;
+                    case 'b': rv += '\b'; break;
+                    case 'f': rv += '\f'; break;
+                    case 'u': {
+                        unsigned code = strtoul(
+                            m_text.substr(m_pos, 4).c_str(), 0, 16);
+                        m_pos += 4;
+                        if (code < 0x80) {
+                            rv += char(code);
+                        }
+                        else if (code < 0x800) {
+                            rv += char(0xC0 | (code >> 6));
+                            rv += char(0x80 | (code & 0x3F));
+                        }
+                        else {
+                            rv += char(0xE0 | (code >> 12));
+                            rv += char(0x80 | ((code >> 6) & 0x3F));
+                            rv += char(0x80 | (code & 0x3F));
+                        }
+                        break;
+                    }
+                    default:  rv += c;
+                }
+            }
+            expect('"');
+            return rv;
+        }
+        string scalar() {
+            skip();
+            if (m_pos < m_text.size() && m_text[m_pos] == '"') {
+                return str();
+            }
+            size_t end = m_text.find_first_of(",}] \t", m_pos);
+            if (end == string::npos || end == m_pos) {
+                throw runtime_error("Invalid JSON value");
+            }
+            string rv = m_text.substr(m_pos, end - m_pos);
+            m_pos = end;
+            return rv;
+        }
+
+    private:
+        const string& m_text;
+        size_t        m_pos;
+};
+
+//------------------------------------------------------------------------------
+// Parse a flat JSON object whose values are strings, numbers, booleans or
+// arrays of strings. A "tags" string is split like the -c argument.
+//------------------------------------------------------------------------------
+void parse_json(const string& line, Fields& fields) {
+    Json_Scanner scan(line);
+
+    scan.expect('{');
+    if (!scan.accept('}')) {
+        do {
+            string name = scan.str();
+            scan.expect(':');
+            vector<string>& values = fields[name];
+            if (scan.accept('[')) {
+                if (!scan.accept(']')) {
+                    do {
+                        values.push_back(scan.str());
+                    } while (scan.accept(','));
+                    scan.expect(']');
+                }
+            }
+            else if (name == "tags") {
+                parse_tags(scan.str().c_str(), values);
+            }
+            else {
+                values.push_back(scan.scalar());
+            }
+        } while (scan.accept(','));
+        scan.expect('}');
+    }
+    if (!scan.at_end()) {
+        throw runtime_error("Invalid JSON: trailing characters");
+    }
+}
+
+//------------------------------------------------------------------------------
+// @return The string as a quoted JSON string.
+//------------------------------------------------------------------------------
+string json_str(const string& str) {
+    static const char* HEX = "0123456789abcdef";
+    string rv = "\"";
+    for (size_t i = 0; i < str.size(); ++i) {
+        unsigned char c = str[i];
+        switch (c) {
+            case '"':  rv += "\\\""; break;
+            case '\\': rv += "\\\\"; break;
+            case '\n': rv += "\\n";  break;
+            case '\r': rv += "\\r";  break;
+            case '\t': rv += "\\t";  break;
+            default:
+                if (c < 0x20) {
+                    rv += "\\u00";
+                    rv += HEX[c >> 4];
+                    rv += HEX[c & 0xF];
+                }
+                else {
+                    rv += c;
+                }
+        }
+    }
+    return rv + "\"";
+}
+
+//------------------------------------------------------------------------------
+// Write the items as the JSON member "items".
+//------------------------------------------------------------------------------
+void json_items(const vector<Item*>& items, ostream& out) {
+    out << ",\"items\":[";
+    for (size_t i = 0; i < items.size(); ++i) {
+        const Item& item = *items[i];
+        out << (i ? "," : "")
+            << "{\"id\":"       << item.id
+            << ",\"title\":"    << json_str(item.title)
+            << ",\"content\":"  << json_str(item.content)
+            << ",\"timestamp\":" << item.timestamp
+            << ",\"tags\":[";
+        for (size_t j = 0; j < item.tags.size(); ++j) {
+            out << (j ? "," : "") << json_str(item.tags[j]);
+        }
+        out << "]}";
+    }
+    out << "]";
+}
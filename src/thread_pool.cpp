@@ -0,0 +1,116 @@
+#include "thread_pool.h"
+using namespace std;
+
+//------------------------------------------------------------------------------
+// Ctor: Starts the workers.
+//------------------------------------------------------------------------------
+Thread_Pool::Thread_Pool(size_t threads)
+    throw(runtime_error) : m_stop(false) {
+
+    pthread_mutex_init(&m_mutex, NULL);
+    pthread_cond_init(&m_work, NULL);
+    pthread_cond_init(&m_done, NULL);
+
+    for (size_t i = 0; i < (threads ? threads : 1); ++i) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, &Thread_Pool::worker, this) != 0) {
+            shutdown();
+            throw runtime_error("Failed to start a worker thread");
+        }
+        m_threads.push_back(thread);
+    }
+}
+
+//------------------------------------------------------------------------------
+// Dtor
+//------------------------------------------------------------------------------
+Thread_Pool::~Thread_Pool() {
+    shutdown();
+}
+
+//------------------------------------------------------------------------------
+// Lets the workers drain the queue, then joins them and releases the
+// synchronisation primitives.
+//------------------------------------------------------------------------------
+void Thread_Pool::shutdown() {
+    {
+        Mutex_Lock lock(m_mutex);
+        m_stop = true;
+        pthread_cond_broadcast(&m_work);
+    }
+    for (size_t i = 0; i < m_threads.size(); ++i) {
+        pthread_join(m_threads[i], NULL);
+    }
+    m_threads.clear();
+    pthread_cond_destroy(&m_done);
+    pthread_cond_destroy(&m_work);
+    pthread_mutex_destroy(&m_mutex);
+}
+
+//------------------------------------------------------------------------------
+// Queues the tasks as one batch and waits for the batch to finish.
+//------------------------------------------------------------------------------
+void Thread_Pool::run(const vector<Task*>& tasks)
+    throw(runtime_error) {
+
+    Batch batch;
+    batch.pending = tasks.size();
+    batch.failed  = false;
+
+    Mutex_Lock lock(m_mutex);
+    for (size_t i = 0; i < tasks.size(); ++i) {
+        Job job = { tasks[i], &batch };
+        m_jobs.push_back(job);
+    }
+    pthread_cond_broadcast(&m_work);
+
+    while (batch.pending > 0) {
+        pthread_cond_wait(&m_done, &m_mutex);
+    }
+    if (batch.failed) {
+        throw runtime_error(batch.error);
+    }
+}
+
+//------------------------------------------------------------------------------
+// Worker loop: runs queued jobs until the pool stops and the queue is empty.
+//------------------------------------------------------------------------------
+void* Thread_Pool::worker(void* arg) {
+    Thread_Pool& pool = *static_cast<Thread_Pool*>(arg);
+
+    Mutex_Lock lock(pool.m_mutex);
+    for (;;) {
+        while (pool.m_jobs.empty() && !pool.m_stop) {
+            pthread_cond_wait(&pool.m_work, &pool.m_mutex);
+        }
+        if (pool.m_jobs.empty()) {
+            return NULL;
+        }
+        Job job = pool.m_jobs.front();
+        pool.m_jobs.pop_front();
+
+        string error;
+        bool failed = false;
+        pthread_mutex_unlock(&pool.m_mutex);
+        try {
+            job.task->run();
+        }
+        catch (const exception& e) {
+            failed = true;
+            error  = e.what();
+        }
+        catch (...) {
+            failed = true;
+            error  = "Unknown error in worker thread";
+        }
+        pthread_mutex_lock(&pool.m_mutex);
+
+        if (failed && !job.batch->failed) {
+            job.batch->failed = true;
+            job.batch->error  = error;
+        }
+        if (--job.batch->pending == 0) {
+            pthread_cond_broadcast(&pool.m_done);
+        }
+    }
+}
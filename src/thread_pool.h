@@ -0,0 +1,95 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <deque>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <pthread.h>
+
+//------------------------------------------------------------------------------
+// Scoped lock of a pthread mutex.
+//------------------------------------------------------------------------------
+class Mutex_Lock {
+
+    public:
+        explicit Mutex_Lock(pthread_mutex_t& mutex) : m_mutex(mutex) {
+            pthread_mutex_lock(&m_mutex);
+        }
+        ~Mutex_Lock() {
+            pthread_mutex_unlock(&m_mutex);
+        }
+
+    private:
+        Mutex_Lock(const Mutex_Lock&);
+        Mutex_Lock& operator=(const Mutex_Lock&);
+
+        pthread_mutex_t& m_mutex;
+};
+
+//------------------------------------------------------------------------------
+// Fixed size pool of worker threads running batches of tasks. Several threads
+// may run batches on the same pool at once.
+//------------------------------------------------------------------------------
+class Thread_Pool {
+
+    public:
+
+        //----------------------------------------------------------------------
+        // A unit of work. Exceptions thrown by run() are caught by the pool
+        // and reported by Thread_Pool::run().
+        //----------------------------------------------------------------------
+        class Task {
+            public:
+                virtual ~Task() {}
+                virtual void run() = 0;
+        };
+
+        //----------------------------------------------------------------------
+        // @param threads The number of worker threads (at least one).
+        // @throw If the threads cannot be started.
+        //----------------------------------------------------------------------
+        explicit Thread_Pool(size_t threads)
+            throw(std::runtime_error);
+
+        //----------------------------------------------------------------------
+        // @post Queued tasks are finished and the workers are joined.
+        //----------------------------------------------------------------------
+        ~Thread_Pool();
+
+        //----------------------------------------------------------------------
+        // @param tasks The tasks to run; they are not owned by the pool.
+        // @post  All tasks have run, in parallel where workers are free.
+        // @throw The first error thrown by a task, once all tasks have run.
+        //----------------------------------------------------------------------
+        void run(const std::vector<Task*>& tasks)
+            throw(std::runtime_error);
+
+        size_t size() const { return m_threads.size(); }
+
+    private:
+        struct Batch {
+            size_t      pending;
+            bool        failed;
+            std::string error;
+        };
+        struct Job {
+            Task*  task;
+            Batch* batch;
+        };
+
+        Thread_Pool(const Thread_Pool&);
+        Thread_Pool& operator=(const Thread_Pool&);
+
+        static void* worker(void*);
+        void shutdown();
+
+        pthread_mutex_t        m_mutex;
+        pthread_cond_t         m_work;      // Signalled when jobs are queued
+        pthread_cond_t         m_done;      // Signalled when a batch finishes
+        std::deque<Job>        m_jobs;
+        bool                   m_stop;
+        std::vector<pthread_t> m_threads;
+};
+
+#endif